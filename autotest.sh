@@ -18,9 +18,10 @@ kill_rbtraced()
     fi
 }
 
+# start_rbtraced [rbtraced options]
 start_rbtraced()
 {
-    ./rbtraced -d
+    ./rbtraced -d $@
     # sleep a while for rbtraced to get ready
     sleep 2
     _pid=$(pidof rbtraced)
@@ -38,15 +39,26 @@ rbtrace_config()
     fi
 }
 
-# open_trace_file <filename>
+# restart_rbtraced [rbtraced options]
+restart_rbtraced()
+{
+    kill_rbtraced
+    sleep 1
+    start_rbtraced $@
+    rbtrace_config
+}
+
+# open_trace_file <filename> [rbt options]
 open_trace_file()
 {
-    ./rbt -o $1 -w on -s 32
+    _file=$1
+    shift
+    ./rbt -o $_file -w on -s 32 $@
     if [ $? -ne 0 ]; then
         die "rbt open trace file failed"
     fi
     sleep 1
-    if [ ! -r $1 ]; then
+    if [ ! -r $_file ]; then
         die "trace file not generated"
     fi
 }
@@ -74,7 +86,89 @@ parse_trace_file()
     rm -f $1.txt
 }
 
+# check_jobs <filename>, records formatted on several threads must come
+# out just like when formatted on one
+check_jobs()
+{
+    ./prbt -f $1 -o $1.txt
+    ./prbt -f $1 -o $1.jobs.txt -j 4
+    cmp -s $1.txt $1.jobs.txt
+    if [ $? -ne 0 ]; then
+        die "prbt -j output differs"
+    fi
+    rm -f $1.txt $1.jobs.txt
+}
+
+# count_trace_file <filename> [prbt options]
+count_trace_file()
+{
+    _file=$1
+    shift
+    ./prbt -f $_file "$@" | egrep "TEST|NULL" | wc -l
+}
+
+# seek_round <filename> <codec>, trace two bursts of records seconds
+# apart and check prbt -e and -s split the file between them
+seek_round()
+{
+    open_trace_file $1 -E $2
+
+    ./rbtbench -p 1 -t 1 -n 3000
+    if [ $? -ne 0 ]; then
+        die "rbtbench failed"
+    fi
+    sleep 2
+    _mid=$(date "+%Y-%m-%d %H:%M:%S")
+    sleep 2
+    ./rbtbench -p 1 -t 1 -n 1000
+    if [ $? -ne 0 ]; then
+        die "rbtbench failed"
+    fi
+
+    close_trace_file
+
+    _total=$(count_trace_file $1)
+    _before=$(count_trace_file $1 -e "$_mid")
+    _after=$(count_trace_file $1 -s "$_mid")
+    if [ $_total -ne 8000 ] || [ $_before -ne 6000 ] ||
+       [ $(( _before + _after )) -ne $_total ]; then
+        die "prbt -s/-e inconsistent($_before+$_after:$_total)"
+    fi
+
+    rm -f "$1"
+}
+
+# trace_round <filename> [rbt options], trace with rbtbench into a new
+# trace file and check all records are in it
+trace_round()
+{
+    open_trace_file $@
+
+    ./rbt -i
+    if [ $? -ne 0 ]; then
+        die "rbt info failed"
+    fi
+
+    # Start trace benchmark
+    ./rbtbench -p 1 -t 1 -n 65538
+    if [ $? -ne 0 ]; then
+        die "rbtbench failed"
+    fi
+
+    # Close and flush trace file
+    close_trace_file
+
+    # Parse trace file, raw files are formatted in chunks of records
+    # and coded ones a block at a time with -j
+    check_jobs $1
+    parse_trace_file $1 131076
+
+    rm -f "$1"
+    rm -f "$1.txt"
+}
+
 ulimit -c unlimited
+use_current=0
 
 case "$1" in
     "-h")
@@ -83,6 +177,7 @@ case "$1" in
     "-N")
 	# close trace file if there is any
 	close_trace_file
+	use_current=1
 	;;
     *)
 	# by default kill old rbtraced and start a new one
@@ -102,30 +197,65 @@ rm -f $TRACE_FILE_NAME.txt
 i=0
 while [ $i -lt $TEST_ROUND ]
 do
-    open_trace_file $TRACE_FILE_NAME
+    trace_round $TRACE_FILE_NAME
+    (( i++ ))
+done
 
-    ./rbt -i
-    if [ $? -ne 0 ]; then
-        die "rbt info failed"
-    fi
+# Coded trace files
+for codec in delta lz
+do
+    trace_round $TRACE_FILE_NAME -E $codec
+done
+./rbt -E none
 
-    # Start trace benchmark
-    ./rbtbench -p 1 -t 1 -n 65538
-    if [ $? -ne 0 ]; then
-        die "rbtbench failed"
-    fi
+# Records before and after a time, binary searched in raw files and
+# looked up in the block index of coded files
+for codec in none delta
+do
+    seek_round $TRACE_FILE_NAME $codec
+done
+./rbt -E none
 
-    # Close and flush trace file
-    close_trace_file
+# Rounds with other daemon options, the current rbtraced is kept
+if [ $use_current -eq 0 ]; then
+    # Per-CPU sub-rings
+    restart_rbtraced -c
+    trace_round $TRACE_FILE_NAME
 
-    # Parse trace file
-    parse_trace_file $TRACE_FILE_NAME 131076
+    # Compact entries on the io ring
+    restart_rbtraced -r io:65536:compact
+    trace_round $TRACE_FILE_NAME
 
-    rm -f "$TRACE_FILE_NAME"
-    rm -f "$TRACE_FILE_NAME.txt"
+    restart_rbtraced
+fi
 
-    (( i++ ))
-done
+# Flight recorder ring, the snapshot holds all records as they fit in
+# its buffers
+./rbt -F on
+if [ $? -ne 0 ]; then
+    die "rbt flight recorder on failed"
+fi
+./rbtbench -p 1 -t 1 -n 65538
+if [ $? -ne 0 ]; then
+    die "rbtbench failed"
+fi
+./rbt -P $TRACE_FILE_NAME
+if [ $? -ne 0 ]; then
+    die "rbt snapshot failed"
+fi
+parse_trace_file $TRACE_FILE_NAME 131076
+rm -f $TRACE_FILE_NAME
+./rbt -F off
+if [ $? -ne 0 ]; then
+    die "rbt flight recorder off failed"
+fi
+
+# Staged records are published when the process dies of a fatal signal
+open_trace_file $TRACE_FILE_NAME
+./test_segfault -s
+close_trace_file
+parse_trace_file $TRACE_FILE_NAME 100000
+rm -f $TRACE_FILE_NAME core.*
 
 open_trace_file $TRACE_FILE_NAME
 
@@ -154,8 +284,5 @@ sleep 1
 if [ -e /dev/shm/rbtracebuf ]; then
     die "shared memory *not* cleaned"
 fi
-if [ -e /dev/shm/sem.rbtrace ]; then
-    die "semaphore *not* cleaned"
-fi
 
 echo "Autotest passed."
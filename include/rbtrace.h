@@ -8,9 +8,12 @@
 extern "C" {
 #endif
 
+/* Rings are configured when rbtraced starts, the io ring is always
+ * ring 0. Look up the ID of other rings with rbtrace_ring_find().
+ */
 typedef enum rbtrace_ring {
 	RBTRACE_RING_IO = 0,
-	RBTRACE_RING_MAX
+	RBTRACE_RING_MAX = 64
 } rbtrace_ring_t;
 
 /* ring buffer trace ID, should be less than 64
@@ -115,7 +118,37 @@ static char *tflags_to_str(uint64_t tflags)
 
 extern int rbtrace(rbtrace_ring_t ring, uint8_t traceid, uint64_t a0,
 		   uint64_t a1, uint64_t a2, uint64_t a3);
+/* Zero-copy tracing: reserve a record, fill its nr_args arguments
+ * in place and commit it. Uncommitted records are not flushed.
+ */
+extern uint64_t *rbtrace_reserve(rbtrace_ring_t ring, uint8_t traceid,
+				 int *nr_args);
+extern void rbtrace_commit(rbtrace_ring_t ring, uint64_t *args);
+/* A record of a batch, a2 and a3 are dropped by compact rings */
+struct rbtrace_rec {
+	uint8_t traceid;
+	uint64_t a0;
+	uint64_t a1;
+	uint64_t a2;
+	uint64_t a3;
+};
+
+/* Trace nr records with one slot claim, returns records traced */
+extern int rbtrace_batch(rbtrace_ring_t ring, int nr,
+			 const struct rbtrace_rec *recs);
+/* Stage records of the calling thread in a thread local buffer and
+ * publish them to the ring in chunks. Staged records are published
+ * when the buffer fills, periodically, at thread exit, rbtrace_exit()
+ * and, for the faulting thread only, on fatal signals.
+ */
+extern int rbtrace_stage_thread(int enable);
 extern int rbtrace_traffic_enabled(rbtrace_ring_t ring, uint8_t traceid);
+/* Start a capture of a flight recorder ring armed with rbt -T, returns
+ * -1 if the ring isn't armed
+ */
+extern int rbtrace_trigger(rbtrace_ring_t ring);
+/* ID of the ring configured with name, -1 if there is no such ring */
+extern int rbtrace_ring_find(const char *name);
 extern int rbtrace_init(void);
 extern void rbtrace_exit(void);
 
@@ -26,16 +26,86 @@ struct rbtrace_entry {
 	uint64_t a1;
 	uint64_t a2;
 	uint64_t a3;
-	struct timespec timestamp;
-	uint32_t cpuid:8;
-	uint32_t thread:18;
-	uint32_t traceid:6;
+	union {
+		struct timespec timestamp;
+		uint64_t tsc;	// TSC ticks if file has tsc_hz set
+	};
+	uint32_t thread;
+	uint16_t cpuid;
+	uint8_t traceid;
+	uint8_t commit;		// commit marker
 };
 
+/* Format of a v2 trace entry, timestamp is nanoseconds since epoch
+ * or TSC ticks and metadata is packed in one word
+ */
+struct rbtrace_entry_v2 {
+	uint64_t timestamp;
+	uint32_t thread;
+	uint16_t cpuid;
+	uint8_t traceid;
+	uint8_t commit;		// commit marker
+	uint64_t a0;
+	uint64_t a1;
+	uint64_t a2;
+	uint64_t a3;
+};
+
+/* Format of a compact v2 trace entry, only a0 and a1 are kept so
+ * that two entries fit in a cache line
+ */
+struct rbtrace_entry_compact {
+	uint64_t timestamp;
+	uint32_t thread;
+	uint16_t cpuid;
+	uint8_t traceid;
+	uint8_t commit;		// commit marker
+	uint64_t a0;
+	uint64_t a1;
+};
+
+/* The commit marker of an entry holds the generation of the buffer
+ * it was written to, with the pending bit set until it is committed
+ */
+#define RBTRACE_COMMIT_PENDING	(0x80)
+#define RBTRACE_COMMIT_GEN_MASK	(0x7F)
+
+STATIC_ASSERT(sizeof(struct rbtrace_entry_v2) == 48);
+STATIC_ASSERT(sizeof(struct rbtrace_entry_compact) == 32);
+
+/* Trace entry formats */
+typedef enum rbtrace_format {
+	RBTRACE_FMT_V1 = 0,	// struct rbtrace_entry
+	RBTRACE_FMT_V2,		// struct rbtrace_entry_v2
+	RBTRACE_FMT_COMPACT,	// struct rbtrace_entry_compact
+	RBTRACE_FMT_MAX,
+} rbtrace_format_t;
+
+static inline uint32_t rbtrace_entry_size(rbtrace_format_t format)
+{
+	switch (format) {
+	case RBTRACE_FMT_V2:
+		return sizeof(struct rbtrace_entry_v2);
+	case RBTRACE_FMT_COMPACT:
+		return sizeof(struct rbtrace_entry_compact);
+	default:
+		return sizeof(struct rbtrace_entry);
+	}
+}
+
 #define RBTRACE_FHEADER_MAGIC	"RBTRACE"
 
 #define RBTRACE_MAJOR	1
-#define RBTRACE_MINOR	0
+#define RBTRACE_MINOR	5
+
+/* Max number of TSC sync points in a trace file header */
+#define RBTRACE_MAX_TSC_SYNCS	8
+
+/* A TSC value and the realtime in nanoseconds sampled with it */
+struct rbtrace_tsc_sync {
+	uint64_t tsc;
+	uint64_t ns;
+};
 
 /* Format of a trace file header */
 struct rbtrace_fheader {
@@ -51,6 +121,16 @@ struct rbtrace_fheader {
 	uint32_t tz_off;        // Offset in file to time zone
 	uint32_t name_off;	// Offset in file to ring name
 	uint32_t desc_off;	// Offset in file to ring desc
+	uint32_t nr_subrings;	// Number of per-CPU sub-rings, since 1.1
+	uint32_t nr_tsc_syncs;	// Number of TSC sync points, since 1.2
+	uint64_t tsc_hz;	// TSC frequency, 0 if timestamps are realtime
+	struct rbtrace_tsc_sync tsc_syncs[RBTRACE_MAX_TSC_SYNCS];
+	uint32_t entry_format;	// Format of trace entries, since 1.4
+	uint32_t entry_size;	// Size of a trace entry
+	uint32_t codec;		// Codec of record blocks, since 1.5
+	uint32_t index_nr;	// Number of block index entries
+	uint64_t index_off;	// Offset in file to block index
+	uint64_t index_seg;	// Bytes of file an index entry covers
 };
 
 #define RBTRACE_FHEADER_SIZE	512
@@ -60,6 +140,78 @@ union padded_rbtrace_fheader {
 	char pad[RBTRACE_FHEADER_SIZE];
 };
 
+/* Codecs of trace files. Files with a codec hold a block per written
+ * buffer rather than raw trace entries.
+ */
+typedef enum rbtrace_codec {
+	RBTRACE_CODEC_NONE = 0,	// raw trace entries
+	RBTRACE_CODEC_RAW,	// blocks of raw trace entries
+	RBTRACE_CODEC_DELTA,	// delta coded timestamps, metadata and args
+	RBTRACE_CODEC_LZ,	// delta coded, then LZ compressed
+	RBTRACE_CODEC_MAX,
+} rbtrace_codec_t;
+
+#define RBTRACE_BLOCK_MAGIC	(0x4B4C4252)	// "RBLK"
+
+/* Blocks start 8 byte aligned */
+#define RBTRACE_BLOCK_ALIGN	(8)
+
+/* Flags of a block */
+#define RBTRACE_BLOCK_RAW	(1 << 0)	// payload is raw trace entries
+#define RBTRACE_BLOCK_LZ	(1 << 1)	// payload is LZ compressed
+
+/* Bits in the CPU and thread sets of a block */
+#define RBTRACE_ZONE_BITS	(256)
+
+/* Bit of a thread in the thread set of a block */
+static inline uint32_t rbtrace_zone_thread(uint32_t thread)
+{
+	return (thread * 2654435761U) >> 24;
+}
+
+/* Header of a block of records in a file with a codec. A wrapped file
+ * is read from the first intact block after the wrap position, blocks
+ * with a lower sequence than the one before are stale. Timestamps are
+ * TSC ticks or nanoseconds, like those of the records. The rest of the
+ * fields sum up the records that were written, so readers skip blocks
+ * that have none they look for.
+ */
+struct rbtrace_block {
+	uint32_t magic;		// RBTRACE_BLOCK_MAGIC
+	uint32_t seq;		// Sequence of the block in file
+	uint32_t nr_records;	// Number of records in the block
+	uint16_t flags;		// How the payload is coded
+	uint16_t subring;	// Sub-ring the records were written from
+	uint32_t size;		// Size of payload following the header
+	uint32_t coded_size;	// Size of payload before the LZ stage
+	uint64_t min_ts;	// Earliest timestamp of the records
+	uint64_t max_ts;	// Latest timestamp of the records
+	uint64_t tids;		// Trace IDs of the records, a bit each
+	uint64_t cpus[RBTRACE_ZONE_BITS / 64];// CPUs of the records
+	uint64_t threads[RBTRACE_ZONE_BITS / 64];// Threads, by their bit
+	uint64_t min_args[4];	// Least a0-a3 of the records
+	uint64_t max_args[4];	// Greatest a0-a3 of the records
+	uint32_t lap;		// Times the file wrapped before the block
+	uint32_t check;		// Check of the fields above
+};
+
+STATIC_ASSERT(sizeof(struct rbtrace_block) % RBTRACE_BLOCK_ALIGN == 0);
+
+/* Files with a codec are split into index_nr segments of index_seg
+ * bytes after the header, an index entry points to the first block
+ * written into its segment in the latest lap. Entries in sequence
+ * order have max_ts never going backwards, so the first block that
+ * may hold records after a time is found with a binary search.
+ */
+#define RBTRACE_INDEX_NR	(1024)
+
+struct rbtrace_index {
+	uint64_t off;		// Offset in file of the block, 0 if none
+	uint64_t max_ts;	// Latest timestamp of the blocks before it
+	uint32_t seq;		// Sequence of the block
+	uint32_t lap;		// Times the file wrapped before the block
+};
+
 #ifdef __cplusplus
 }
 #endif
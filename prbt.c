@@ -6,13 +6,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #define RBT_STR
 #include "rbtracedef.h"
 #include "rbtrace.h"
+#include "rbtrace_codec.h"
 #include "version.h"
 
 STATIC_ASSERT(sizeof(rbt_tid_str)/sizeof(rbt_tid_str[0]) == RBT_TRAFFIC_LAST);
 STATIC_ASSERT(sizeof(rbt_fmt_str)/sizeof(rbt_fmt_str[0]) == RBT_TRAFFIC_LAST);
+STATIC_ASSERT(sizeof(rbt_codec_str)/sizeof(rbt_codec_str[0]) == RBTRACE_CODEC_MAX);
 
 struct prbt_option {
 	char *file_path;
@@ -22,6 +26,12 @@ struct prbt_option {
 	bool only_show_info;
 	bool show_timestamp;
 	uint64_t trace_ids;
+	int nr_jobs;		// threads records are formatted on
+	int64_t thread;		// thread of records included, -1 for all
+	int32_t cpu;		// CPU of records included, -1 for all
+	int32_t arg;		// arg of records in [arg_min, arg_max], or -1
+	uint64_t arg_min;
+	uint64_t arg_max;
 } opts = {
 	.file_path = NULL,
 	.out_path = NULL,
@@ -29,12 +39,271 @@ struct prbt_option {
 	.end_time = 0,
 	.only_show_info = false,
 	.show_timestamp = true,
+	.nr_jobs = 1,
 	.trace_ids = 0xFFFFFFFFFFFFFFFF,
+	.thread = -1,
+	.cpu = -1,
+	.arg = -1,
+	.arg_min = 0,
+	.arg_max = UINT64_MAX,
+};
+
+#define NSEC_PER_SEC	(1000000000ULL)
+
+/* Time source of the records in trace file */
+struct trace_clock {
+	uint64_t tsc_hz;	// TSC frequency, 0 if records have realtime
+	uint32_t nr_syncs;	// number of TSC sync points
+	struct rbtrace_tsc_sync syncs[RBTRACE_MAX_TSC_SYNCS];
+} tclk = {
+	.tsc_hz = 0,
+	.nr_syncs = 0,
+};
+
+/* Format of a trace entry before 1.3, thread IDs were truncated */
+struct rbtrace_entry_1_0 {
+	uint64_t a0;
+	uint64_t a1;
+	uint64_t a2;
+	uint64_t a3;
+	union {
+		struct timespec timestamp;
+		uint64_t tsc;
+	};
+	uint32_t cpuid:8;
+	uint32_t thread:18;
+	uint32_t traceid:6;
+};
+
+STATIC_ASSERT(sizeof(struct rbtrace_entry_1_0) ==
+	      sizeof(struct rbtrace_entry));
+
+/* Format of trace entries in file */
+struct trace_format {
+	rbtrace_format_t format;
+	uint32_t size;		// size of an entry in file
+	bool legacy;		// entries in the format before 1.3
+	rbtrace_codec_t codec;	// codec of record blocks, since 1.5
+} tfmt = {
+	.format = RBTRACE_FMT_V1,
+	.size = sizeof(struct rbtrace_entry),
+	.legacy = false,
+	.codec = RBTRACE_CODEC_NONE,
 };
 
 static void usage(void);
 static void version(void);
 
+/* Key to sort trace records in time order, TSC ticks or nanoseconds */
+static inline uint64_t trace_key(struct rbtrace_entry *re)
+{
+	if (tclk.tsc_hz) {
+		return re->tsc;
+	}
+	return re->timestamp.tv_sec * NSEC_PER_SEC + re->timestamp.tv_nsec;
+}
+
+/* Convert the timestamp of a trace record to realtime. TSC ticks are
+ * interpolated between the sync points around them, so the drift
+ * between TSC and realtime is followed.
+ */
+static void trace_time(struct rbtrace_entry *re, struct timespec *ts)
+{
+	struct rbtrace_tsc_sync *s0, *s1;
+	double hz;
+	int64_t ns;
+	int i;
+
+	if ((tclk.tsc_hz == 0) || (tclk.nr_syncs == 0)) {
+		*ts = re->timestamp;
+		return;
+	}
+
+	for (i = 0; i < (tclk.nr_syncs - 1); i++) {
+		if (re->tsc < tclk.syncs[i + 1].tsc) {
+			break;
+		}
+	}
+
+	s0 = &tclk.syncs[i];
+	if (i < (tclk.nr_syncs - 1)) {
+		s1 = &tclk.syncs[i + 1];
+		hz = (double)(s1->tsc - s0->tsc) * NSEC_PER_SEC /
+			(s1->ns - s0->ns);
+	} else {
+		hz = tclk.tsc_hz;
+	}
+
+	ns = s0->ns + (int64_t)((double)(int64_t)(re->tsc - s0->tsc) *
+				NSEC_PER_SEC / hz);
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/* Key of the records traced at a realtime in seconds, the inverse of
+ * trace_time()
+ */
+static uint64_t trace_time_key(time_t sec)
+{
+	struct rbtrace_tsc_sync *s0;
+	int64_t ns = (int64_t)sec * NSEC_PER_SEC;
+	int64_t tsc;
+	int i;
+
+	if (tclk.tsc_hz == 0) {
+		return (ns > 0) ? ns : 0;
+	}
+	if (tclk.nr_syncs == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < (tclk.nr_syncs - 1); i++) {
+		if (ns < (int64_t)tclk.syncs[i + 1].ns) {
+			break;
+		}
+	}
+	s0 = &tclk.syncs[i];
+	tsc = s0->tsc + (int64_t)((double)(ns - (int64_t)s0->ns) *
+				  tclk.tsc_hz / NSEC_PER_SEC);
+	return (tsc > 0) ? tsc : 0;
+}
+
+static inline void decode_v2_timestamp(uint64_t timestamp,
+				       struct rbtrace_entry *re)
+{
+	if (tclk.tsc_hz) {
+		re->tsc = timestamp;
+	} else {
+		re->timestamp.tv_sec = timestamp / NSEC_PER_SEC;
+		re->timestamp.tv_nsec = timestamp % NSEC_PER_SEC;
+	}
+}
+
+/* Decode nr entries read from file into trace entries. Return the
+ * raw buffer if entries are already in the current v1 format.
+ */
+static struct rbtrace_entry *
+decode_trace_entries(char *raw, size_t nr, struct rbtrace_entry *re)
+{
+	struct rbtrace_entry_1_0 old;
+	struct rbtrace_entry_v2 *re2;
+	struct rbtrace_entry_compact *rec;
+	size_t i;
+
+	switch (tfmt.format) {
+	case RBTRACE_FMT_V2:
+		re2 = (struct rbtrace_entry_v2 *)raw;
+		for (i = 0; i < nr; i++, re2++) {
+			decode_v2_timestamp(re2->timestamp, &re[i]);
+			re[i].thread = re2->thread;
+			re[i].cpuid = re2->cpuid;
+			re[i].traceid = re2->traceid;
+			re[i].commit = re2->commit;
+			re[i].a0 = re2->a0;
+			re[i].a1 = re2->a1;
+			re[i].a2 = re2->a2;
+			re[i].a3 = re2->a3;
+		}
+		return re;
+	case RBTRACE_FMT_COMPACT:
+		rec = (struct rbtrace_entry_compact *)raw;
+		for (i = 0; i < nr; i++, rec++) {
+			decode_v2_timestamp(rec->timestamp, &re[i]);
+			re[i].thread = rec->thread;
+			re[i].cpuid = rec->cpuid;
+			re[i].traceid = rec->traceid;
+			re[i].commit = rec->commit;
+			re[i].a0 = rec->a0;
+			re[i].a1 = rec->a1;
+			re[i].a2 = 0;
+			re[i].a3 = 0;
+		}
+		return re;
+	default:
+		break;
+	}
+
+	if (!tfmt.legacy) {
+		return (struct rbtrace_entry *)raw;
+	}
+
+	for (i = 0; i < nr; i++) {
+		memcpy(&old, raw + i * sizeof(old), sizeof(old));
+		re[i].a0 = old.a0;
+		re[i].a1 = old.a1;
+		re[i].a2 = old.a2;
+		re[i].a3 = old.a3;
+		re[i].tsc = old.tsc;
+		re[i].timestamp = old.timestamp;
+		re[i].thread = old.thread;
+		re[i].cpuid = old.cpuid;
+		re[i].traceid = old.traceid;
+		re[i].commit = 0;
+	}
+	return re;
+}
+
+/* Whether a record holds a trace. Records never written, like the
+ * rest of a buffer mapped from the file, are zero. Those a producer
+ * had not committed when its buffer was written are left pending.
+ */
+static inline bool trace_written(const struct rbtrace_entry *re)
+{
+	if ((re->traceid == RBT_NULL) && (re->thread == 0)) {
+		return false;
+	}
+	return !(re->commit & RBTRACE_COMMIT_PENDING);
+}
+
+/* Records a producer staged, or stamped after it was preempted, land
+ * in the file out of time order, though not by more than a buffer.
+ * Reading stops once a buffer of records after the last one in range
+ * was read past opts.end_time.
+ */
+struct trace_end {
+	uint64_t key;		// records from this key on are past the end
+	uint64_t past;		// records read past the end in a row
+	uint64_t window;	// records read past the end before stopping
+};
+
+static void trace_end_init(struct trace_end *te, uint64_t window)
+{
+	te->key = opts.end_time ? trace_time_key(opts.end_time + 1) :
+		UINT64_MAX;
+	te->past = 0;
+	te->window = window;
+}
+
+static bool trace_end_reached(struct trace_end *te,
+			      struct rbtrace_entry *re)
+{
+	if (!trace_written(re)) {
+		return false;
+	}
+	if (trace_key(re) < te->key) {
+		te->past = 0;
+		return false;
+	}
+	return ++te->past > te->window;
+}
+
+/* Whether records in file are already trace entries */
+static inline bool trace_in_place(void)
+{
+	return (tfmt.format == RBTRACE_FMT_V1) && !tfmt.legacy;
+}
+
+/* Trace records start after the header, files written with O_DIRECT
+ * pad it to a block
+ */
+static off_t trace_data_off(union padded_rbtrace_fheader *prf)
+{
+	if (prf->hdr.hdr_size > sizeof(*prf)) {
+		return prf->hdr.hdr_size;
+	}
+	return sizeof(*prf);
+}
+
 static int parse_trace_header(int fd, FILE *fp,
 			      union padded_rbtrace_fheader *prf)
 {
@@ -70,297 +339,1822 @@ static int parse_trace_header(int fd, FILE *fp,
 		fprintf(fp, "REVISION: %d.%d\n", rf->major, rf->minor);
 	}
 
-	tv_sec = rf->timestamp.tv_sec + rf->gmtoff;
-	gm = gmtime(&tv_sec);
-	if (gm == NULL) {
-		rc = -1;
-		fprintf(stderr, "Invalid timestamp in trace header!\n");
-	} else {
-		fprintf(fp, "OPEN AT: %02d/%02d %02d:%02d:%02d.%06ld %s\n",
-			gm->tm_mon + 1, gm->tm_mday, gm->tm_hour, gm->tm_min,
-			gm->tm_sec, rf->timestamp.tv_nsec / 1000,
-			((char *)prf) + rf->tz_off);
+	tv_sec = rf->timestamp.tv_sec + rf->gmtoff;
+	gm = gmtime(&tv_sec);
+	if (gm == NULL) {
+		rc = -1;
+		fprintf(stderr, "Invalid timestamp in trace header!\n");
+	} else {
+		fprintf(fp, "OPEN AT: %02d/%02d %02d:%02d:%02d.%06ld %s\n",
+			gm->tm_mon + 1, gm->tm_mday, gm->tm_hour, gm->tm_min,
+			gm->tm_sec, rf->timestamp.tv_nsec / 1000,
+			((char *)prf) + rf->tz_off);
+	}
+
+	if (rf->wrap_pos != 0) {
+		fprintf(fp, "wrap position: %ld\n", rf->wrap_pos);
+	}
+
+	if (rf->minor < 3) {
+		tfmt.legacy = true;
+	}
+
+	if ((rf->minor >= 4) && (rf->entry_format != RBTRACE_FMT_V1)) {
+		if ((rf->entry_format >= RBTRACE_FMT_MAX) ||
+		    (rf->entry_size !=
+		     rbtrace_entry_size(rf->entry_format))) {
+			rc = -1;
+			fprintf(stderr, "Unknown entry format %d size %d!\n",
+				rf->entry_format, rf->entry_size);
+			goto out;
+		}
+		tfmt.format = rf->entry_format;
+		tfmt.size = rf->entry_size;
+		fprintf(fp, "entry format: %s\n",
+			tfmt.format == RBTRACE_FMT_V2 ? "v2" : "compact");
+	}
+
+	if ((rf->minor >= 5) && (rf->codec != RBTRACE_CODEC_NONE)) {
+		if (rf->codec >= RBTRACE_CODEC_MAX) {
+			rc = -1;
+			fprintf(stderr, "Unknown codec %d!\n", rf->codec);
+			goto out;
+		}
+		tfmt.codec = rf->codec;
+		fprintf(fp, "codec: %s\n", rbt_codec_str[tfmt.codec]);
+	}
+
+	if ((rf->minor >= 2) && rf->tsc_hz) {
+		tclk.tsc_hz = rf->tsc_hz;
+		tclk.nr_syncs = rf->nr_tsc_syncs;
+		if (tclk.nr_syncs > RBTRACE_MAX_TSC_SYNCS) {
+			tclk.nr_syncs = RBTRACE_MAX_TSC_SYNCS;
+		}
+		memcpy(tclk.syncs, rf->tsc_syncs,
+		       sizeof(tclk.syncs[0]) * tclk.nr_syncs);
+		fprintf(fp, "TSC frequency: %ld Hz\n", rf->tsc_hz);
+	}
+
+	fprintf(fp, "ring name: %s\n", ((char *)prf) + rf->name_off);
+	fprintf(fp, "ring desc: %s\n", ((char *)prf) + rf->desc_off);
+
+	if ((rf->minor >= 1) && (rf->nr_subrings > 1)) {
+		fprintf(fp, "sub-rings: %d\n", rf->nr_subrings);
+	}
+
+ out:
+	return rc;
+}
+
+/* Returns the length of the record formatted */
+static int format_trace_record(char *buf, struct rbtrace_entry *re)
+{
+	char *start = buf;
+	int nchars;
+	const char *fmt;
+	const char *tid;
+
+	if (re->traceid >= RBT_TRAFFIC_LAST) {
+		nchars = sprintf(buf, "ID:%d, %16lX, %16lX, %16lX, %16lX",
+				 re->traceid, re->a0, re->a1,
+				 re->a2, re->a3);
+		buf += nchars;
+	} else {
+		tid = rbt_tid_str[re->traceid];
+		nchars = sprintf(buf, "%4s ", tid);
+		buf += nchars;
+
+		fmt = rbt_fmt_str[re->traceid];
+		nchars = sprintf(buf, fmt, re->a0, re->a1,
+				 re->a2, re->a3);
+		buf += nchars;
+	}
+
+	nchars = sprintf(buf, "\n");
+	return buf + nchars - start;
+}
+
+/* Reader of the blocks of a coded file in the order they were
+ * written. A wrapped file is read from the wrap position to its end,
+ * then from its start to the wrap position.
+ */
+struct block_reader {
+	int fd;
+	off_t start[2];		// start of each region of the file
+	off_t end[2];		// end of each region of the file
+	int nr_regions;
+	int region;		// region being read
+	off_t off;		// offset of the next block
+	uint32_t seq;		// sequence of the last block
+	uint32_t min_seq;	// least sequence of the first block
+	uint64_t nr_blocks;	// blocks read
+	uint64_t lo;		// blocks with no records in [lo, hi] are
+	uint64_t hi;		// skipped without decoding them
+	bool sorted;		// blocks are in time order, stop past hi
+	bool past;		// the last block was past hi
+	bool filter;		// skip blocks the filters let no record of
+	char *win;		// window of the file
+	size_t win_size;
+	off_t win_off;		// offset of the window in file
+	size_t win_len;		// bytes in the window
+	char *raw;		// records of the last block in file format
+	size_t raw_size;
+};
+
+/* Blocks are searched for in windows of this many bytes at least */
+#define BLOCK_WINDOW	(1 << 20)
+
+static int index_cmp(const void *a, const void *b)
+{
+	const struct rbtrace_index *ia = a;
+	const struct rbtrace_index *ib = b;
+
+	return (ia->seq > ib->seq) - (ia->seq < ib->seq);
+}
+
+/* Start at the latest intact block the index says every block written
+ * before ended before lo
+ */
+static void block_reader_seek(struct block_reader *br,
+			      union padded_rbtrace_fheader *prf)
+{
+	struct rbtrace_index *idx = NULL;
+	struct rbtrace_block blk;
+	size_t size = prf->hdr.index_nr * sizeof(*idx);
+	size_t nr = 0;
+	size_t lo = 0;
+	size_t hi = 0;
+	size_t mid;
+	size_t i;
+
+	if ((prf->hdr.index_nr == 0) || (br->lo == 0)) {
+		return;
+	}
+	idx = malloc(size);
+	if (idx == NULL) {
+		return;
+	}
+	if (pread(br->fd, idx, size, prf->hdr.index_off) != (ssize_t)size) {
+		goto out;
+	}
+
+	for (i = 0; i < prf->hdr.index_nr; i++) {
+		if (idx[i].off >= trace_data_off(prf)) {
+			idx[nr++] = idx[i];
+		}
+	}
+	qsort(idx, nr, sizeof(*idx), index_cmp);
+
+	hi = nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx[mid].max_ts < br->lo) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* Blocks written over since the index entry was are gone */
+	for (i = lo; i-- > 0; ) {
+		if ((pread(br->fd, &blk, sizeof(blk), idx[i].off) !=
+		     sizeof(blk)) || !rbtrace_block_valid(&blk) ||
+		    (blk.seq != idx[i].seq)) {
+			continue;
+		}
+		br->region = ((br->nr_regions > 1) &&
+			      (idx[i].off < br->end[1])) ? 1 : 0;
+		br->off = idx[i].off;
+		br->min_seq = blk.seq;
+		break;
+	}
+
+ out:
+	free(idx);
+}
+
+static bool block_reader_init(struct block_reader *br, int fd,
+			      union padded_rbtrace_fheader *prf,
+			      bool filter)
+{
+	off_t base = trace_data_off(prf);
+	off_t fsize = lseek(fd, 0, SEEK_END);
+
+	memset(br, 0, sizeof(*br));
+	br->fd = fd;
+	br->win_size = BLOCK_WINDOW;
+	br->win = malloc(br->win_size);
+	if (br->win == NULL) {
+		fprintf(stderr, "Failed to malloc %zu bytes for block "
+			"window!\n", br->win_size);
+		return false;
+	}
+
+	if (prf->hdr.wrap_pos > base) {
+		br->start[br->nr_regions] = prf->hdr.wrap_pos;
+		br->end[br->nr_regions++] = fsize;
+		br->start[br->nr_regions] = base;
+		br->end[br->nr_regions++] = prf->hdr.wrap_pos;
+	} else {
+		br->start[br->nr_regions] = base;
+		br->end[br->nr_regions++] = fsize;
+	}
+	br->off = br->start[0];
+
+	br->hi = UINT64_MAX;
+	if (!filter) {
+		return true;
+	}
+	br->filter = true;
+	/* Records are filtered by time exactly as they are printed */
+	if (opts.start_time) {
+		br->lo = trace_time_key(opts.start_time - 1);
+		block_reader_seek(br, prf);
+	}
+	if (opts.end_time) {
+		br->hi = trace_time_key(opts.end_time + 1);
+	}
+	br->sorted = (prf->hdr.nr_subrings <= 1);
+	return true;
+}
+
+static void block_reader_fini(struct block_reader *br)
+{
+	free(br->win);
+	free(br->raw);
+}
+
+/* Bytes of the file at off, NULL if there are fewer than len */
+static char *block_reader_get(struct block_reader *br, off_t off,
+			      size_t len)
+{
+	ssize_t nbytes;
+	char *win;
+
+	if ((off >= br->win_off) &&
+	    (off + len <= br->win_off + br->win_len)) {
+		return br->win + (off - br->win_off);
+	}
+
+	if (len > br->win_size) {
+		win = realloc(br->win, len);
+		if (win == NULL) {
+			fprintf(stderr, "Failed to malloc %zu bytes for block "
+				"window!\n", len);
+			return NULL;
+		}
+		br->win = win;
+		br->win_size = len;
+	}
+
+	nbytes = pread(br->fd, br->win, br->win_size, off);
+	if (nbytes < (ssize_t)len) {
+		if (nbytes == -1) {
+			fprintf(stderr, "pread %zu bytes from off %ld failed, "
+				"error:%d\n", br->win_size, off, errno);
+		}
+		br->win_len = 0;
+		return NULL;
+	}
+	br->win_off = off;
+	br->win_len = nbytes;
+	return br->win;
+}
+
+/* Whether the zone map of a block lets any record pass the filters */
+static bool block_match(const struct rbtrace_block *blk)
+{
+	uint32_t bit;
+
+	if (!(blk->tids & opts.trace_ids)) {
+		return false;
+	}
+	if (opts.cpu != -1) {
+		bit = opts.cpu % RBTRACE_ZONE_BITS;
+		if (!(blk->cpus[bit / 64] & (1ULL << (bit % 64)))) {
+			return false;
+		}
+	}
+	if (opts.thread != -1) {
+		bit = rbtrace_zone_thread(opts.thread);
+		if (!(blk->threads[bit / 64] & (1ULL << (bit % 64)))) {
+			return false;
+		}
+	}
+	if ((opts.arg != -1) &&
+	    ((blk->max_args[opts.arg] < opts.arg_min) ||
+	     (blk->min_args[opts.arg] > opts.arg_max))) {
+		return false;
+	}
+	return true;
+}
+
+/* Move past the block found at the current offset */
+static inline void block_reader_skip(struct block_reader *br,
+				     const struct rbtrace_block *blk)
+{
+	br->seq = blk->seq;
+	br->nr_blocks++;
+	br->off += rbtrace_block_span(blk);
+}
+
+/* Offset of the next intact block header, which is copied to blk, or
+ * -1 past the last block. Blocks are looked for at every alignment
+ * past what doesn't decode, like the remains of blocks written over
+ * after a wrap. Blocks out of the time range, or with no record the
+ * filters let through, are skipped on their header.
+ */
+static off_t block_reader_find(struct block_reader *br,
+			       struct rbtrace_block *blk)
+{
+	size_t span;
+	char *ptr;
+
+	while (br->region < br->nr_regions) {
+		if (br->off + sizeof(*blk) > br->end[br->region]) {
+			if (++br->region < br->nr_regions) {
+				br->off = br->start[br->region];
+			}
+			continue;
+		}
+
+		ptr = block_reader_get(br, br->off, sizeof(*blk));
+		if (ptr == NULL) {
+			br->off = br->end[br->region];
+			continue;
+		}
+		memcpy(blk, ptr, sizeof(*blk));
+		span = rbtrace_block_span(blk);
+		if (!rbtrace_block_valid(blk) ||
+		    (br->nr_blocks ? (blk->seq <= br->seq) :
+		     (blk->seq < br->min_seq)) ||
+		    (blk->size > rbtrace_block_bound(blk->nr_records,
+						     tfmt.format)) ||
+		    (br->off + span > br->end[br->region])) {
+			br->off += RBTRACE_BLOCK_ALIGN;
+			continue;
+		}
+
+		/* Staged records may land a block late, so reading stops
+		 * at the second block in a row past hi
+		 */
+		if (br->sorted && (blk->min_ts > br->hi)) {
+			if (br->past) {
+				br->region = br->nr_regions;
+				break;
+			}
+			br->past = true;
+		} else {
+			br->past = false;
+		}
+
+		if ((blk->max_ts < br->lo) || (blk->min_ts > br->hi) ||
+		    (br->filter && !block_match(blk))) {
+			block_reader_skip(br, blk);
+			continue;
+		}
+
+		return br->off;
+	}
+
+	return -1;
+}
+
+/* Decode the next intact block, records in file format are returned
+ * and their number set to nr.
+ */
+static char *block_reader_next(struct block_reader *br, uint32_t *nr)
+{
+	struct rbtrace_block blk;
+	size_t raw_size;
+	off_t off;
+	char *ptr;
+
+	while ((off = block_reader_find(br, &blk)) != -1) {
+		raw_size = (size_t)blk.nr_records * tfmt.size;
+		if (raw_size > br->raw_size) {
+			free(br->raw);
+			br->raw = malloc(raw_size);
+			br->raw_size = br->raw ? raw_size : 0;
+			if (br->raw == NULL) {
+				fprintf(stderr, "Failed to malloc %zu bytes "
+					"for trace block!\n", raw_size);
+				return NULL;
+			}
+		}
+
+		ptr = block_reader_get(br, off, rbtrace_block_span(&blk));
+		if ((ptr == NULL) ||
+		    (rbtrace_decode_block(&blk, ptr + sizeof(blk),
+					  tfmt.format, tclk.tsc_hz != 0,
+					  br->raw) != 0)) {
+			br->off += RBTRACE_BLOCK_ALIGN;
+			continue;
+		}
+
+		block_reader_skip(br, &blk);
+		*nr = blk.nr_records;
+		return br->raw;
+	}
+
+	return NULL;
+}
+
+/* Print the time of a record in file format as the line label */
+static bool print_summary_time(FILE *fp, union padded_rbtrace_fheader *prf,
+			       const char *label, const char *name,
+			       char *raw)
+{
+	time_t tv_sec = 0;
+	char buf[128];
+	struct rbtrace_entry re;
+	struct timespec ts;
+	struct tm *gm = NULL;
+
+	re = *decode_trace_entries(raw, 1, &re);
+	trace_time(&re, &ts);
+	tv_sec = ts.tv_sec + prf->hdr.gmtoff;
+	gm = gmtime(&tv_sec);
+	if (gm == NULL) {
+		fprintf(stderr, "invalid timestamp %ld for %s trace "
+			"record!\n", ts.tv_sec, name);
+		return false;
+	}
+
+	strftime(buf, sizeof(buf), "%m-%d %H:%M:%S", gm);
+	fprintf(fp, "%s: %s\n", label, buf);
+	return true;
+}
+
+/* First and last records of a coded file */
+static bool block_summary(int fd, union padded_rbtrace_fheader *prf,
+			  char *first, char *last)
+{
+	struct block_reader br;
+	uint32_t nr = 0;
+	char *raw;
+	bool found = false;
+
+	if (!block_reader_init(&br, fd, prf, false)) {
+		return false;
+	}
+	while ((raw = block_reader_next(&br, &nr)) != NULL) {
+		if (!found) {
+			memcpy(first, raw, tfmt.size);
+			found = true;
+		}
+		memcpy(last, raw + (nr - 1) * tfmt.size, tfmt.size);
+	}
+	block_reader_fini(&br);
+	return found;
+}
+
+static void print_trace_summary(int fd, FILE *fp,
+				union padded_rbtrace_fheader *prf)
+{
+	off_t off = 0;
+	off_t fsize = 0;
+	char first[sizeof(struct rbtrace_entry)];
+	char last[sizeof(struct rbtrace_entry)];
+
+	if (tfmt.codec != RBTRACE_CODEC_NONE) {
+		if (!block_summary(fd, prf, first, last)) {
+			fprintf(stderr, "Empty trace file!\n");
+			return;
+		}
+		goto print;
+	}
+
+	fsize = lseek(fd, 0, SEEK_END);
+	if (fsize < (trace_data_off(prf) + tfmt.size)) {
+		fprintf(stderr, "Empty trace file!\n");
+		return;
+	}
+
+	if (prf->hdr.wrap_pos) {
+		off = prf->hdr.wrap_pos;
+	} else {
+		off = trace_data_off(prf);
+	}
+
+	if (pread(fd, first, tfmt.size, off) != tfmt.size) {
+		fprintf(stderr, "pread %d bytes from off %ld failed, "
+			"error:%d\n", tfmt.size, off, errno);
+		return;
+	}
+
+	/* Wrapped file, last trace record is just before current one */
+	if (off >= (trace_data_off(prf) + tfmt.size)) {
+		off -= tfmt.size;
+	}
+	/* Last trace record is at file end */
+	else {
+		off = fsize - tfmt.size;
+	}
+
+	if (pread(fd, last, tfmt.size, off) != tfmt.size) {
+		fprintf(stderr, "pread %d bytes from off %ld failed, "
+			"error:%d\n", tfmt.size, off, errno);
+		return;
+	}
+
+ print:
+	if (print_summary_time(fp, prf, "start time", "first", first)) {
+		print_summary_time(fp, prf, "end time  ", "last", last);
+	}
+}
+
+/* Reader of a file of raw records mapped as a whole, records in the
+ * current v1 format are handed out in place. A wrapped file is read
+ * from the wrap position to its end, then from its start to the wrap
+ * position.
+ */
+struct trace_map {
+	char *addr;		// mapping of the file
+	size_t size;		// size of the mapping
+	off_t start[2];		// start of each region of the file
+	off_t end[2];		// end of each region of the file
+	int nr_regions;
+	int region;		// region being read
+	off_t off;		// offset of the next record
+	off_t ahead;		// offset readahead was asked up to
+	size_t max;		// max number of records returned at a time
+	struct rbtrace_entry *ents;// records decoded from other formats
+};
+
+/* Bytes read ahead of the records being read */
+#define TRACE_MAP_AHEAD	(8 << 20)
+
+static bool trace_map_init(struct trace_map *tm, int fd,
+			   union padded_rbtrace_fheader *prf, int advice)
+{
+	off_t base = trace_data_off(prf);
+	off_t fsize = lseek(fd, 0, SEEK_END);
+	off_t wrap = prf->hdr.wrap_pos;
+
+	memset(tm, 0, sizeof(*tm));
+	tm->max = prf->hdr.nr_records ? prf->hdr.nr_records : 1;
+	if (!trace_in_place()) {
+		tm->ents = malloc(sizeof(*tm->ents) * tm->max);
+		if (tm->ents == NULL) {
+			fprintf(stderr, "Failed to malloc %zu trace "
+				"records!\n", tm->max);
+			return false;
+		}
+	}
+
+	/* Empty file */
+	if (fsize < base + tfmt.size) {
+		return true;
+	}
+	tm->size = fsize;
+	tm->addr = mmap(NULL, tm->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (tm->addr == MAP_FAILED) {
+		fprintf(stderr, "mmap %zu bytes of trace file failed, "
+			"error:%d\n", tm->size, errno);
+		tm->addr = NULL;
+		free(tm->ents);
+		return false;
+	}
+	madvise(tm->addr, tm->size, advice);
+
+	/* A partial record at file end is never read */
+	fsize = base + (fsize - base) / tfmt.size * tfmt.size;
+	if ((wrap > base) && (wrap < fsize)) {
+		tm->start[tm->nr_regions] = wrap;
+		tm->end[tm->nr_regions++] = fsize;
+		tm->start[tm->nr_regions] = base;
+		tm->end[tm->nr_regions++] = wrap;
+	} else {
+		tm->start[tm->nr_regions] = base;
+		tm->end[tm->nr_regions++] = fsize;
+	}
+	tm->off = tm->start[0];
+	return true;
+}
+
+static void trace_map_fini(struct trace_map *tm)
+{
+	if (tm->addr) {
+		munmap(tm->addr, tm->size);
+	}
+	free(tm->ents);
+}
+
+/* Continue reading at off, which is in region */
+static void trace_map_seek(struct trace_map *tm, int region, off_t off)
+{
+	tm->region = region;
+	tm->off = off;
+	tm->ahead = 0;
+}
+
+/* nr records at off in file, in place if they are in the v1 format,
+ * or decoded into ents
+ */
+static inline struct rbtrace_entry *
+trace_map_at(struct trace_map *tm, off_t off, size_t nr,
+	     struct rbtrace_entry *ents)
+{
+	return decode_trace_entries(tm->addr + off, nr, ents);
+}
+
+/* Offset of the next records of the file in the order they were
+ * written, up to max of them at a time. Their number is set to nr.
+ * Returns -1 past the last record.
+ */
+static off_t trace_map_advance(struct trace_map *tm, size_t max,
+			       size_t *nr)
+{
+	off_t page = sysconf(_SC_PAGESIZE);
+	off_t end;
+	off_t off;
+	size_t n;
+
+	while (tm->region < tm->nr_regions) {
+		n = (tm->end[tm->region] - tm->off) / tfmt.size;
+		if (n == 0) {
+			if (++tm->region < tm->nr_regions) {
+				trace_map_seek(tm, tm->region,
+					       tm->start[tm->region]);
+			}
+			continue;
+		}
+		if (n > max) {
+			n = max;
+		}
+
+		if (tm->off + n * tfmt.size > tm->ahead) {
+			off = tm->off & ~(page - 1);
+			end = tm->end[tm->region];
+			if (end > off + TRACE_MAP_AHEAD) {
+				end = off + TRACE_MAP_AHEAD;
+			}
+			madvise(tm->addr + off, end - off, MADV_WILLNEED);
+			tm->ahead = end;
+		}
+
+		*nr = n;
+		off = tm->off;
+		tm->off += n * tfmt.size;
+		return off;
+	}
+
+	return -1;
+}
+
+/* Next records of the file in the order they were written, up to a
+ * buffer of them at a time. Their number is set to nr.
+ */
+static struct rbtrace_entry *trace_map_next(struct trace_map *tm,
+					    size_t *nr)
+{
+	off_t off;
+
+	off = trace_map_advance(tm, tm->max, nr);
+	if (off == -1) {
+		return NULL;
+	}
+	return trace_map_at(tm, off, *nr, tm->ents);
+}
+
+/* Number of the nr records at off to read before the end is reached,
+ * nr if it is not
+ */
+static size_t trace_end_mapped(struct trace_end *te, struct trace_map *tm,
+			       off_t off, size_t nr)
+{
+	struct rbtrace_entry *re;
+	size_t i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = (nr - i < tm->max) ? (nr - i) : tm->max;
+		re = trace_map_at(tm, off + i * tfmt.size, n, tm->ents);
+		for (j = 0; j < n; j++) {
+			if (trace_end_reached(te, &re[j])) {
+				return i + j;
+			}
+		}
+	}
+	return nr;
+}
+
+static inline uint64_t trace_arg(struct rbtrace_entry *re, int i)
+{
+	switch (i) {
+	case 0:
+		return re->a0;
+	case 1:
+		return re->a1;
+	case 2:
+		return re->a2;
+	default:
+		return re->a3;
+	}
+}
+
+/* Whether a record passes the trace ID, CPU, thread and arg filters */
+static bool trace_match(struct rbtrace_entry *re)
+{
+	if (!(opts.trace_ids & (1ULL << (re->traceid % 64)))) {
+		return false;
+	}
+	if ((opts.cpu != -1) && (re->cpuid != opts.cpu)) {
+		return false;
+	}
+	if ((opts.thread != -1) && (re->thread != opts.thread)) {
+		return false;
+	}
+	if ((opts.arg != -1) &&
+	    ((trace_arg(re, opts.arg) < opts.arg_min) ||
+	     (trace_arg(re, opts.arg) > opts.arg_max))) {
+		return false;
+	}
+	return true;
+}
+
+/* Bytes a formatted record takes at most */
+#define TRACE_LINE_MAX	(256)
+
+/* Format a record into buf, which holds TRACE_LINE_MAX bytes. Returns
+ * the length of the line, 0 if the record is filtered out.
+ */
+static int trace_format_fn(struct rbtrace_fheader *rf, uint64_t idx,
+			   struct rbtrace_entry *re, char *buf)
+{
+	char *start = buf;
+	int nchars = 0;
+	time_t tv_sec = 0;
+	struct timespec ts;
+	struct tm gm;
+
+	/* Check whether this record has been filtered out */
+	if (!trace_match(re)) {
+		return 0;
+	}
+
+	if (!trace_written(re)) {
+		return 0;
+	}
+
+	trace_time(re, &ts);
+	if (opts.start_time && (ts.tv_sec < opts.start_time)) {
+		return 0;
+	}
+	if (opts.end_time && (ts.tv_sec > opts.end_time)) {
+		return 0;
+	}
+
+	tv_sec = ts.tv_sec + rf->gmtoff;
+	if (gmtime_r(&tv_sec, &gm) == NULL) {
+		fprintf(stderr, "idx:%ld, invalid timestamp %ld\n",
+			idx, ts.tv_sec);
+		return 0;
+	}
+
+	if (opts.show_timestamp) {
+		/* Format time stamp, cpu and thread ID */
+		nchars = sprintf(buf, "%02d-%02d %02d:%02d:%02d.%09ld ",
+				 gm.tm_mon + 1, gm.tm_mday, gm.tm_hour,
+				 gm.tm_min, gm.tm_sec,
+				 ts.tv_nsec);
+		buf += nchars;
+	}
+
+	nchars = sprintf(buf, "%2d %8d ", re->cpuid, re->thread);
+	buf += nchars;
+
+	/* Format trace record */
+	buf += format_trace_record(buf, re);
+
+	return buf - start;
+}
+
+static bool trace_print_fn(struct rbtrace_fheader *rf,
+			   uint64_t idx, FILE *fp,
+			   struct rbtrace_entry *re)
+{
+	char record_buf[TRACE_LINE_MAX];
+	int len;
+
+	len = trace_format_fn(rf, idx, re, record_buf);
+	if (len > 0) {
+		fwrite(record_buf, 1, len, fp);
+	}
+	return false;
+}
+
+/* Records are formatted on opts.nr_jobs threads a chunk at a time,
+ * chunks are written out in the order they were added
+ */
+enum print_chunk_type {
+	CHUNK_RECORDS,		// records copied into the chunk
+	CHUNK_MAPPED,		// records in the mapped file
+	CHUNK_BLOCK,		// a block of a coded file
+};
+
+struct print_chunk {
+	enum print_chunk_type type;
+	off_t off;		// offset of mapped records or block in file
+	size_t len;		// bytes the block takes in file
+	size_t nr;		// number of records
+	uint64_t idx;		// index of the first record
+	bool done;		// records are formatted
+	char *ents;		// records copied or decoded
+	size_t ents_size;
+	char *blk;		// block read from file
+	size_t blk_size;
+	char *raw;		// records of the block in file format
+	size_t raw_size;
+	char *out;		// formatted records
+	size_t out_size;
+	size_t out_len;
+};
+
+struct print_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	// chunks were added
+	pthread_cond_t done;	// a chunk was formatted
+	pthread_t *threads;
+	int nr_threads;
+	struct print_chunk *chunks;// ring of chunks
+	size_t nr_chunks;
+	uint64_t head;		// next chunk to write out
+	uint64_t next;		// next chunk to format
+	uint64_t tail;		// next chunk to add
+	struct print_chunk *cur;// chunk records are copied into
+	bool exit;
+	uint64_t cnt;		// records added
+	int fd;
+	FILE *fp;
+	struct rbtrace_fheader *rf;
+	struct trace_map *tm;	// mapping of a raw file
+};
+
+/* Records in a chunk of raw records */
+#define PRINT_CHUNK	(4096)
+
+/* Most threads records are formatted on */
+#define PRINT_JOBS_MAX	(256)
+
+/* Make a chunk buffer hold len bytes at least */
+static bool print_chunk_grow(char **buf, size_t *size, size_t len)
+{
+	char *tmp;
+
+	if (len <= *size) {
+		return true;
+	}
+	if (len < *size * 2) {
+		len = *size * 2;
+	}
+	tmp = realloc(*buf, len);
+	if (tmp == NULL) {
+		fprintf(stderr, "Failed to malloc %zu bytes for print "
+			"chunk!\n", len);
+		return false;
+	}
+	*buf = tmp;
+	*size = len;
+	return true;
+}
+
+/* Records of a chunk, read and decoded from file if need be */
+static struct rbtrace_entry *print_chunk_load(struct print_pool *pool,
+					      struct print_chunk *chunk)
+{
+	struct rbtrace_block blk;
+	ssize_t nbytes;
+
+	if (!trace_in_place() &&
+	    !print_chunk_grow(&chunk->ents, &chunk->ents_size,
+			      chunk->nr * sizeof(struct rbtrace_entry))) {
+		return NULL;
+	}
+
+	switch (chunk->type) {
+	case CHUNK_MAPPED:
+		return trace_map_at(pool->tm, chunk->off, chunk->nr,
+				    (struct rbtrace_entry *)chunk->ents);
+	case CHUNK_BLOCK:
+		break;
+	default:
+		return (struct rbtrace_entry *)chunk->ents;
+	}
+
+	if (!print_chunk_grow(&chunk->blk, &chunk->blk_size, chunk->len) ||
+	    !print_chunk_grow(&chunk->raw, &chunk->raw_size,
+			      chunk->nr * tfmt.size)) {
+		return NULL;
+	}
+	nbytes = pread(pool->fd, chunk->blk, chunk->len, chunk->off);
+	if (nbytes != (ssize_t)chunk->len) {
+		fprintf(stderr, "pread %zu bytes from off %ld failed, "
+			"error:%d\n", chunk->len, chunk->off, errno);
+		return NULL;
+	}
+	memcpy(&blk, chunk->blk, sizeof(blk));
+	if (rbtrace_decode_block(&blk, chunk->blk + sizeof(blk),
+				 tfmt.format, tclk.tsc_hz != 0,
+				 chunk->raw) != 0) {
+		fprintf(stderr, "Corrupt block %u at off %ld\n",
+			blk.seq, chunk->off);
+		return NULL;
+	}
+	return decode_trace_entries(chunk->raw, chunk->nr,
+				    (struct rbtrace_entry *)chunk->ents);
+}
+
+static void print_chunk_format(struct print_pool *pool,
+			       struct print_chunk *chunk)
+{
+	struct rbtrace_entry *re;
+	size_t i;
+	int len;
+
+	chunk->out_len = 0;
+	re = print_chunk_load(pool, chunk);
+	if (re == NULL) {
+		return;
+	}
+
+	for (i = 0; i < chunk->nr; i++, re++) {
+		if (!print_chunk_grow(&chunk->out, &chunk->out_size,
+				      chunk->out_len + TRACE_LINE_MAX)) {
+			return;
+		}
+		len = trace_format_fn(pool->rf, chunk->idx + i, re,
+				      chunk->out + chunk->out_len);
+		chunk->out_len += len;
+	}
+}
+
+static void *print_worker(void *arg)
+{
+	struct print_pool *pool = arg;
+	struct print_chunk *chunk;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (!pool->exit && (pool->next == pool->tail)) {
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		}
+		if (pool->next == pool->tail) {
+			break;
+		}
+		chunk = &pool->chunks[pool->next++ % pool->nr_chunks];
+		pthread_mutex_unlock(&pool->lock);
+
+		print_chunk_format(pool, chunk);
+
+		pthread_mutex_lock(&pool->lock);
+		chunk->done = true;
+		pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Write out the oldest chunk once it is formatted */
+static void print_pool_flush(struct print_pool *pool)
+{
+	struct print_chunk *chunk;
+
+	chunk = &pool->chunks[pool->head % pool->nr_chunks];
+	pthread_mutex_lock(&pool->lock);
+	while (!chunk->done) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	fwrite(chunk->out, 1, chunk->out_len, pool->fp);
+	pool->head++;
+}
+
+/* A free chunk to fill in, chunks are written out to make room */
+static struct print_chunk *print_pool_get(struct print_pool *pool,
+					  enum print_chunk_type type)
+{
+	struct print_chunk *chunk;
+
+	if (pool->tail - pool->head == pool->nr_chunks) {
+		print_pool_flush(pool);
+	}
+	chunk = &pool->chunks[pool->tail % pool->nr_chunks];
+	chunk->type = type;
+	chunk->idx = pool->cnt;
+	chunk->nr = 0;
+	chunk->done = false;
+	return chunk;
+}
+
+/* Hand a filled in chunk to the workers */
+static void print_pool_put(struct print_pool *pool,
+			   struct print_chunk *chunk)
+{
+	pool->cnt += chunk->nr;
+	pthread_mutex_lock(&pool->lock);
+	pool->tail++;
+	pthread_cond_signal(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void print_pool_mapped(struct print_pool *pool, off_t off,
+			      size_t nr)
+{
+	struct print_chunk *chunk;
+
+	chunk = print_pool_get(pool, CHUNK_MAPPED);
+	chunk->off = off;
+	chunk->nr = nr;
+	print_pool_put(pool, chunk);
+}
+
+static void print_pool_block(struct print_pool *pool, off_t off,
+			     const struct rbtrace_block *blk)
+{
+	struct print_chunk *chunk;
+
+	chunk = print_pool_get(pool, CHUNK_BLOCK);
+	chunk->off = off;
+	chunk->len = rbtrace_block_span(blk);
+	chunk->nr = blk->nr_records;
+	print_pool_put(pool, chunk);
+}
+
+/* Copy a record into the chunk being filled in. Returns true if it
+ * could not be.
+ */
+static bool print_pool_add(struct print_pool *pool,
+			   struct rbtrace_entry *re)
+{
+	struct print_chunk *chunk = pool->cur;
+
+	if (chunk == NULL) {
+		chunk = print_pool_get(pool, CHUNK_RECORDS);
+		if (!print_chunk_grow(&chunk->ents, &chunk->ents_size,
+				      PRINT_CHUNK * sizeof(*re))) {
+			return true;
+		}
+		pool->cur = chunk;
+	}
+
+	memcpy(chunk->ents + chunk->nr * sizeof(*re), re, sizeof(*re));
+	if (++chunk->nr == PRINT_CHUNK) {
+		pool->cur = NULL;
+		print_pool_put(pool, chunk);
+	}
+	return false;
+}
+
+static bool print_pool_init(struct print_pool *pool, int fd, FILE *fp,
+			    union padded_rbtrace_fheader *prf,
+			    struct trace_map *tm)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->fd = fd;
+	pool->fp = fp;
+	pool->rf = &prf->hdr;
+	pool->tm = tm;
+	pool->nr_chunks = 2 * opts.nr_jobs;
+	pool->chunks = calloc(pool->nr_chunks, sizeof(*pool->chunks));
+	pool->threads = calloc(opts.nr_jobs, sizeof(*pool->threads));
+	if ((pool->chunks == NULL) || (pool->threads == NULL)) {
+		fprintf(stderr, "Failed to malloc %zu print chunks!\n",
+			pool->nr_chunks);
+		goto fail;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < opts.nr_jobs; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   print_worker, pool) != 0) {
+			fprintf(stderr, "Failed to create print thread, "
+				"error:%d\n", errno);
+			break;
+		}
+		pool->nr_threads++;
+	}
+	if (pool->nr_threads > 0) {
+		return true;
+	}
+
+ fail:
+	free(pool->chunks);
+	free(pool->threads);
+	return false;
+}
+
+/* Write out all chunks in order and stop the workers */
+static void print_pool_fini(struct print_pool *pool)
+{
+	size_t i;
+	int j;
+
+	if (pool->cur) {
+		print_pool_put(pool, pool->cur);
+	}
+	while (pool->head < pool->tail) {
+		print_pool_flush(pool);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exit = true;
+	pthread_cond_broadcast(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (j = 0; j < pool->nr_threads; j++) {
+		pthread_join(pool->threads[j], NULL);
 	}
 
-	if (rf->wrap_pos != 0) {
-		fprintf(fp, "wrap position: %ld\n", rf->wrap_pos);
+	for (i = 0; i < pool->nr_chunks; i++) {
+		free(pool->chunks[i].ents);
+		free(pool->chunks[i].blk);
+		free(pool->chunks[i].raw);
+		free(pool->chunks[i].out);
 	}
+	free(pool->chunks);
+	free(pool->threads);
+}
 
-	fprintf(fp, "ring name: %s\n", ((char *)prf) + rf->name_off);
-	fprintf(fp, "ring desc: %s\n", ((char *)prf) + rf->desc_off);
+/* Latest key of the nr written records from the first one on, counted
+ * from the start of the records in time order, 0 if none is written
+ */
+static uint64_t seek_max_key(struct trace_map *tm, uint64_t first,
+			     uint64_t nr)
+{
+	struct rbtrace_entry *re;
+	uint64_t n1 = (tm->end[0] - tm->start[0]) / tfmt.size;
+	uint64_t max = 0;
+	uint64_t n, i;
+	off_t off;
 
- out:
-	return rc;
+	while (nr > 0) {
+		if (first < n1) {
+			off = tm->start[0] + first * tfmt.size;
+			n = n1 - first;
+		} else {
+			off = tm->start[1] + (first - n1) * tfmt.size;
+			n = nr;
+		}
+		if (n > nr) {
+			n = nr;
+		}
+		if (n > tm->max) {
+			n = tm->max;
+		}
+		re = trace_map_at(tm, off, n, tm->ents);
+		for (i = 0; i < n; i++) {
+			if (trace_written(&re[i]) && (trace_key(&re[i]) > max)) {
+				max = trace_key(&re[i]);
+			}
+		}
+		first += n;
+		nr -= n;
+	}
+
+	return max;
 }
 
-static void format_trace_record(char *buf, struct rbtrace_entry *re)
+/* Binary search the mapped records, in time order from the wrap
+ * position on, for the first buffer with records traced from
+ * opts.start_time on. Records within and across buffers are not quite
+ * in time order, so buffers are compared by their latest record and
+ * reading goes on from the buffer before the one found.
+ */
+static void seek_trace_file(struct trace_map *tm)
 {
-	int nchars;
-	const char *fmt;
-	const char *tid;
+	uint64_t key = trace_time_key(opts.start_time);
+	uint64_t n1, n2;
+	uint64_t lo, hi, mid;
+	uint64_t bufs;
+	uint64_t rec;
 
-	if (re->traceid >= RBT_TRAFFIC_LAST) {
-		nchars = sprintf(buf, "ID:%d, %16lX, %16lX, %16lX, %16lX",
-				 re->traceid, re->a0, re->a1,
-				 re->a2, re->a3);
-		buf += nchars;
-	} else {
-		tid = rbt_tid_str[re->traceid];
-		nchars = sprintf(buf, "%4s ", tid);
-		buf += nchars;
+	if (tm->nr_regions == 0) {
+		return;
+	}
+	n1 = (tm->end[0] - tm->start[0]) / tfmt.size;
+	n2 = (tm->nr_regions > 1) ?
+		(tm->end[1] - tm->start[1]) / tfmt.size : 0;
+	bufs = (n1 + n2 + tm->max - 1) / tm->max;
 
-		fmt = rbt_fmt_str[re->traceid];
-		nchars = sprintf(buf, fmt, re->a0, re->a1,
-				 re->a2, re->a3);
-		buf += nchars;
+	lo = 0;
+	hi = bufs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rec = mid * tm->max;
+		if (seek_max_key(tm, rec, (n1 + n2 - rec < tm->max) ?
+				 (n1 + n2 - rec) : tm->max) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
 
-	sprintf(buf, "\n");
+	rec = lo ? (lo - 1) * tm->max : 0;
+	if (rec < n1) {
+		trace_map_seek(tm, 0, tm->start[0] + rec * tfmt.size);
+	} else if (n2) {
+		trace_map_seek(tm, 1, tm->start[1] + (rec - n1) * tfmt.size);
+	}
 }
 
-static void print_trace_summary(int fd, FILE *fp,
-				union padded_rbtrace_fheader *prf)
+static void
+parse_trace_file(int fd, FILE *fp,
+		 union padded_rbtrace_fheader *prf,
+		 bool (*parse_fn)(struct rbtrace_fheader *,
+				  uint64_t, FILE *,
+				  struct rbtrace_entry *))
 {
-	off_t off = 0;
-	off_t fsize = 0;
-	time_t tv_sec = 0;
-	char buf[128];
-	struct rbtrace_entry re;
-	struct tm *gm = NULL;
+	struct trace_map tm;
+	struct trace_end te;
+	struct print_pool pool;
+	struct rbtrace_entry *re = NULL;
+	uint64_t cnt = 0;
+	size_t nr = 0;
+	size_t n = 0;
+	size_t i;
+	off_t off;
 
-	fsize = lseek(fd, 0, SEEK_END);
-	if (fsize < (sizeof(*prf) + sizeof(re))) {
-		fprintf(stderr, "Empty trace file!\n");
+	if (!trace_map_init(&tm, fd, prf, MADV_SEQUENTIAL)) {
 		return;
 	}
+	if (opts.start_time) {
+		seek_trace_file(&tm);
+	}
+	trace_end_init(&te, tm.max);
 
-	if (prf->hdr.wrap_pos) {
-		off = prf->hdr.wrap_pos;
-	} else {
-		off = sizeof(*prf);
+	if ((opts.nr_jobs > 1) &&
+	    print_pool_init(&pool, fd, fp, prf, &tm)) {
+		while ((off = trace_map_advance(&tm, PRINT_CHUNK,
+						&nr)) != -1) {
+			n = opts.end_time ?
+				trace_end_mapped(&te, &tm, off, nr) : nr;
+			if (n) {
+				print_pool_mapped(&pool, off, n);
+			}
+			if (n < nr) {
+				break;
+			}
+		}
+		print_pool_fini(&pool);
+		goto out;
 	}
 
-	if (pread(fd, &re, sizeof(re), off) != sizeof(re)) {
-		fprintf(stderr, "pread %ld bytes from off %ld failed, "
-			"error:%d\n", sizeof(re), off, errno);
-		return;
+	while ((re = trace_map_next(&tm, &nr)) != NULL) {
+		for (i = 0; i < nr; i++, re++) {
+			if (trace_end_reached(&te, re) ||
+			    parse_fn(&prf->hdr, cnt++, fp, re)) {
+				goto out;
+			}
+		}
 	}
 
-	tv_sec = re.timestamp.tv_sec + prf->hdr.gmtoff;
-	gm = gmtime(&tv_sec);
-	if (gm == NULL) {
-		fprintf(stderr, "invalid timestamp %ld for first trace "
-			"record!\n", re.timestamp.tv_sec);
+ out:
+	trace_map_fini(&tm);
+}
+
+/* Records of a coded file are read a block at a time */
+static void
+parse_trace_blocks(int fd, FILE *fp,
+		   union padded_rbtrace_fheader *prf,
+		   bool (*parse_fn)(struct rbtrace_fheader *,
+				    uint64_t, FILE *,
+				    struct rbtrace_entry *))
+{
+	struct block_reader br;
+	struct print_pool pool;
+	struct rbtrace_block blk;
+	struct rbtrace_entry *ents = NULL;
+	struct rbtrace_entry *re = NULL;
+	size_t max = 0;
+	uint64_t cnt = 0;
+	uint32_t nr = 0;
+	uint32_t i;
+	off_t off;
+	char *raw;
+
+	if (!block_reader_init(&br, fd, prf, true)) {
 		return;
 	}
 
-	strftime(buf, sizeof(buf), "%m-%d %H:%M:%S", gm);
-	fprintf(fp, "start time: %s\n", buf);
-
-	/* Wrapped file, last trace record is just before current one */
-	if (off >= (sizeof(*prf) + sizeof(re))) {
-		off -= sizeof(re);
+	/* Workers read and decode the blocks found */
+	if ((opts.nr_jobs > 1) &&
+	    print_pool_init(&pool, fd, fp, prf, NULL)) {
+		while ((off = block_reader_find(&br, &blk)) != -1) {
+			block_reader_skip(&br, &blk);
+			print_pool_block(&pool, off, &blk);
+		}
+		print_pool_fini(&pool);
+		goto out;
 	}
-	/* Last trace record is at file end */
-	else {
-		off = fsize - sizeof(re);
+
+	while ((raw = block_reader_next(&br, &nr)) != NULL) {
+		if (nr > max) {
+			free(ents);
+			ents = malloc(sizeof(*ents) * nr);
+			if (ents == NULL) {
+				fprintf(stderr, "Failed to malloc %u trace "
+					"records!\n", nr);
+				goto out;
+			}
+			max = nr;
+		}
+		re = decode_trace_entries(raw, nr, ents);
+		for (i = 0; i < nr; i++, re++) {
+			if (parse_fn(&prf->hdr, cnt++, fp, re)) {
+				goto out;
+			}
+		}
 	}
 
-	if (pread(fd, &re, sizeof(re), off) != sizeof(re)) {
-		fprintf(stderr, "pread %ld bytes from off %ld failed, "
-			"error:%d\n", sizeof(re), off, errno);
-		return;
+ out:
+	free(ents);
+	block_reader_fini(&br);
+}
+
+/* Number of records read at a time from each buffer when merging
+ * per-CPU sub-rings
+ */
+#define MERGE_WINDOW	(1024)
+
+struct merge_run {
+	off_t off;		// offset in file of next window
+	off_t end;		// offset in file where this run ends
+	off_t *blocks;		// blocks of a coded run, by offset
+	size_t nr_blocks;	// number of blocks in the run
+	size_t max_blocks;	// max number of blocks before growing
+	size_t next;		// index of the next block to read
+	char *raw;		// records of the last block in file format
+	size_t raw_size;
+	struct rbtrace_entry *ents;// window of records decoded from file
+	struct rbtrace_entry *re;// records in window
+	size_t max;		// max number of records in window
+	size_t nr;		// number of records in window
+	size_t idx;		// index of current record in window
+};
+
+static bool merge_run_load(struct trace_map *tm, struct merge_run *run)
+{
+	size_t nr;
+
+	if (run->off >= run->end) {
+		return false;
 	}
 
-	tv_sec = re.timestamp.tv_sec + prf->hdr.gmtoff;
-	gm = gmtime(&tv_sec);
-	if (gm == NULL) {
-		fprintf(stderr, "invalid timestamp %ld for last trace "
-			"record!\n", re.timestamp.tv_sec);
-		return;
+	nr = (run->end - run->off) / tfmt.size;
+	if (nr > run->max) {
+		nr = run->max;
 	}
 
-	strftime(buf, sizeof(buf), "%m-%d %H:%M:%S", gm);
-	fprintf(fp, "end time  : %s\n", buf);
+	run->nr = nr;
+	run->idx = 0;
+	run->re = trace_map_at(tm, run->off, nr, run->ents);
+	run->off += nr * tfmt.size;
+	return true;
+}
+
+/* Records staged late may be behind others of their block, which are
+ * put back in time order. They are seldom more than a few.
+ */
+static void merge_run_sort(struct merge_run *run)
+{
+	struct rbtrace_entry tmp;
+	size_t i, j;
+
+	for (i = 1; i < run->nr; i++) {
+		if (trace_key(&run->re[i]) >= trace_key(&run->re[i - 1])) {
+			continue;
+		}
+		tmp = run->re[i];
+		for (j = i; (j > 0) &&
+			     (trace_key(&run->re[j - 1]) > trace_key(&tmp));
+		     j--) {
+			run->re[j] = run->re[j - 1];
+		}
+		run->re[j] = tmp;
+	}
 }
 
-static size_t load_trace_page(int fd, uint64_t page_idx,
-			      char *page, size_t page_size)
+/* Decode the next block of a coded run as its window */
+static bool merge_run_load_block(struct block_reader *br,
+				 struct merge_run *run)
 {
-	size_t nbytes;
+	struct rbtrace_block blk;
+	size_t raw_size;
 	off_t off;
+	char *ptr;
 
-	off = sizeof(union padded_rbtrace_fheader) + page_idx * page_size;
-	nbytes = pread(fd, page, page_size, off);
-	if (nbytes == -1) {
-		fprintf(stderr, "pread %zu bytes from off %ld failed, "
-			"error:%d\n", page_size, off, errno);
-	} else if (nbytes % sizeof(struct rbtrace_entry)) {
-		fprintf(stderr, "non-aligned trace page, idx %ld, "
-			"nbytes %zu\n",	page_idx, nbytes);
+	while (run->next < run->nr_blocks) {
+		off = run->blocks[run->next++];
+		ptr = block_reader_get(br, off, sizeof(blk));
+		if (ptr == NULL) {
+			continue;
+		}
+		memcpy(&blk, ptr, sizeof(blk));
+
+		raw_size = (size_t)blk.nr_records * tfmt.size;
+		if (raw_size > run->raw_size) {
+			free(run->raw);
+			free(run->ents);
+			run->ents = NULL;
+			run->raw = malloc(raw_size);
+			run->raw_size = run->raw ? raw_size : 0;
+			if (!trace_in_place() && run->raw) {
+				run->ents = malloc(sizeof(*run->ents) *
+						   blk.nr_records);
+			}
+			if ((run->raw == NULL) ||
+			    (!trace_in_place() && (run->ents == NULL))) {
+				fprintf(stderr, "Failed to malloc %u trace "
+					"records!\n", blk.nr_records);
+				return false;
+			}
+		}
+
+		ptr = block_reader_get(br, off, rbtrace_block_span(&blk));
+		if ((ptr == NULL) ||
+		    (rbtrace_decode_block(&blk, ptr + sizeof(blk),
+					  tfmt.format, tclk.tsc_hz != 0,
+					  run->raw) != 0)) {
+			fprintf(stderr, "Corrupt block %u at off %ld\n",
+				blk.seq, off);
+			continue;
+		}
+
+		run->nr = blk.nr_records;
+		run->idx = 0;
+		run->re = decode_trace_entries(run->raw, run->nr, run->ents);
+		merge_run_sort(run);
+		if (run->nr) {
+			return true;
+		}
 	}
+	return false;
+}
 
-	return nbytes;
+/* Coded runs are read by blocks, raw ones from the mapped file */
+static inline bool merge_run_next(struct trace_map *tm,
+				  struct block_reader *br,
+				  struct merge_run *run)
+{
+	return br ? merge_run_load_block(br, run) : merge_run_load(tm, run);
 }
 
-static bool trace_print_fn(struct rbtrace_fheader *rf,
-			   uint64_t idx, FILE *fp,
-			   struct rbtrace_entry *re)
+static inline struct rbtrace_entry *merge_run_cur(struct merge_run *run)
 {
-	char record_buf[256];
-	char *buf = NULL;
-	int nchars = 0;
-	time_t tv_sec = 0;
-	struct tm *gm = NULL;
+	return &run->re[run->idx];
+}
 
-	/* Check whether this trace ID has been filtered out */
-	if (!(opts.trace_ids & (1 << re->traceid))) {
-		goto out;
+static void merge_heap_down(struct merge_run **heap, size_t nr, size_t i)
+{
+	size_t l, r, min;
+	struct merge_run *tmp;
+
+	while (true) {
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if ((l < nr) &&
+		    (trace_key(merge_run_cur(heap[l])) <
+		     trace_key(merge_run_cur(heap[min])))) {
+			min = l;
+		}
+		if ((r < nr) &&
+		    (trace_key(merge_run_cur(heap[r])) <
+		     trace_key(merge_run_cur(heap[min])))) {
+			min = r;
+		}
+		if (min == i) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
 	}
+}
 
-	tv_sec = re->timestamp.tv_sec + rf->gmtoff;
-	gm = gmtime(&tv_sec);
-	if (gm == NULL) {
-		fprintf(stderr, "idx:%ld, invalid timestamp %ld\n",
-			idx, re->timestamp.tv_sec);
-		goto out;
+/* Room for one more run at the end of runs */
+static struct merge_run *merge_run_add(struct merge_run **runs,
+				       size_t *nr, size_t *max)
+{
+	struct merge_run *tmp;
+
+	if (*nr == *max) {
+		*max = *max ? *max * 2 : 64;
+		tmp = realloc(*runs, *max * sizeof(*tmp));
+		if (tmp == NULL) {
+			fprintf(stderr, "Failed to malloc %zu merge runs!\n",
+				*max);
+			return NULL;
+		}
+		*runs = tmp;
 	}
+	tmp = &(*runs)[(*nr)++];
+	memset(tmp, 0, sizeof(*tmp));
+	return tmp;
+}
 
-	buf = record_buf;
-	if (opts.show_timestamp) {
-		/* Format time stamp, cpu and thread ID */
-		nchars = sprintf(buf, "%02d-%02d %02d:%02d:%02d.%09ld ",
-				 gm->tm_mon + 1, gm->tm_mday, gm->tm_hour,
-				 gm->tm_min, gm->tm_sec,
-				 re->timestamp.tv_nsec);
-		buf += nchars;
+static void merge_runs_free(struct merge_run *runs, size_t nr_runs)
+{
+	size_t i;
+
+	if (runs == NULL) {
+		return;
+	}
+	for (i = 0; i < nr_runs; i++) {
+		free(runs[i].blocks);
+		free(runs[i].raw);
+		free(runs[i].ents);
 	}
+	free(runs);
+}
 
-	nchars = sprintf(buf, "%2d %8d ", re->cpuid, re->thread);
-	buf += nchars;
+/* Split the records in file into runs in which timestamps never go
+ * backwards. Full buffers are runs by themselves, but the partial
+ * buffers flushed on close are not aligned to the buffer size.
+ */
+static struct merge_run *merge_find_runs(struct trace_map *tm,
+					 size_t *nr_runs)
+{
+	size_t nr = 0;
+	size_t max = 0;
+	size_t n = 0;
+	off_t off = 0;
+	off_t next = 0;
+	struct rbtrace_entry *re = NULL;
+	uint64_t last = 0;
+	struct merge_run *runs = NULL;
+	struct merge_run *run = NULL;
+	size_t i;
 
-	/* Format trace record */
-	format_trace_record(buf, re);
+	while ((re = trace_map_next(tm, &n)) != NULL) {
+		off = tm->off - n * tfmt.size;
+		for (i = 0; i < n; i++, re++) {
+			/* Records wrap around at the end of the file */
+			if ((nr == 0) || ((i == 0) && (off != next)) ||
+			    (trace_key(re) < last)) {
+				if (nr > 0) {
+					runs[nr - 1].end = (i == 0) ? next :
+						off + i * tfmt.size;
+				}
+				run = merge_run_add(&runs, &nr, &max);
+				if (run == NULL) {
+					goto fail;
+				}
+				run->off = off + i * tfmt.size;
+			}
+			last = trace_key(re);
+		}
+		next = tm->off;
+	}
+	if (nr > 0) {
+		runs[nr - 1].end = next;
+	}
 
-	fprintf(fp, record_buf);
+	*nr_runs = nr;
+	return runs;
 
- out:
-	return false;
+ fail:
+	merge_runs_free(runs, nr);
+	*nr_runs = 0;
+	return NULL;
+}
+
+/* Split the blocks of a coded file into runs of blocks of a sub-ring
+ * in which timestamps never go backwards. Blocks the index, the time
+ * range or the filters leave out are skipped on their header.
+ */
+static struct merge_run *merge_find_block_runs(struct block_reader *br,
+					       uint32_t nr_subrings,
+					       size_t *nr_runs)
+{
+	struct rbtrace_block blk;
+	struct merge_run *runs = NULL;
+	struct merge_run *run = NULL;
+	size_t *cur = NULL;	// run of each sub-ring, plus one
+	uint64_t *last = NULL;	// latest timestamp of each sub-ring
+	size_t nr = 0;
+	size_t max = 0;
+	uint32_t s;
+	off_t *tmp;
+	off_t off;
+
+	cur = calloc(nr_subrings, sizeof(*cur));
+	last = calloc(nr_subrings, sizeof(*last));
+	if ((cur == NULL) || (last == NULL)) {
+		fprintf(stderr, "Failed to malloc %u merge runs!\n",
+			nr_subrings);
+		goto fail;
+	}
+
+	while ((off = block_reader_find(br, &blk)) != -1) {
+		block_reader_skip(br, &blk);
+		s = blk.subring % nr_subrings;
+		if ((cur[s] == 0) || (blk.min_ts < last[s])) {
+			run = merge_run_add(&runs, &nr, &max);
+			if (run == NULL) {
+				goto fail;
+			}
+			cur[s] = nr;
+		}
+		run = &runs[cur[s] - 1];
+		if (run->nr_blocks == run->max_blocks) {
+			run->max_blocks = run->max_blocks ?
+				run->max_blocks * 2 : 16;
+			tmp = realloc(run->blocks, run->max_blocks *
+				      sizeof(*tmp));
+			if (tmp == NULL) {
+				fprintf(stderr, "Failed to malloc %zu merge "
+					"blocks!\n", run->max_blocks);
+				goto fail;
+			}
+			run->blocks = tmp;
+		}
+		run->blocks[run->nr_blocks++] = off;
+		last[s] = blk.max_ts;
+	}
+
+	free(cur);
+	free(last);
+	*nr_runs = nr;
+	return runs;
+
+ fail:
+	free(cur);
+	free(last);
+	merge_runs_free(runs, nr);
+	*nr_runs = 0;
+	return NULL;
 }
 
+/* Print the records of all runs in timestamp order, the runs are read
+ * from the mapped file or by blocks if br is set.
+ */
 static void
-parse_trace_file(int fd, FILE *fp,
-		 union padded_rbtrace_fheader *prf,
+merge_print_runs(struct trace_map *tm, struct block_reader *br,
+		 struct merge_run *runs, size_t nr_runs, uint64_t window,
+		 int fd, FILE *fp, union padded_rbtrace_fheader *prf,
 		 bool (*parse_fn)(struct rbtrace_fheader *,
 				  uint64_t, FILE *,
 				  struct rbtrace_entry *))
 {
-	bool again = true;
+	struct trace_end te;
+	struct print_pool pool;
+	bool jobs = false;
 	bool stop = false;
-	size_t nbytes = 0;
-	size_t page_size = 0;
-	uint64_t page_idx = 0;
-	char *page = NULL;
-	off_t off_in_pg = 0;
-	off_t off_in_file = 0;
-	struct rbtrace_fheader *rf = NULL;
-	struct rbtrace_entry *re = NULL;
+	size_t nr = 0;
+	size_t i;
 	uint64_t cnt = 0;
+	struct merge_run **heap = NULL;
+	struct merge_run *run = NULL;
 
-	rf = &prf->hdr;
-	page_size = sizeof(*re) * prf->hdr.nr_records;
-	page = malloc(page_size);
-	if (page == NULL) {
-		fprintf(stderr, "Failed to malloc %zu bytes for trace "
-			"record!\n", page_size);
-		goto out;
+	heap = calloc(nr_runs, sizeof(*heap));
+	if (heap == NULL) {
+		fprintf(stderr, "Failed to malloc %zu merge runs!\n",
+			nr_runs);
+		return;
+	}
+
+	for (i = 0; i < nr_runs; i++) {
+		if (merge_run_next(tm, br, &runs[i])) {
+			heap[nr++] = &runs[i];
+		}
 	}
 
-	if (prf->hdr.wrap_pos > sizeof(*prf)) {
-		/* Unable to do binary search in wrap mode */
-		page_idx = (prf->hdr.wrap_pos - sizeof(*prf)) / page_size;
-		off_in_pg = (prf->hdr.wrap_pos - sizeof(*prf)) % page_size;
-	} else if (opts.start_time) {
-		/* TODO: do binary search in file */
+	for (i = nr / 2; i-- > 0; ) {
+		merge_heap_down(heap, nr, i);
 	}
 
-	do {
-		nbytes = load_trace_page(fd, page_idx, page, page_size);
-		if (nbytes <= 0) {
+	/* Records are merged here and formatted by workers */
+	jobs = (opts.nr_jobs > 1) &&
+		print_pool_init(&pool, fd, fp, prf, NULL);
+	trace_end_init(&te, window);
+
+	while (nr > 0) {
+		run = heap[0];
+		if (trace_end_reached(&te, merge_run_cur(run))) {
+			break;
+		}
+		if (jobs) {
+			stop = print_pool_add(&pool, merge_run_cur(run));
+		} else {
+			stop = parse_fn(&prf->hdr, cnt++, fp,
+					merge_run_cur(run));
+		}
+		if (stop) {
 			break;
-		} else if (nbytes <= off_in_pg) {
-			fprintf(stderr, "Invalid pg_idx(%ld) or off_in_pg(%ld)\n",
-				page_idx, off_in_pg);
-			goto out;
-		} else if (nbytes < page_size) {
-			again = false;
 		}
 
-		re = (struct rbtrace_entry *)(page + off_in_pg);
-		while (off_in_pg < nbytes) {
-			/* Parse the trace record */
-			stop = parse_fn(rf, cnt, fp, re);
-			cnt++;
-			if (stop) {
-				goto out;
-			}
-			re++;
-			off_in_pg += sizeof(*re);
+		if ((++run->idx >= run->nr) && !merge_run_next(tm, br, run)) {
+			heap[0] = heap[--nr];
 		}
+		merge_heap_down(heap, nr, 0);
+	}
+	if (jobs) {
+		print_pool_fini(&pool);
+	}
+
+	free(heap);
+}
 
-		page_idx++;
-		off_in_pg = 0;
-	} while (again);
+/* Each buffer written by a per-CPU sub-ring is ordered by itself,
+ * but buffers from different CPUs are interleaved in the file. Do
+ * a k-way merge over all runs to print records in timestamp order,
+ * which also takes care of the wrap position.
+ */
+static void
+parse_trace_file_merged(int fd, FILE *fp,
+			union padded_rbtrace_fheader *prf,
+			bool (*parse_fn)(struct rbtrace_fheader *,
+					 uint64_t, FILE *,
+					 struct rbtrace_entry *))
+{
+	struct trace_map tm;
+	size_t nr_runs = 0;
+	size_t i;
+	struct merge_run *runs = NULL;
+	struct merge_run *run = NULL;
 
-	/* We're done if file is not wrapped or wrapped at the head */
-	if ((prf->hdr.wrap_pos == 0) ||
-	    (prf->hdr.wrap_pos == sizeof(*prf))) {
+	if (!trace_map_init(&tm, fd, prf, MADV_NORMAL)) {
+		return;
+	}
+	runs = merge_find_runs(&tm, &nr_runs);
+	if (runs == NULL) {
 		goto out;
 	}
 
-	/* The file is wrapped, handle the rest of the records */
-	again = true;
-	page_idx = 0;
-	off_in_pg = 0;
-
-	do {
-		nbytes = load_trace_page(fd, page_idx, page, page_size);
-		if (nbytes <= 0) {
-			break;
-		} else if (nbytes <= off_in_pg) {
-			fprintf(stderr, "invalid off_in_pg(%ld)\n",
-				off_in_pg);
-			goto out;
-		} else if (nbytes < page_size) {
-			again = false;
+	for (i = 0; i < nr_runs; i++) {
+		run = &runs[i];
+		run->max = (run->end - run->off) / tfmt.size;
+		if (run->max > MERGE_WINDOW) {
+			run->max = MERGE_WINDOW;
 		}
-
-		re = (struct rbtrace_entry *)(page + off_in_pg);
-		while (off_in_pg < nbytes) {
-			off_in_file = sizeof(*prf) +
-				page_idx * page_size +
-				off_in_pg;
-			if (off_in_file >= prf->hdr.wrap_pos) {
-				/* Done! */
+		if (!trace_in_place()) {
+			run->ents = malloc(sizeof(*run->ents) * run->max);
+			if (run->ents == NULL) {
+				fprintf(stderr, "Failed to malloc merge "
+					"window!\n");
 				goto out;
 			}
-			stop = parse_fn(rf, cnt, fp, re);
-			cnt++;
-			if (stop) {
-				goto out;
-			}
-			re++;
-			off_in_pg += sizeof(*re);
 		}
+	}
 
-		page_idx++;
-		off_in_pg = 0;
-	} while (again);
+	merge_print_runs(&tm, NULL, runs, nr_runs, tm.max, fd, fp, prf,
+			 parse_fn);
 
  out:
-	if (page) {
-		free(page);
+	merge_runs_free(runs, nr_runs);
+	trace_map_fini(&tm);
+}
+
+/* Blocks of a coded file hold a buffer of one sub-ring each, runs of
+ * them are merged a decoded block at a time
+ */
+static void
+parse_trace_blocks_merged(int fd, FILE *fp,
+			  union padded_rbtrace_fheader *prf,
+			  bool (*parse_fn)(struct rbtrace_fheader *,
+					   uint64_t, FILE *,
+					   struct rbtrace_entry *))
+{
+	struct block_reader br;
+	size_t nr_runs = 0;
+	struct merge_run *runs = NULL;
+
+	if (!block_reader_init(&br, fd, prf, true)) {
+		return;
+	}
+	runs = merge_find_block_runs(&br, prf->hdr.nr_subrings, &nr_runs);
+	if (runs != NULL) {
+		merge_print_runs(NULL, &br, runs, nr_runs,
+				 prf->hdr.nr_records ?
+				 prf->hdr.nr_records : 1,
+				 fd, fp, prf, parse_fn);
+	}
+
+	merge_runs_free(runs, nr_runs);
+	block_reader_fini(&br);
+}
+
+/* Parse an arg range like 0:0x1000 or 1:16:64 */
+static bool parse_arg_range(const char *str)
+{
+	char *end = NULL;
+
+	opts.arg = strtol(str, &end, 0);
+	if ((opts.arg < 0) || (opts.arg > 3) || (*end != ':')) {
+		return false;
 	}
+	opts.arg_min = strtoull(end + 1, &end, 0);
+	if (*end == ':') {
+		opts.arg_max = strtoull(end + 1, &end, 0);
+	}
+	return (*end == '\0') && (opts.arg_min <= opts.arg_max);
 }
 
 int main(int argc, char *argv[])
@@ -372,7 +2166,7 @@ int main(int argc, char *argv[])
 	FILE *fp = NULL;
 	struct tm time;
 
-	while ((ch = getopt(argc, argv, "f:o:s:e:i:Ivh")) != -1) {
+	while ((ch = getopt(argc, argv, "f:o:s:e:i:t:c:a:j:Ivh")) != -1) {
 		switch (ch) {
 		case 'f':
 			opts.file_path = optarg;
@@ -381,10 +2175,12 @@ int main(int argc, char *argv[])
 			opts.out_path = optarg;
 			break;
 		case 's':
+			memset(&time, 0, sizeof(time));
 			if (strptime(optarg, "%Y-%m-%d %T", &time) == NULL) {
 				fprintf(stderr, "Illegal time format!\n");
 				goto out;
 			}
+			time.tm_isdst = -1;
 			opts.start_time = mktime(&time);
 			if (opts.start_time == -1) {
 				fprintf(stderr, "Parse time failed!\n");
@@ -392,16 +2188,38 @@ int main(int argc, char *argv[])
 			}
 			break;
 		case 'e':
+			memset(&time, 0, sizeof(time));
 			if (strptime(optarg, "%Y-%m-%d %T", &time) == NULL) {
 				fprintf(stderr, "Illegal time format!\n");
 				goto out;
 			}
+			time.tm_isdst = -1;
 			opts.end_time = mktime(&time);
 			if (opts.end_time == -1) {
 				fprintf(stderr, "Parse time failed!\n");
 				goto out;
 			}
 			break;
+		case 't':
+			opts.thread = strtol(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			if (!parse_arg_range(optarg)) {
+				fprintf(stderr, "Illegal arg range!\n");
+				goto out;
+			}
+			break;
+		case 'j':
+			opts.nr_jobs = strtol(optarg, NULL, 0);
+			if ((opts.nr_jobs < 1) ||
+			    (opts.nr_jobs > PRINT_JOBS_MAX)) {
+				fprintf(stderr, "Illegal number of jobs!\n");
+				goto out;
+			}
+			break;
 		case 'I':
 			opts.only_show_info = true;
 			break;
@@ -458,7 +2276,19 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	parse_trace_file(fd, fp, &prf, trace_print_fn);
+	if ((prf.hdr.minor >= 1) && (prf.hdr.nr_subrings > 1)) {
+		if (tfmt.codec != RBTRACE_CODEC_NONE) {
+			parse_trace_blocks_merged(fd, fp, &prf,
+						  trace_print_fn);
+		} else {
+			parse_trace_file_merged(fd, fp, &prf,
+						trace_print_fn);
+		}
+	} else if (tfmt.codec != RBTRACE_CODEC_NONE) {
+		parse_trace_blocks(fd, fp, &prf, trace_print_fn);
+	} else {
+		parse_trace_file(fd, fp, &prf, trace_print_fn);
+	}
 
  out:
 	if (fd != -1) {
@@ -472,13 +2302,23 @@ static void usage(void)
 	printf("Usage: ./prbt <options>\n"
 	       "       [-f <trace-file>]  Specify trace file path\n"
 	       "       [-o <output-file>] Specify output file path\n"
+	       "       [-s <time>]        Skip records traced before time\n"
+	       "       [-e <time>]        Skip records traced after time,\n"
+	       "                          times are like \"2024-01-31 08:00:00\"\n"
+	       "       [-t <thread>]      Only include records of thread\n"
+	       "       [-c <cpu>]         Only include records traced on cpu\n"
+	       "       [-a <n>:<min>[:<max>]] Only include records with arg n,\n"
+	       "                          0 for a0 to 3 for a3, in [min, max]\n"
+	       "       [-j <jobs>]        Format records on jobs threads\n"
 	       "       [-I]               Only show trace file info\n"
 	       "       [-i <trace-ids>]   Specify trace IDs included,\n"
 	       "                          all traces included by default\n"
 	       "       [-v]               Display version information\n"
 	       "       [-h]               Display this help message\n\n"
 	       "e.g.   ./prbt -f test.rbt.0 -o test.txt -I\n"
-	       "       ./prbt -f test.rbt.0 -i TEST\n\n"
+	       "       ./prbt -f test.rbt.0 -i TEST\n"
+	       "       ./prbt -f test.rbt.0 -i TEST -a 0:0x1000:0x2000\n"
+	       "       ./prbt -f test.rbt.0 -o test.txt -j 8\n\n"
 	       "Available trace IDs:\n%s\n", tflags_to_str(TFLAGS_ALL));
 }
 
@@ -3,28 +3,66 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
 #define RBT_STR
 #include "rbtrace_private.h"
+#include "rbtrace_codec.h"
 #include "version.h"
 
 #define ONE_MB		(1024UL * 1024UL)
 
+/* How long to wait for rbtraced to take a snapshot */
+#define SNAP_WAIT_MSECS	(10000)
+
+/* Full buffers a capture keeps before and writes after a trigger */
+#define DFT_TRIG_PRE	(2)
+#define DFT_TRIG_POST	(2)
+
 struct rbtrace_option {
 	rbtrace_ring_t ring;
+	char *ring_name;
 	char *file;
 	uint64_t size;
 	uint64_t stflags;
 	uint64_t ctflags;
 	bool wrap;
 	bool zap;
+	rbtrace_policy_t policy;
+	uint32_t resize;
+	rbtrace_iomode_t iomode;
+	rbtrace_codec_t codec;
+	bool flight;
+	char *snapshot;
+	struct rbtrace_op_trigger_arg trigger;
 } opts = {
 	.ring = RBTRACE_RING_IO,
+	.ring_name = NULL,
 	.file = NULL,
 	.size = 0,
 	.stflags = 0,
 	.ctflags = 0,
 	.wrap = false,
 	.zap = false,
+	.policy = RBTRACE_POLICY_MAX,
+	.resize = 0,
+	.iomode = RBTRACE_IO_MAX,
+	.codec = RBTRACE_CODEC_MAX,
+	.flight = false,
+	.snapshot = NULL,
+	.trigger = {
+		.path = "",
+		.pre = DFT_TRIG_PRE,
+		.post = DFT_TRIG_POST,
+		.traceid = RBT_NULL,
+		.a0 = 0,
+	},
+};
+
+static struct option long_opts[] = {
+	{"snapshot", required_argument, NULL, 'P'},
+	{"trigger", no_argument, NULL, 'G'},
+	{NULL, 0, NULL, 0},
 };
 
 char *rbtrace_op_str[] = {
@@ -35,9 +73,20 @@ char *rbtrace_op_str[] = {
 	"traffic-flags",
 	"zap",
 	"info",
+	"policy",
+	"resize",
+	"iomode",
+	"flight",
+	"snapshot",
+	"trigger",
+	"codec",
 };
 
 STATIC_ASSERT(sizeof(rbtrace_op_str)/sizeof(rbtrace_op_str[0]) == RBTRACE_OP_MAX);
+STATIC_ASSERT(sizeof(rbt_format_str)/sizeof(rbt_format_str[0]) == RBTRACE_FMT_MAX);
+STATIC_ASSERT(sizeof(rbt_policy_str)/sizeof(rbt_policy_str[0]) == RBTRACE_POLICY_MAX);
+STATIC_ASSERT(sizeof(rbt_iomode_str)/sizeof(rbt_iomode_str[0]) == RBTRACE_IO_MAX);
+STATIC_ASSERT(sizeof(rbt_codec_str)/sizeof(rbt_codec_str[0]) == RBTRACE_CODEC_MAX);
 
 struct flag_name {
 	uint64_t flag;
@@ -67,6 +116,42 @@ struct flag_name {
 		.flag = RBTRACE_DO_FLUSH,
 		.name = "FLUSH",
 	},
+	{
+		.flag = RBTRACE_DO_TSC,
+		.name = "TSC",
+	},
+	{
+		.flag = RBTRACE_DO_RESIZE,
+		.name = "RESIZE",
+	},
+	{
+		.flag = RBTRACE_DO_NUMA,
+		.name = "NUMA",
+	},
+	{
+		.flag = RBTRACE_DO_MMAP,
+		.name = "MMAP",
+	},
+	{
+		.flag = RBTRACE_DO_FLIGHT,
+		.name = "FLIGHT",
+	},
+	{
+		.flag = RBTRACE_DO_SNAP,
+		.name = "SNAP",
+	},
+	{
+		.flag = RBTRACE_DO_FREEZE,
+		.name = "FREEZE",
+	},
+	{
+		.flag = RBTRACE_DO_ARMED,
+		.name = "ARMED",
+	},
+	{
+		.flag = RBTRACE_DO_TRIGGER,
+		.name = "TRIGGER",
+	},
 };
 
 static char *rbtrace_op_to_str(rbtrace_op_t op)
@@ -106,6 +191,14 @@ static char *flags_to_str(uint64_t flags)
 
 static void dump_ring_info(struct rbtrace_op_info_arg *info_arg)
 {
+	char label[32];
+	struct timespec ts;
+	struct policy_stats *ps;
+	uint64_t elapsed;
+	uint64_t records;
+	int p;
+	int i;
+
 	printf("name             : %s\n", info_arg->ring_name);
 	printf("desc             : %s\n", info_arg->ring_desc);
 	printf("flags            : %s\n", flags_to_str(info_arg->flags));
@@ -113,6 +206,73 @@ static void dump_ring_info(struct rbtrace_op_info_arg *info_arg)
 	printf("file size(MB)    : %ld\n", info_arg->file_size / ONE_MB);
 	printf("file path        : %s\n", info_arg->file_path);
 	printf("trace entry size : %d\n", info_arg->trace_entry_size);
+	printf("trace entry fmt  : %s\n",
+	       info_arg->trace_entry_format < RBTRACE_FMT_MAX ?
+	       rbt_format_str[info_arg->trace_entry_format] : "unknown");
+	printf("buffer records   : %d\n", info_arg->nr_records);
+	printf("sub-rings        : %d\n", info_arg->nr_subrings);
+	printf("buffers          : %d\n", info_arg->nr_bufs);
+	printf("overflow policy  : %s\n",
+	       info_arg->policy < RBTRACE_POLICY_MAX ?
+	       rbt_policy_str[info_arg->policy] : "unknown");
+	printf("file io mode     : %s\n",
+	       info_arg->iomode < RBTRACE_IO_MAX ?
+	       rbt_iomode_str[info_arg->iomode] : "unknown");
+	printf("file codec       : %s\n",
+	       info_arg->codec < RBTRACE_CODEC_MAX ?
+	       rbt_codec_str[info_arg->codec] : "unknown");
+	if (info_arg->flags & RBTRACE_DO_ARMED) {
+		printf("trigger          : %s, %u before, %u after",
+		       info_arg->trigger.path, info_arg->trigger.pre,
+		       info_arg->trigger.post);
+		if (info_arg->trigger.traceid < RBT_TRAFFIC_LAST) {
+			printf(", on %s a0 >= %lu",
+			       rbt_tid_str[info_arg->trigger.traceid],
+			       info_arg->trigger.a0);
+		}
+		printf("\n");
+	}
+	/* Overflows under each policy the ring has had */
+	for (p = 0; p < RBTRACE_POLICY_MAX; p++) {
+		ps = &info_arg->stats.rs_policy[p];
+		if ((p != info_arg->policy) && !ps->ps_lost &&
+		    !ps->ps_waits) {
+			continue;
+		}
+		snprintf(label, sizeof(label), "%s lost", rbt_policy_str[p]);
+		printf("%-17s: %lu\n", label, ps->ps_lost);
+		snprintf(label, sizeof(label), "%s waits", rbt_policy_str[p]);
+		printf("%-17s: %lu\n", label, ps->ps_waits);
+		for (i = 0; i < RBTRACE_WAIT_BUCKETS; i++) {
+			if (ps->ps_wait_hist[i] == 0) {
+				continue;
+			}
+			if (i == RBTRACE_WAIT_BUCKETS - 1) {
+				snprintf(label, sizeof(label), ">=%dus",
+					 1 << (i - 1));
+			} else {
+				snprintf(label, sizeof(label), "<%dus",
+					 1 << i);
+			}
+			printf("  %-15s: %lu\n", label, ps->ps_wait_hist[i]);
+		}
+	}
+
+	/*
+	 * Records written from each node since the ring was set up, the
+	 * rate is the average over that whole time, not the current one
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = ts.tv_sec * 1000000000ULL + ts.tv_nsec -
+		info_arg->stats.rs_start_ns;
+	elapsed = elapsed / 1000000 ? elapsed / 1000000 : 1;
+	for (i = 0; (i < info_arg->nr_nodes) && (i < RBTRACE_MAX_NODES);
+	     i++) {
+		records = info_arg->stats.rs_node_records[i];
+		snprintf(label, sizeof(label), "node %d records", i);
+		printf("%-17s: %lu, avg %lu records/s since start\n", label,
+		       records, records * 1000 / elapsed);
+	}
 }
 
 static void usage(void);
@@ -135,16 +295,22 @@ int main(int argc, char *argv[])
 	bool do_info = false;
 	bool do_set_tflags = false;
 	bool do_clear_tflags = false;
+	bool do_policy = false;
+	bool do_resize = false;
+	bool do_iomode = false;
+	bool do_codec = false;
+	bool do_flight = false;
+	bool do_arm = false;
+	bool do_trigger = false;
+	unsigned long records;
+	int i;
 
-	while ((ch = getopt(argc, argv, "vhcir:o:w:z:s:S:C:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "vhcir:o:w:z:s:S:C:O:R:D:E:F:P:T:W:X:G",
+				 long_opts, NULL)) != -1) {
 		switch (ch) {
 		case 'r':
-			if (strcmp(optarg, "io") == 0) {
-				opts.ring = RBTRACE_RING_IO;
-			} else {
-				fprintf(stderr, "Illegal trace ring ID!\n");
-				goto out;
-			}
+			/* Looked up once the shared memory is mapped */
+			opts.ring_name = optarg;
 			break;
 		case 'o':
 			opts.file = optarg;
@@ -207,6 +373,118 @@ int main(int argc, char *argv[])
 			}
 			do_clear_tflags = true;
 			break;
+		case 'O':
+			for (i = 0; i < RBTRACE_POLICY_MAX; i++) {
+				if (strcmp(optarg, rbt_policy_str[i]) == 0) {
+					break;
+				}
+			}
+			if (i >= RBTRACE_POLICY_MAX) {
+				fprintf(stderr, "Invalid overflow policy:%s\n",
+					optarg);
+				goto out;
+			}
+			opts.policy = i;
+			do_policy = true;
+			break;
+		case 'R':
+			records = strtoul(optarg, &endptr, 10);
+			if ((endptr == optarg) || (*endptr != '\0') ||
+			    (records < RBTRACE_MIN_RECORDS) ||
+			    (records > RBTRACE_MAX_RECORDS)) {
+				fprintf(stderr, "Buffer records must be %d-%d\n",
+					RBTRACE_MIN_RECORDS,
+					RBTRACE_MAX_RECORDS);
+				goto out;
+			}
+			opts.resize = records;
+			do_resize = true;
+			break;
+		case 'D':
+			for (i = 0; i < RBTRACE_IO_MAX; i++) {
+				if (strcmp(optarg, rbt_iomode_str[i]) == 0) {
+					break;
+				}
+			}
+			if (i >= RBTRACE_IO_MAX) {
+				fprintf(stderr, "Invalid file io mode:%s\n",
+					optarg);
+				goto out;
+			}
+			opts.iomode = i;
+			do_iomode = true;
+			break;
+		case 'E':
+			for (i = 0; i < RBTRACE_CODEC_MAX; i++) {
+				if (strcmp(optarg, rbt_codec_str[i]) == 0) {
+					break;
+				}
+			}
+			if (i >= RBTRACE_CODEC_MAX) {
+				fprintf(stderr, "Invalid file codec:%s\n",
+					optarg);
+				goto out;
+			}
+			opts.codec = i;
+			do_codec = true;
+			break;
+		case 'F':
+			if (strcmp(optarg, "on") == 0) {
+				opts.flight = true;
+			} else if (strcmp(optarg, "off") == 0) {
+				opts.flight = false;
+			} else {
+				fprintf(stderr, "Invalid option:%s\n", optarg);
+				goto out;
+			}
+			do_flight = true;
+			break;
+		case 'P':
+			opts.snapshot = optarg;
+			if (strlen(opts.snapshot) >= RBTRACE_MAX_PATH) {
+				fprintf(stderr, "Path too long! Must be less than %d characters!\n",
+					RBTRACE_MAX_PATH);
+				goto out;
+			}
+			break;
+		case 'T':
+			if (strcmp(optarg, "off") != 0) {
+				if (strlen(optarg) >= RBTRACE_MAX_PATH) {
+					fprintf(stderr, "Path too long! Must be less than %d characters!\n",
+						RBTRACE_MAX_PATH);
+					goto out;
+				}
+				strcpy(opts.trigger.path, optarg);
+			}
+			do_arm = true;
+			break;
+		case 'W':
+			if (sscanf(optarg, "%u:%u", &opts.trigger.pre,
+				   &opts.trigger.post) != 2) {
+				fprintf(stderr, "Invalid window:%s\n", optarg);
+				goto out;
+			}
+			break;
+		case 'X':
+			endptr = strchr(optarg, ':');
+			if (endptr) {
+				*endptr++ = '\0';
+				opts.trigger.a0 = strtoull(endptr, NULL, 0);
+			}
+			for (i = RBT_LOST; i < RBT_TRAFFIC_LAST; i++) {
+				if (strcmp(optarg, rbt_tid_str[i]) == 0) {
+					break;
+				}
+			}
+			if (i >= RBT_TRAFFIC_LAST) {
+				fprintf(stderr, "Invalid trace:%s\n", optarg);
+				goto out;
+			}
+			opts.trigger.traceid = i;
+			break;
+		case 'G':
+			do_trigger = true;
+			break;
 		case 'v':
 			version();
 			goto out;
@@ -225,6 +503,17 @@ int main(int argc, char *argv[])
 	}
 	rbtrace_inited = true;
 
+	if (opts.ring_name) {
+		rc = rbtrace_ring_find(opts.ring_name);
+		if (rc < 0) {
+			fprintf(stderr, "Illegal trace ring:%s!\n",
+				opts.ring_name);
+			goto out;
+		}
+		opts.ring = rc;
+		rc = 0;
+	}
+
 	if (do_wrap) {
 		op = RBTRACE_OP_WRAP;
 		rc = rbtrace_ctrl(opts.ring, op, &opts.wrap);
@@ -252,6 +541,49 @@ int main(int argc, char *argv[])
 			goto out;
 		}
 	}
+	if (do_flight) {
+		op = RBTRACE_OP_FLIGHT;
+		rc = rbtrace_ctrl(opts.ring, op, &opts.flight);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+	}
+	if (do_arm) {
+		op = RBTRACE_OP_TRIGGER;
+		rc = rbtrace_ctrl(opts.ring, op, &opts.trigger);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+	}
+	if (do_trigger) {
+		rc = rbtrace_trigger(opts.ring);
+		if (rc != 0) {
+			fprintf(stderr, "ring:%d is not armed\n", opts.ring);
+			goto out;
+		}
+	}
+	if (do_iomode) {
+		op = RBTRACE_OP_IOMODE;
+		rc = rbtrace_ctrl(opts.ring, op, &opts.iomode);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+	}
+	if (do_codec) {
+		op = RBTRACE_OP_CODEC;
+		rc = rbtrace_ctrl(opts.ring, op, &opts.codec);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+	}
 	if (do_open) {
 		op = RBTRACE_OP_OPEN;
 		rc = rbtrace_ctrl(opts.ring, op, opts.file);
@@ -291,6 +623,42 @@ int main(int argc, char *argv[])
 			goto out;
 		}
 	}
+	if (do_policy) {
+		op = RBTRACE_OP_POLICY;
+		rc = rbtrace_ctrl(opts.ring, op, &opts.policy);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+	}
+	if (do_resize) {
+		op = RBTRACE_OP_RESIZE;
+		rc = rbtrace_ctrl(opts.ring, op, &opts.resize);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+	}
+	if (opts.snapshot) {
+		op = RBTRACE_OP_SNAPSHOT;
+		rc = rbtrace_ctrl(opts.ring, op, opts.snapshot);
+		if (rc != 0) {
+			fprintf(stderr, "op:%s failed, error:%d\n",
+				rbtrace_op_to_str(op), rc);
+			goto out;
+		}
+		/* Return once the file is complete */
+		for (i = 0; i < SNAP_WAIT_MSECS / 10; i++) {
+			rc = rbtrace_ctrl(opts.ring, RBTRACE_OP_INFO,
+					  &info_arg);
+			if ((rc != 0) || !(info_arg.flags & RBTRACE_DO_SNAP)) {
+				break;
+			}
+			usleep(10000);
+		}
+	}
 	if (do_info) {
 		op = RBTRACE_OP_INFO;
 		rc = rbtrace_ctrl(opts.ring, op, &info_arg);
@@ -313,7 +681,7 @@ int main(int argc, char *argv[])
 static void usage(void)
 {
 	printf("Usage: ./rbt <options>\n"
-	       "       [-r <ring-id>]   Specify trace ring, io by default\n"
+	       "       [-r <ring>]      Specify trace ring by name, io by default\n"
 	       "       [-o <tracefile>] Open trace file\n"
 	       "       [-c]             Flush and close trace file\n"
 	       "       [-s <size-MB>]   Specify trace file size in MB\n"
@@ -321,9 +689,25 @@ static void usage(void)
 	       "       [-z on|off]      Enable/disable zap, exclusive with wrap\n"
 	       "       [-S <trace-id>]  Set trace ID to be enabled\n"
 	       "       [-C <trace-id>]  Clear trace ID to be disabled\n"
+	       "       [-O <policy>]    Overflow policy: drop, spin, wait or block\n"
+	       "       [-R <records>]   Resize buffers of the ring to records\n"
+	       "       [-D <mode>]      File io mode: buffered, direct, dontneed or mmap\n"
+	       "       [-E <codec>]     File codec: none, raw, delta or lz, mmap\n"
+	       "                        files are never coded\n"
+	       "       [-F on|off]      Enable/disable flight recorder mode, the\n"
+	       "                        ring is only written out by snapshots\n"
+	       "       [-P|--snapshot <file>] Snapshot a flight recorder ring to file\n"
+	       "       [-T <file>|off]  Arm/disarm triggered capture of a flight\n"
+	       "                        recorder ring to file.<time> files\n"
+	       "       [-W <pre>:<post>] Full buffers a capture keeps before and\n"
+	       "                        writes after its trigger, default %d:%d\n"
+	       "       [-X <trace>[:<a0>]] Trigger on records of trace with a0\n"
+	       "                        of at least a0, e.g. LOST or TEST:1000\n"
+	       "       [-G|--trigger]   Trigger a capture of an armed ring\n"
 	       "       [-v]             Display the version information\n"
 	       "       [-h]             Display this help message\n\n"
-	       "Available trace IDs:\n%s\n", tflags_to_str(TFLAGS_ALL));
+	       "Available trace IDs:\n%s\n", DFT_TRIG_PRE, DFT_TRIG_POST,
+	       tflags_to_str(TFLAGS_ALL));
 }
 
 static void version(void)
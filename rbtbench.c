@@ -8,10 +8,13 @@
 #include <sys/syscall.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
 #include <pthread.h>
 #include <assert.h>
 #include "rbtrace.h"
 #include "rbtracedef.h"
+#include "rbtrace_private.h"
 
 #ifndef gettid
 #define gettid()	syscall(__NR_gettid)
@@ -19,6 +22,11 @@
 
 #define SHM_NAME	"rbtbench"
 
+#define NSEC_PER_SEC	(1000000000ULL)
+
+/* Largest batch in batch mode */
+#define BENCH_MAX_BATCH	64
+
 /* Utility macro for tracing */
 #define RBT_TRACE_TEST(_dev_, _op_, _off_, _len_)	\
 	{						\
@@ -38,10 +46,16 @@ struct bench_option {
 	int nr_processes;
 	int nr_threads;
 	int nr_traces;
+	int delay;
+	char *mode;
+	bool stage;
 } opts = {
 	.nr_processes = 1,
 	.nr_threads = 1,
 	.nr_traces = 128 * 1024,
+	.delay = 10000,
+	.mode = "trace",
+	.stage = false,
 };
 
 struct bench_context {
@@ -49,15 +63,100 @@ struct bench_context {
 	pthread_cond_t cond;
 	int ready_threads;
 	int x;
+	int next_role;		// role of the next thread in filter mode
+	int done_producers;	// producers done in filter mode
 };
 
-static void do_bench(struct bench_context *ctx)
+/* Config of a dTLB miss counter for the given cache op */
+#define BENCH_DTLB_MISSES(_op_)					\
+	(PERF_COUNT_HW_CACHE_DTLB | ((_op_) << 8) |		\
+	 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* Per thread hardware counter, unavailable if fd is -1 */
+struct perf_counter {
+	int fd;
+	uint64_t start;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void perf_counter_start(struct perf_counter *pc,
+			       uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	/* Count for the calling thread on any CPU */
+	pc->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	pc->start = 0;
+	if (pc->fd != -1) {
+		if (read(pc->fd, &pc->start, sizeof(pc->start)) !=
+		    sizeof(pc->start)) {
+			close(pc->fd);
+			pc->fd = -1;
+		}
+	}
+}
+
+/* Format counter delta per operation, "n/a" if no PMU access */
+static char *perf_counter_per_op(struct perf_counter *pc, uint64_t nr_ops)
+{
+	static __thread char buf[32];
+	uint64_t value;
+
+	if ((pc->fd == -1) || (nr_ops == 0) ||
+	    (read(pc->fd, &value, sizeof(value)) != sizeof(value))) {
+		return "n/a";
+	}
+
+	snprintf(buf, sizeof(buf), "%.3f",
+		 (double)(value - pc->start) / nr_ops);
+	return buf;
+}
+
+static void perf_counter_stop(struct perf_counter *pc)
+{
+	if (pc->fd != -1) {
+		close(pc->fd);
+		pc->fd = -1;
+	}
+}
+
+static void bench_trace(struct bench_context *ctx)
 {
 	int x;
 	int i;
+	uint64_t nr_records = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	struct perf_counter misses;
+	struct perf_counter tlb_loads;
+	struct perf_counter tlb_stores;
 
 	srand((int)time(NULL));
 
+	perf_counter_start(&misses, PERF_TYPE_HARDWARE,
+			   PERF_COUNT_HW_CACHE_MISSES);
+	/* Records land on random slots of a large buffer, see what
+	 * huge pages save in TLB misses
+	 */
+	perf_counter_start(&tlb_loads, PERF_TYPE_HW_CACHE,
+			   BENCH_DTLB_MISSES(PERF_COUNT_HW_CACHE_OP_READ));
+	perf_counter_start(&tlb_stores, PERF_TYPE_HW_CACHE,
+			   BENCH_DTLB_MISSES(PERF_COUNT_HW_CACHE_OP_WRITE));
+	start = now_ns();
 	while ((x = __sync_add_and_fetch(&ctx->x, 1)) <= opts.nr_traces) {
 		/* Trace op start */
 		RBT_TRACE_TEST(1, RBT_TRAFFIC_READ_START, x, 512);
@@ -65,14 +164,160 @@ static void do_bench(struct bench_context *ctx)
 		/* Just randomly consume some time between two trace
 		 * records
 		 */
-		i = rand() % 10000;
+		i = opts.delay ? rand() % opts.delay : 0;
 		while (i > 0) {
 			i--;
 		}
 
 		/* Trace op done */
 		RBT_TRACE_TEST(1, RBT_TRAFFIC_READ_DONE, x, 512);
+		nr_records += 2;
+	}
+	elapsed = now_ns() - start;
+
+	if (nr_records) {
+		printf("thread:%ld %lu records, %lu ns/record, "
+		       "%lu records/s, cache-misses/record %s, ", gettid(),
+		       nr_records, elapsed / nr_records,
+		       (uint64_t)(nr_records * NSEC_PER_SEC /
+				  (elapsed ? elapsed : 1)),
+		       perf_counter_per_op(&misses, nr_records));
+		printf("dTLB-load-misses/record %s, ",
+		       perf_counter_per_op(&tlb_loads, nr_records));
+		printf("dTLB-store-misses/record %s\n",
+		       perf_counter_per_op(&tlb_stores, nr_records));
+	}
+	perf_counter_stop(&misses);
+	perf_counter_stop(&tlb_loads);
+	perf_counter_stop(&tlb_stores);
+}
+
+/* Half of the threads trace records while the other half keep
+ * checking whether the trace ID is enabled like a filtering caller
+ * does, to see how much producers slow the filter checks down
+ */
+static void bench_filter(struct bench_context *ctx)
+{
+	int nr_producers;
+	uint64_t nr_checks = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	struct perf_counter misses;
+
+	nr_producers = (opts.nr_processes * opts.nr_threads + 1) / 2;
+	if (__sync_fetch_and_add(&ctx->next_role, 1) % 2 == 0) {
+		bench_trace(ctx);
+		__sync_add_and_fetch(&ctx->done_producers, 1);
+		return;
 	}
+
+	perf_counter_start(&misses, PERF_TYPE_HARDWARE,
+			   PERF_COUNT_HW_CACHE_MISSES);
+	start = now_ns();
+	while (ctx->done_producers < nr_producers) {
+		(void)rbtrace_traffic_enabled(RBTRACE_RING_IO,
+					      RBT_TRAFFIC_TEST);
+		nr_checks++;
+	}
+	elapsed = now_ns() - start;
+
+	printf("thread:%ld %lu filter checks, %lu checks/s, "
+	       "cache-misses/check %s\n", gettid(), nr_checks,
+	       (uint64_t)(nr_checks * NSEC_PER_SEC /
+			  (elapsed ? elapsed : 1)),
+	       perf_counter_per_op(&misses, nr_checks));
+	perf_counter_stop(&misses);
+}
+
+/* Trace nr_traces records at each batch size from 1 to
+ * BENCH_MAX_BATCH to show the amortized cost of a record
+ */
+static void bench_batch(struct bench_context *ctx)
+{
+	struct rbtrace_rec recs[BENCH_MAX_BATCH];
+	uint64_t nr_records;
+	uint64_t nr_lost;
+	uint64_t start;
+	uint64_t elapsed;
+	int batch;
+	int ret;
+	int i;
+
+	for (i = 0; i < BENCH_MAX_BATCH; i++) {
+		recs[i].traceid = RBT_TRAFFIC_TEST;
+		recs[i].a0 = i;
+		recs[i].a1 = 512;
+		recs[i].a2 = 1;
+		recs[i].a3 = RBT_TRAFFIC_WRITE_START;
+	}
+
+	for (batch = 1; batch <= BENCH_MAX_BATCH; batch *= 2) {
+		nr_records = 0;
+		nr_lost = 0;
+		start = now_ns();
+		while (nr_records + nr_lost < opts.nr_traces) {
+			ret = rbtrace_batch(RBTRACE_RING_IO, batch, recs);
+			if (ret < 0) {
+				printf("trace batch failed!\n");
+				return;
+			}
+			nr_records += ret;
+			nr_lost += batch - ret;
+		}
+		elapsed = now_ns() - start;
+
+		printf("thread:%ld batch:%2d %lu records, %.1f ns/record, "
+		       "%lu lost\n", gettid(), batch, nr_records,
+		       (double)elapsed / (nr_records + nr_lost), nr_lost);
+	}
+}
+
+static void do_bench(struct bench_context *ctx)
+{
+	if (opts.stage && (rbtrace_stage_thread(1) != 0)) {
+		printf("thread:%ld enable staging failed!\n", gettid());
+	}
+
+	if (strcmp(opts.mode, "filter") == 0) {
+		bench_filter(ctx);
+	} else if (strcmp(opts.mode, "batch") == 0) {
+		bench_batch(ctx);
+	} else {
+		bench_trace(ctx);
+	}
+}
+
+
+
+/* Compare the cost of the timestamp sources a record can use */
+static void bench_clock(void)
+{
+	struct timespec ts;
+	uint64_t start;
+	uint64_t clock_ns;
+	uint64_t tsc_ns;
+	volatile uint64_t tsc;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < opts.nr_traces; i++) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+	}
+	clock_ns = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < opts.nr_traces; i++) {
+		tsc = rdtsc();
+	}
+	tsc_ns = now_ns() - start;
+	(void)tsc;
+
+	printf("clock_gettime : %.1f ns/record\n",
+	       (double)clock_ns / opts.nr_traces);
+	printf("rdtsc         : %.1f ns/record\n",
+	       (double)tsc_ns / opts.nr_traces);
+	printf("saved         : %.1f ns/record\n",
+	       ((double)clock_ns - tsc_ns) / opts.nr_traces);
 }
 
 static void usage(void);
@@ -131,7 +376,7 @@ int main(int argc, char *argv[])
 	pid_t pid = -1;
 	int i;
 
-	while ((ch = getopt(argc, argv, "p:t:n:h")) != -1) {
+	while ((ch = getopt(argc, argv, "p:t:n:d:m:sh")) != -1) {
 		switch (ch) {
 		case 'p':
 			opts.nr_processes = atoi(optarg);
@@ -154,6 +399,19 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'd':
+			opts.delay = atoi(optarg);
+			if (opts.delay < 0) {
+				fprintf(stderr, "Invalid delay\n");
+				goto out;
+			}
+			break;
+		case 'm':
+			opts.mode = optarg;
+			break;
+		case 's':
+			opts.stage = true;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -161,6 +419,17 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (strcmp(opts.mode, "clock") == 0) {
+		bench_clock();
+		goto out;
+	} else if ((strcmp(opts.mode, "trace") != 0) &&
+		   (strcmp(opts.mode, "filter") != 0) &&
+		   (strcmp(opts.mode, "batch") != 0)) {
+		fprintf(stderr, "Invalid mode %s\n", opts.mode);
+		usage();
+		goto out;
+	}
+
 	/* Create shared memory */
 	shmfd = shm_open(SHM_NAME, O_RDWR|O_CREAT|O_EXCL, 0666);
 	if (shmfd == -1) {
@@ -218,6 +487,12 @@ int main(int argc, char *argv[])
 	}
 	rbtrace_inited = true;
 
+	if (is_parent) {
+		printf("trace buffers on %s pages\n",
+		       (rbt_globals.dir_ptr->sd_flags & RBTRACE_SHM_HUGE) ?
+		       "huge" : "4KB");
+	}
+
 	/* Create benchmark threads */
 	if (opts.nr_threads > 1) {
 		threads = malloc(sizeof(*threads) * opts.nr_threads);
@@ -314,5 +589,13 @@ int main(int argc, char *argv[])
 
 static void usage(void)
 {
-	printf("Usage: ./rbtbench -p #processes -t #threads -n #traces\n");
+	printf("Usage: ./rbtbench -p #processes -t #threads -n #traces\n"
+	       "       [-d <delay>]  Max busy loops between records, 0 to disable\n"
+	       "       [-s]          Stage records in thread local buffers\n"
+	       "       [-m <mode>]   trace: trace records, the default\n"
+	       "                     filter: half of threads check trace ID\n"
+	       "                             while the others trace\n"
+	       "                     batch: trace in batches of 1 to %d\n"
+	       "                     clock: compare timestamp sources\n",
+	       BENCH_MAX_BATCH);
 }
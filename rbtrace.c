@@ -6,10 +6,18 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/syscall.h>
 #include <sched.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <signal.h>
+#include <cpuid.h>
 #include <assert.h>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define RBTRACE_HAVE_RSEQ
+#endif
 #include "rbtracedef.h"
 #include "rbtrace.h"
 #include "rbtrace_private.h"
@@ -18,15 +26,89 @@
 #define gettid() syscall(__NR_gettid)
 #endif
 
-#ifndef pause
-#define pause()	__asm __volatile("pause\n": : : "memory")
+#ifndef bit_RDTSCP
+#define bit_RDTSCP	(1 << 27)
 #endif
 
+/* Linux keeps the CPU number in the low 12 bits of TSC_AUX */
+#define TSC_AUX_CPU_MASK	(0xFFF)
+
+/* Where the CPU number of a record comes from, cheapest first */
+typedef enum rbtrace_cpu_src {
+	RBTRACE_CPU_RSEQ = 0,
+	RBTRACE_CPU_RDTSCP,
+	RBTRACE_CPU_GETCPU,
+} rbtrace_cpu_src_t;
+
+static rbtrace_cpu_src_t rbt_cpu_src = RBTRACE_CPU_GETCPU;
+static pthread_once_t rbt_once = PTHREAD_ONCE_INIT;
+
+/* Thread ID cached per thread, cleared in the child after fork */
+static __thread pid_t rbt_tid = 0;
+
+/* Records a staging thread keeps before publishing them to the ring */
+#define RBTRACE_STAGE_ENTRIES		(64)
+
+/* How often records of quiet staging threads are published */
+#define RBTRACE_STAGE_FLUSH_USECS	(100000)
+
+/* Thread local staging buffer. Entries are built in the format of
+ * their ring and published with one slot claim and a memcpy.
+ */
+struct rbtrace_stage {
+	struct rbtrace_stage *next;
+	volatile int lock;	// held by owner while staging a record
+	int nr[RBTRACE_RING_MAX];// number of staged entries per ring
+	char ents[][RBTRACE_STAGE_ENTRIES *
+		    sizeof(struct rbtrace_entry)];// one per configured ring
+};
+
+/* v1 entries are the largest */
+STATIC_ASSERT(sizeof(struct rbtrace_entry) >=
+	      sizeof(struct rbtrace_entry_v2));
+
+/* How rbtrace_stage_flush_all() treats stages in use by their owner */
+#define RBTRACE_STAGE_TRY	(0)	// skip them
+#define RBTRACE_STAGE_WAIT	(1)	// wait for the owner
+
+static __thread struct rbtrace_stage *rbt_stage = NULL;
+static struct rbtrace_stage *rbt_stages = NULL;
+static pthread_mutex_t rbt_stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rbt_stage_key;
+static pthread_t rbt_stage_timer;
+static bool rbt_stage_timer_running = false;
+static volatile bool rbt_stage_timer_stop = false;
+
+/* Staged records are published before the process dies of these */
+static const int rbt_fatal_signals[] = {
+	SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT,
+};
+#define RBT_NR_FATAL_SIGNALS	\
+	(sizeof(rbt_fatal_signals)/sizeof(rbt_fatal_signals[0]))
+static struct sigaction rbt_fatal_oldacts[RBT_NR_FATAL_SIGNALS];
+static bool rbt_fatal_installed = false;
+
+/* Buffers of a resized ring live in shm segments of their own,
+ * mapped by each process the first time it sees them
+ */
+struct rbtrace_seg {
+	struct rbtrace_seg *next;
+	volatile uint32_t seg;	// segment number, 0 if not mapped
+	char *base;
+	size_t size;
+};
+
+static struct rbtrace_seg rbt_segs[RBTRACE_RING_MAX][2];
+static struct rbtrace_seg *rbt_segs_retired = NULL;
+static pthread_mutex_t rbt_seg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* For now we only support at most 64 trace IDs */
 STATIC_ASSERT(RBT_TRAFFIC_LAST < 64);
 
 #define IO_RING_SIZE	(64*1024)
+#define IO_RING_CPU_SIZE	(8*1024)
 
+/* Rings rbtraced sets up unless configured otherwise */
 struct ring_config ring_cfgs[] = {
 	{
 		.rc_ring = RBTRACE_RING_IO,
@@ -34,164 +116,1142 @@ struct ring_config ring_cfgs[] = {
 		.rc_desc = "I/O traffic",
 		.rc_flags = 0,
 		.rc_size = IO_RING_SIZE,
-		.rc_data_size = IO_RING_SIZE * sizeof(struct rbtrace_entry),
+		.rc_cpu_size = IO_RING_CPU_SIZE,
+		.rc_format = RBTRACE_FMT_V1,
+		.rc_policy = RBTRACE_POLICY_SPIN,
+		.rc_nr_bufs = RBTRACE_DFT_BUFS,
 	},
 };
 
-STATIC_ASSERT((sizeof(ring_cfgs)/sizeof(ring_cfgs[0])) ==
-	      RBTRACE_RING_MAX);
+int nr_ring_cfgs = sizeof(ring_cfgs)/sizeof(ring_cfgs[0]);
+
+STATIC_ASSERT(sizeof(uint64_t) <= RBTRACE_SHM_DIR_OFF);
+STATIC_ASSERT(RBTRACE_SHM_DIR_OFF + sizeof(struct rbtrace_shm_dir) <=
+	      RBTRACE_SHM_RI_OFF);
+
+/* One pending bit per ring in the doorbell */
+STATIC_ASSERT(RBTRACE_RING_MAX <= 64);
 
 struct rbtrace_global_data rbt_globals = {
 	.inited = false,
 	.shm_fd = -1,
 	.shm_size = 0,
 	.shm_base = MAP_FAILED,
-	.sem_ptr = SEM_FAILED,
 	.fsize_ptr = NULL,
-	.ring_ptr = NULL,
+	.db_ptr = NULL,
+	.dir_ptr = NULL,
+	.nr_rings = 0,
+	.nr_nodes = 0,
 	.ri_ptr = NULL,
 	.re_base = NULL,
 };
 
-void rbtrace_signal_thread(struct ring_info *ri)
+struct rbtrace_numa rbt_numa = {
+	.nr_nodes = 1,
+};
+
+/* Ring the doorbell of the flusher of a NUMA node, control requests
+ * go to node 0 which owns the trace files
+ */
+void rbtrace_signal_thread(struct ring_info *ri, uint32_t node)
+{
+	struct rbtrace_doorbell *db = &rbt_globals.db_ptr[node];
+
+	/* The locked OR also orders the check of db_waiting after it */
+	__sync_fetch_and_or(&db->db_pending, 1ULL << ri->ri_ring);
+	if (db->db_waiting) {
+		__sync_add_and_fetch(&db->db_futex, 1);
+		if (rbtrace_futex(&db->db_futex, FUTEX_WAKE, 1, NULL) == -1) {
+			dprintf("ring:%d futex wake failed, error:%d\n",
+				ri->ri_ring, errno);
+		}
+	}
+}
+
+static inline pid_t rbtrace_gettid(void)
+{
+	if (rbt_tid == 0) {
+		rbt_tid = gettid();
+	}
+	return rbt_tid;
+}
+
+static inline int rbtrace_getcpu(void)
+{
+	uint32_t aux;
+#ifdef RBTRACE_HAVE_RSEQ
+	struct rseq *rs;
+	int cpu;
+
+	if (rbt_cpu_src == RBTRACE_CPU_RSEQ) {
+		rs = (struct rseq *)((char *)__builtin_thread_pointer() +
+				     __rseq_offset);
+		cpu = (int)rs->cpu_id;
+		if (cpu >= 0) {
+			return cpu;
+		}
+	}
+#endif
+	if (rbt_cpu_src == RBTRACE_CPU_RDTSCP) {
+		rdtscp(&aux);
+		return aux & TSC_AUX_CPU_MASK;
+	}
+
+	return sched_getcpu();
+}
+
+static void rbtrace_atfork_child(void)
+{
+	rbt_tid = 0;
+
+	/* Staging is not inherited, the staged records belong to the
+	 * parent and the other threads and the timer are gone
+	 */
+	pthread_mutex_init(&rbt_stage_mutex, NULL);
+	rbt_stages = NULL;
+	rbt_stage_timer_running = false;
+	if (rbt_stage) {
+		pthread_setspecific(rbt_stage_key, NULL);
+		free(rbt_stage);
+		rbt_stage = NULL;
+	}
+}
+
+static void rbtrace_stage_destroy(void *arg);
+
+/* Pick the cheapest way to get the CPU number, glibc registers rseq
+ * for each thread and the kernel keeps cpu_id updated in it. Fall
+ * back to TSC_AUX which the kernel sets to the CPU number.
+ */
+static void rbtrace_once_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	pthread_atfork(NULL, NULL, rbtrace_atfork_child);
+	pthread_key_create(&rbt_stage_key, rbtrace_stage_destroy);
+	rbtrace_numa_init();
+
+#ifdef RBTRACE_HAVE_RSEQ
+	if (__rseq_size > 0) {
+		rbt_cpu_src = RBTRACE_CPU_RSEQ;
+		return;
+	}
+#endif
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+	    (edx & bit_RDTSCP)) {
+		rbt_cpu_src = RBTRACE_CPU_RDTSCP;
+		return;
+	}
+
+	rbt_cpu_src = RBTRACE_CPU_GETCPU;
+}
+
+/* Overflow policy limits: spin loops, sleep for a swap and the
+ * longest a producer blocks for the flusher
+ */
+#define RBTRACE_SPIN_LOOPS	(1024)
+#define RBTRACE_WAIT_USECS	(10000)
+#define RBTRACE_BLOCK_USECS	(1000000)
+
+/* Timestamp of a record, taken once for all records of a batch */
+struct ring_stamp {
+	struct timespec ts;
+	uint64_t val;		// TSC ticks or nanoseconds since epoch
+};
+
+static inline void
+ring_stamp(struct ring_info *ri, struct ring_stamp *st)
 {
-	(*rbt_globals.ring_ptr) = ri->ri_ring;
-	if (sem_post(rbt_globals.sem_ptr) == -1) {
-		dprintf("ring:%d sem_post failed, error:%d\n",
-			ri->ri_ring, errno);
+	if (ri->ri_flags & RBTRACE_DO_TSC) {
+		st->val = rdtsc();
+	} else {
+		clock_gettime(CLOCK_REALTIME, &st->ts);
+		st->val = st->ts.tv_sec * 1000000000ULL + st->ts.tv_nsec;
 	}
 }
 
-static struct rbtrace_entry *
-ringwrap_slot(struct ring_config *cfg,
-	      struct ring_info *ri,
-	      uint32_t slot)
+static inline void
+ring_entry_init(struct ring_info *ri, char *ent, int cpuid,
+		uint8_t traceid, uint8_t commit,
+		const struct ring_stamp *st)
 {
 	struct rbtrace_entry *re;
-	int lost;
+	struct rbtrace_entry_v2 *re2;
 
-	if (slot == cfg->rc_size) {
-		/* swap ring buffer */
-		if (__sync_add_and_fetch(&ri->ri_flush, 1) == 1) {
-			/* No buffer flush in progress, swap cir_off & alt_off,
-			 * guarded by ri_flush and CMPXCHG
-			 */
-			int temp;
-			temp = ri->ri_cir_off;
-			ri->ri_cir_off = ri->ri_alt_off;
-			ri->ri_alt_off = temp;
-
-			__sync_lock_test_and_set(&ri->ri_slot, -1);
-
-			/* Prior buffer flush (if any) has done,
-			 * reset lost statistics
-			 */
-			lost = __sync_lock_test_and_set(&ri->ri_lost, 0);
-			if (lost) {
-				rbtrace(RBTRACE_RING_IO, RBT_LOST, lost, 0, 0, 0);
-				dprintf("ring:%d lost %d records\n",
-					ri->ri_ring, lost);
-			}
-			rbtrace_signal_thread(ri);
+	if (ri->ri_format == RBTRACE_FMT_V1) {
+		re = (struct rbtrace_entry *)ent;
+		if (ri->ri_flags & RBTRACE_DO_TSC) {
+			re->tsc = st->val;
 		} else {
-			/* The last buffer flush is still in progress,
-			 * the records in current buffer will be
-			 * discarded
-			 */
-			__sync_lock_test_and_set(&ri->ri_slot, -1);
-
-			/* Wake if missed or still processing prior
-			 * flush to disk
-			 */
-			rbtrace_signal_thread(ri);
-		}
-
-		slot = __sync_add_and_fetch(&ri->ri_slot, 1);
-		if (slot < cfg->rc_size) {
-			re = ((struct rbtrace_entry *)
-			      (rbt_globals.re_base + ri->ri_cir_off)) + slot;
-			clock_gettime(CLOCK_REALTIME, &re->timestamp);
-			re->cpuid = (uint16_t)sched_getcpu();
-			re->thread = gettid();
-			return re;
-		}
-
-		__sync_val_compare_and_swap(&ri->ri_slot, slot, -1);
-		__sync_add_and_fetch(&ri->ri_lost, 1);
-		dprintf("ring:%d slot:%d trace lost\n", ri->ri_ring, slot);
+			re->timestamp = st->ts;
+		}
+		re->cpuid = (uint16_t)cpuid;
+		re->thread = rbtrace_gettid();
+		re->traceid = traceid;
+		re->commit = commit;
+	} else {
+		/* Compact entries share the layout of v2 up to a1 */
+		re2 = (struct rbtrace_entry_v2 *)ent;
+		re2->timestamp = st->val;
+		re2->cpuid = (uint16_t)cpuid;
+		re2->thread = rbtrace_gettid();
+		re2->traceid = traceid;
+		re2->commit = commit;
+	}
+}
+
+/* Map the shm segment of a resized ring, or the trace file of a ring
+ * whose buffers live in it, into this process
+ */
+static char *ring_seg_map(struct ring_info *ri, uint32_t layout,
+			  uint32_t seg)
+{
+	struct rbtrace_seg *sg;
+	struct rbtrace_seg *old;
+	char name[RBTRACE_MAX_NAME];
+	char *base = NULL;
+	struct stat st;
+	int fd;
+
+	pthread_mutex_lock(&rbt_seg_mutex);
+	sg = &rbt_segs[ri->ri_ring][layout];
+	if (sg->seg == seg) {
+		base = sg->base;
+		goto out;
+	}
+
+	if (seg & RBTRACE_SEG_FILE) {
+		snprintf(name, sizeof(name), "file %u",
+			 seg & ~RBTRACE_SEG_FILE);
+		fd = open(ri->ri_file_path, O_RDWR);
+	} else {
+		rbtrace_seg_name(name, sizeof(name), ri->ri_ring, seg);
+		fd = shm_open(name, O_RDWR, 0666);
+	}
+	if (fd == -1) {
+		dprintf("ring:%d open segment %s failed, error:%d\n",
+			ri->ri_ring, name, errno);
+		goto out;
+	}
+	if (fstat(fd, &st) == 0) {
+		base = rbtrace_shm_map(fd, st.st_size,
+				       !(seg & RBTRACE_SEG_FILE) &&
+				       (rbt_globals.dir_ptr->sd_flags &
+					RBTRACE_SHM_HUGE));
+	}
+	close(fd);
+	if ((base == NULL) || (base == MAP_FAILED)) {
+		dprintf("ring:%d map segment %s failed, error:%d\n",
+			ri->ri_ring, name, errno);
+		base = NULL;
+		goto out;
+	}
+
+	/* A producer preempted for a whole resize may still write to
+	 * the segment this layout used before, keep it mapped
+	 */
+	if (sg->base) {
+		old = malloc(sizeof(*old));
+		if (old) {
+			*old = *sg;
+			old->next = rbt_segs_retired;
+			rbt_segs_retired = old;
+		}
+	}
+	sg->size = st.st_size;
+	sg->base = base;
+	__atomic_store_n(&sg->seg, seg, __ATOMIC_RELEASE);
+
+ out:
+	pthread_mutex_unlock(&rbt_seg_mutex);
+	return base;
+}
+
+/* Base of the buffers of a layout if this process has them mapped */
+static inline char *
+ring_seg_mapped(struct ring_info *ri, struct subring_geo *geo,
+		uint32_t layout)
+{
+	struct rbtrace_seg *sg;
+
+	if (geo->sg_seg == 0) {
+		return rbt_globals.re_base;
+	}
+
+	sg = &rbt_segs[ri->ri_ring][layout];
+	if (__atomic_load_n(&sg->seg, __ATOMIC_ACQUIRE) == geo->sg_seg) {
+		return sg->base;
+	}
+	return NULL;
+}
+
+static inline char *
+ring_buffer_at(struct ring_info *ri, struct subring_geo *geo,
+	       char *base, uint32_t seq)
+{
+	return base + geo->sg_buf_off +
+		(uint64_t)(seq % ri->ri_nr_bufs) *
+		geo->sg_size * ri->ri_entry_size;
+}
+
+static inline char *
+ring_buffer(struct ring_info *ri, struct subring_info *si,
+	    uint32_t layout, uint32_t seq)
+{
+	struct subring_geo *geo = &si->si_geo[layout];
+	char *base;
+
+	base = ring_seg_mapped(ri, geo, layout);
+	if (base == NULL) {
+		base = ring_seg_map(ri, layout, geo->sg_seg);
+		if (base == NULL) {
+			return NULL;
+		}
+	}
+	return ring_buffer_at(ri, geo, base, seq);
+}
+
+/* Number of records in a buffer of the given pass */
+static inline uint32_t
+ring_size(struct subring_info *si, uint32_t pass)
+{
+	return si->si_geo[rbtrace_pass_layout(pass)].sg_size;
+}
+
+char *rbtrace_subring_buffer(struct ring_info *ri, struct subring_info *si,
+			     uint32_t layout, uint32_t seq)
+{
+	return ring_buffer(ri, si, layout, seq);
+}
+
+void rbtrace_seg_name(char *name, size_t len, rbtrace_ring_t ring,
+		      uint32_t seg)
+{
+	snprintf(name, len, "%s.%d.%u", RBTRACE_SHM_NAME, ring, seg);
+}
+
+static inline void *
+ring_entry(struct ring_info *ri, struct subring_info *si,
+	   uint32_t pass, uint32_t slot, int cpuid, uint8_t traceid,
+	   const struct ring_stamp *st)
+{
+	char *ent;
+
+	ent = ring_buffer(ri, si, rbtrace_pass_layout(pass),
+			  rbtrace_pass_head(pass));
+	if (ent == NULL) {
 		return NULL;
+	}
+	ent += (uint64_t)slot * ri->ri_entry_size;
+	ring_entry_init(ri, ent, cpuid, traceid,
+			rbtrace_pass_gen(pass) | RBTRACE_COMMIT_PENDING, st);
+
+	return ent;
+}
+
+static inline void
+ring_commit(struct ring_info *ri, uint64_t *args)
+{
+	uint8_t *commit;
+
+	commit = (uint8_t *)args - ri->ri_args_off + ri->ri_commit_off;
+
+	/* Publish the arguments before clearing the pending bit */
+	__atomic_store_n(commit, *commit & RBTRACE_COMMIT_GEN_MASK,
+			 __ATOMIC_RELEASE);
+}
+
+static void ringwrap_record(struct ring_info *ri, uint8_t traceid,
+			    uint64_t a0, uint64_t a1,
+			    uint64_t a2, uint64_t a3);
+
+/* Have the flusher start a capture if the ring is armed, the first
+ * producer to fire rings the doorbell
+ */
+static int ring_trigger(struct ring_info *ri)
+{
+	uint64_t flags = ri->ri_flags;
+
+	if (!(flags & RBTRACE_DO_ARMED)) {
+		return -1;
+	}
+	if (!(flags & RBTRACE_DO_TRIGGER) &&
+	    !(__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_TRIGGER) &
+	      RBTRACE_DO_TRIGGER)) {
+		rbtrace_signal_thread(ri, 0);
+	}
+	return 0;
+}
+
+static inline void
+ring_check_trigger(struct ring_info *ri, uint8_t traceid, uint64_t a0)
+{
+	if ((ri->ri_flags & RBTRACE_DO_ARMED) &&
+	    (traceid != RBT_NULL) &&
+	    (traceid == ri->ri_trig_id) &&
+	    (a0 >= ri->ri_trig_a0)) {
+		ring_trigger(ri);
+	}
+}
+
+static inline uint64_t ring_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+ring_count_lost(struct ring_info *ri, struct subring_info *si, int nr)
+{
+	__sync_add_and_fetch(&si->si_lost, nr);
+	__sync_add_and_fetch(&rbtrace_policy_stats(ri)->ps_lost, nr);
+}
+
+static void ring_count_wait(struct ring_info *ri, uint64_t start)
+{
+	struct policy_stats *ps = rbtrace_policy_stats(ri);
+	uint64_t us = (ring_clock_ns() - start) / 1000;
+	int bucket = 0;
+
+	while (us && (bucket < RBTRACE_WAIT_BUCKETS - 1)) {
+		us >>= 1;
+		bucket++;
+	}
+
+	__sync_add_and_fetch(&ps->ps_waits, 1);
+	__sync_add_and_fetch(&ps->ps_wait_hist[bucket], 1);
+}
+
+/* Sleep until the sequence of the sub-ring moves on from seq or
+ * usecs elapse
+ */
+static void ring_sleep(struct subring_info *si, uint32_t seq,
+		       uint64_t usecs)
+{
+	struct timespec timeout;
+
+	timeout.tv_sec = usecs / 1000000;
+	timeout.tv_nsec = (usecs % 1000000) * 1000;
+	rbtrace_futex(&si->si_seq, FUTEX_WAIT, seq, &timeout);
+}
+
+/* Number of full buffers queued for the flusher */
+static inline uint32_t
+ring_queued(struct subring_info *si, uint32_t pass)
+{
+	return (rbtrace_pass_head(pass) - si->si_tail) &
+		RBTRACE_PASS_HEAD_MASK;
+}
+
+/* Block policy: wait for the flusher to free a buffer instead of
+ * discarding the active one
+ */
+static void
+ringwrap_block(struct ring_info *ri, struct subring_info *si,
+	       uint32_t pass)
+{
+	uint64_t start;
+	uint64_t deadline;
+	uint32_t seq;
+
+	if (ring_queued(si, pass) < ri->ri_nr_bufs - 1) {
+		return;
+	}
+
+	start = ring_clock_ns();
+	deadline = start + RBTRACE_BLOCK_USECS * 1000ULL;
+	__sync_add_and_fetch(&si->si_waiters, 1);
+	for (;;) {
+		seq = si->si_seq;
+		if ((ring_queued(si, pass) < ri->ri_nr_bufs - 1) ||
+		    (ring_clock_ns() >= deadline)) {
+			break;
+		}
+		ring_sleep(si, seq, RBTRACE_WAIT_USECS);
+	}
+	__sync_sub_and_fetch(&si->si_waiters, 1);
+	ring_count_wait(ri, start);
+}
+
+/* Called by the producer that claimed the slot at the end of the
+ * active buffer in the given pass. The buffer is queued for the
+ * flusher if there is a free one to move on to, otherwise its records
+ * are discarded and it is filled again. A flight recorder overwrites
+ * its oldest full buffer instead, unless a snapshot is being taken.
+ * The new pass takes the layout of the ring, this is where producers
+ * move to resized buffers.
+ */
+static void
+ringwrap_swap(struct ring_info *ri, struct subring_info *si,
+	      uint32_t pass, int cpuid)
+{
+	uint32_t head = rbtrace_pass_head(pass);
+	uint32_t layout;
+	uint64_t flags = ri->ri_flags;
+	int lost;
+
+	/* Only a flusher writing to file frees buffers to wait for */
+	if ((ri->ri_policy == RBTRACE_POLICY_BLOCK) &&
+	    ((flags & (RBTRACE_DO_DISK|RBTRACE_DO_FLIGHT)) ==
+	     RBTRACE_DO_DISK)) {
+		ringwrap_block(ri, si, pass);
+	}
+
+	layout = ri->ri_layout ? RBTRACE_PASS_LAYOUT : 0;
+	if ((ring_queued(si, pass) == ri->ri_nr_bufs - 1) &&
+	    ((flags & (RBTRACE_DO_FLIGHT|RBTRACE_DO_FREEZE)) ==
+	     RBTRACE_DO_FLIGHT)) {
+		/* Nobody else frees buffers in flight recorder mode */
+		__sync_add_and_fetch(&si->si_tail, 1);
+	}
+	if (ring_queued(si, pass) < ri->ri_nr_bufs - 1) {
+		si->si_buf_gen[head % ri->ri_nr_bufs] =
+			rbtrace_pass_gen(pass) |
+			(rbtrace_pass_layout(pass) ? RBTRACE_BUF_LAYOUT : 0);
+		pass = (pass & ~(RBTRACE_PASS_HEAD_MASK|RBTRACE_PASS_LAYOUT)) |
+			((head + 1) & RBTRACE_PASS_HEAD_MASK) | layout;
+		__sync_lock_test_and_set(&si->si_pos, RBTRACE_POS(pass, 0));
+
+		/* Report records lost since the last swap */
+		lost = __sync_lock_test_and_set(&si->si_lost, 0);
+		if (lost) {
+			ringwrap_record(&rbt_globals.ri_ptr[RBTRACE_RING_IO],
+					RBT_LOST, lost, 0, 0, 0);
+			dprintf("ring:%d cpu:%d lost %d records\n",
+				ri->ri_ring, cpuid, lost);
+		}
 	} else {
-		int cnt = 1024;
-		while ((ri->ri_slot > cfg->rc_size) && (--cnt > 0)) {
+		/* All other buffers are waiting for the flusher, the
+		 * records in the current buffer will be discarded. A
+		 * new pass gets a new generation so that stale commit
+		 * markers are not taken for new records.
+		 */
+		__sync_add_and_fetch(&si->si_discard, ring_size(si, pass));
+		pass = ((pass + RBTRACE_PASS_DISCARD) & ~RBTRACE_PASS_LAYOUT) |
+			layout;
+		__sync_lock_test_and_set(&si->si_pos, RBTRACE_POS(pass, 0));
+	}
+
+	rbtrace_subring_wake(si);
+
+	/* Wake if missed or still processing prior flush to disk */
+	if (!(flags & RBTRACE_DO_FLIGHT)) {
+		rbtrace_signal_thread(ri, si->si_node);
+	}
+}
+
+/* Called by producers that claimed a slot past the end of the active
+ * buffer, wait for the buffer to be swapped as the policy says.
+ * Returns false if the record should be dropped right away.
+ */
+static bool
+ringwrap_wait(struct ring_info *ri, struct subring_info *si,
+	      uint32_t pass)
+{
+	uint64_t start;
+	uint32_t seq;
+	int cnt = RBTRACE_SPIN_LOOPS;
+
+	switch (ri->ri_policy) {
+	case RBTRACE_POLICY_DROP:
+		return false;
+	case RBTRACE_POLICY_WAIT:
+	case RBTRACE_POLICY_BLOCK:
+		start = ring_clock_ns();
+		__sync_add_and_fetch(&si->si_waiters, 1);
+		seq = si->si_seq;
+		if (RBTRACE_POS_PASS(si->si_pos) == pass) {
+			/* The swapper may itself wait for the flusher */
+			ring_sleep(si, seq,
+				   (ri->ri_policy == RBTRACE_POLICY_BLOCK) ?
+				   RBTRACE_BLOCK_USECS : RBTRACE_WAIT_USECS);
+		}
+		__sync_sub_and_fetch(&si->si_waiters, 1);
+		ring_count_wait(ri, start);
+		break;
+	default:
+		start = ring_clock_ns();
+		while ((RBTRACE_POS_PASS(si->si_pos) == pass) &&
+		       (--cnt > 0)) {
 			pause();
 		}
-		slot = __sync_add_and_fetch(&ri->ri_slot, 1);
-		if (slot < cfg->rc_size) {
-			re = ((struct rbtrace_entry *)
-			      (rbt_globals.re_base + ri->ri_cir_off)) + slot;
-			clock_gettime(CLOCK_REALTIME, &re->timestamp);
-			re->cpuid = (uint16_t)sched_getcpu();
-			re->thread = gettid();
-			return re;
+		ring_count_wait(ri, start);
+		break;
+	}
+
+	return true;
+}
+
+static inline struct subring_info *
+ringwrap_subring(struct ring_info *ri, int cpuid)
+{
+	/* Producers on different CPUs use different sub-rings in
+	 * per-CPU mode, so the slot counter is rarely contended. In
+	 * NUMA mode they use the sub-ring of their node.
+	 */
+	if (ri->ri_nr_subrings > 1) {
+		if (ri->ri_flags & RBTRACE_DO_NUMA) {
+			cpuid = rbt_numa.cpu_node[(uint32_t)cpuid %
+						  RBTRACE_MAX_CPUS];
 		}
+		return &ri->ri_subrings[(uint32_t)cpuid % ri->ri_nr_subrings];
+	}
+	return &ri->ri_subrings[0];
+}
 
-		__sync_add_and_fetch(&ri->ri_lost, 1);
+static void *
+ringwrap_slot(struct ring_info *ri,
+	      struct subring_info *si,
+	      uint64_t pos, int cpuid, uint8_t traceid)
+{
+	struct ring_stamp st;
+	uint32_t pass = RBTRACE_POS_PASS(pos);
+	uint32_t slot = RBTRACE_POS_COUNT(pos) - 1;
 
-		dprintf("ring:%d slot:%d lost\n", ri->ri_ring, slot);
-		return NULL;
+	if (slot == ring_size(si, pass)) {
+		/* swap ring buffer */
+		ringwrap_swap(ri, si, pass, cpuid);
+	} else if (!ringwrap_wait(ri, si, pass)) {
+		goto lost;
 	}
+
+	pos = __sync_add_and_fetch(&si->si_pos, 1);
+	pass = RBTRACE_POS_PASS(pos);
+	slot = RBTRACE_POS_COUNT(pos) - 1;
+	if (slot < ring_size(si, pass)) {
+		ring_stamp(ri, &st);
+		return ring_entry(ri, si, pass, slot, cpuid, traceid, &st);
+	}
+
+ lost:
+	ring_count_lost(ri, si, 1);
+	dprintf("ring:%d slot:%u lost\n", ri->ri_ring, slot);
+	return NULL;
 }
 
-static struct rbtrace_entry *
-ringwrap(struct ring_config *cfg, struct ring_info *ri)
+static void *
+ringwrap(struct ring_info *ri, uint8_t traceid)
 {
+	uint64_t pos;
+	uint32_t pass;
 	uint32_t slot;
-	struct rbtrace_entry *re;
+	int cpuid;
+	struct subring_info *si;
+	struct ring_stamp st;
+
+	cpuid = rbtrace_getcpu();
+	si = ringwrap_subring(ri, cpuid);
 
-	slot = __sync_add_and_fetch(&ri->ri_slot, 1);
-	if (slot < cfg->rc_size) {
-		re = ((struct rbtrace_entry *)
-		      (rbt_globals.re_base + ri->ri_cir_off)) + slot;
-		clock_gettime(CLOCK_REALTIME, &re->timestamp);
-		re->cpuid = (uint16_t)sched_getcpu();
-		re->thread = gettid();
-		return re;
+	/* The pass tells which buffer the slot is in, so a swap right
+	 * after the claim can't move the record to another buffer
+	 */
+	pos = __sync_add_and_fetch(&si->si_pos, 1);
+	pass = RBTRACE_POS_PASS(pos);
+	slot = RBTRACE_POS_COUNT(pos) - 1;
+	if (slot < ring_size(si, pass)) {
+		ring_stamp(ri, &st);
+		return ring_entry(ri, si, pass, slot, cpuid, traceid, &st);
 	}
 
-	return ringwrap_slot(cfg, ri, slot);
+	return ringwrap_slot(ri, si, pos, cpuid, traceid);
 }
 
-int rbtrace(rbtrace_ring_t ring, uint8_t traceid, uint64_t a0,
-	    uint64_t a1, uint64_t a2, uint64_t a3)
+/* Write a record straight to the ring, bypassing staging */
+static void ringwrap_record(struct ring_info *ri, uint8_t traceid,
+			    uint64_t a0, uint64_t a1,
+			    uint64_t a2, uint64_t a3)
+{
+	uint64_t *args;
+	char *ent;
+
+	ent = ringwrap(ri, traceid);
+	if (ent == NULL) {
+		return;
+	}
+
+	args = (uint64_t *)(ent + ri->ri_args_off);
+	args[0] = a0;
+	args[1] = a1;
+	if (ri->ri_format != RBTRACE_FMT_COMPACT) {
+		args[2] = a2;
+		args[3] = a3;
+	}
+	ring_commit(ri, args);
+	ring_check_trigger(ri, traceid, a0);
+}
+
+/* Fill and commit nr claimed slots starting at slot, either from
+ * records of a batch or by copying entries from a staging buffer
+ */
+static void
+ringwrap_fill(struct ring_info *ri, struct subring_info *si,
+	      uint32_t pass, uint32_t slot, int nr, int cpuid,
+	      const struct ring_stamp *st,
+	      const struct rbtrace_rec *recs,
+	      const char *staged)
+{
+	uint64_t *args;
+	uint8_t gen;
+	char *ent;
+	int i;
+
+	if (staged) {
+		gen = rbtrace_pass_gen(pass);
+		ent = ring_buffer(ri, si, rbtrace_pass_layout(pass),
+				  rbtrace_pass_head(pass));
+		if (ent == NULL) {
+			return;
+		}
+		ent += (uint64_t)slot * ri->ri_entry_size;
+		memcpy(ent, staged, (size_t)nr * ri->ri_entry_size);
+		for (i = 0; i < nr; i++, ent += ri->ri_entry_size) {
+			__atomic_store_n((uint8_t *)ent + ri->ri_commit_off,
+					 gen, __ATOMIC_RELEASE);
+		}
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ent = ring_entry(ri, si, pass, slot + i, cpuid,
+				 recs[i].traceid, st);
+		if (ent == NULL) {
+			return;
+		}
+		args = (uint64_t *)(ent + ri->ri_args_off);
+		args[0] = recs[i].a0;
+		args[1] = recs[i].a1;
+		if (ri->ri_format != RBTRACE_FMT_COMPACT) {
+			args[2] = recs[i].a2;
+			args[3] = recs[i].a3;
+		}
+		ring_commit(ri, args);
+	}
+}
+
+/* Claim slots for nr records with one atomic and stamp them with one
+ * clock read. The claim that covers the end of the buffer fills what
+ * fits, swaps the buffer and claims the rest of its slots in the new
+ * buffer.
+ */
+static int
+ringwrap_batch(struct ring_info *ri, int nr,
+	       const struct rbtrace_rec *recs,
+	       const char *staged)
+{
+	struct subring_info *si;
+	struct ring_stamp st;
+	bool stamped = false;
+	bool waited = false;
+	uint64_t pos;
+	uint32_t pass;
+	int64_t size;
+	int64_t first;
+	int64_t last;
+	int cpuid;
+	int done = 0;
+	int n;
+
+	cpuid = rbtrace_getcpu();
+	si = ringwrap_subring(ri, cpuid);
+
+	while (done < nr) {
+		n = nr - done;
+		pos = __sync_add_and_fetch(&si->si_pos, n);
+		pass = RBTRACE_POS_PASS(pos);
+		size = ring_size(si, pass);
+		last = (int64_t)RBTRACE_POS_COUNT(pos) - 1;
+		first = last - n + 1;
+
+		if (first < size) {
+			if (!stamped && !staged) {
+				ring_stamp(ri, &st);
+				stamped = true;
+			}
+			if (n > size - first) {
+				n = size - first;
+			}
+			ringwrap_fill(ri, si, pass, first, n, cpuid, &st,
+				      recs ? &recs[done] : NULL,
+				      staged ? staged +
+				      (size_t)done * ri->ri_entry_size : NULL);
+			done += n;
+		}
+
+		if (last < size) {
+			break;
+		}
+
+		if (first <= size) {
+			/* This claim owns the end of the buffer */
+			ringwrap_swap(ri, si, pass, cpuid);
+		} else if (!waited && ringwrap_wait(ri, si, pass)) {
+			waited = true;
+		} else {
+			ring_count_lost(ri, si, nr - done);
+			dprintf("ring:%d batch lost %d records\n",
+				ri->ri_ring, nr - done);
+			break;
+		}
+	}
+
+	return done;
+}
+
+/* Publish the staged entries of a ring, caller owns the stage */
+static void rbtrace_stage_publish(struct rbtrace_stage *stage,
+				  rbtrace_ring_t ring)
+{
+	if (stage->nr[ring] && rbt_globals.ri_ptr) {
+		ringwrap_batch(&rbt_globals.ri_ptr[ring], stage->nr[ring],
+			       NULL, stage->ents[ring]);
+	}
+	stage->nr[ring] = 0;
+}
+
+static void rbtrace_stage_flush(struct rbtrace_stage *stage)
+{
+	int i;
+
+	for (i = RBTRACE_RING_IO; i < rbt_globals.nr_rings; i++) {
+		rbtrace_stage_publish(stage, i);
+	}
+}
+
+static void rbtrace_stage_flush_all(int how)
+{
+	struct rbtrace_stage *stage;
+
+	pthread_mutex_lock(&rbt_stage_mutex);
+	for (stage = rbt_stages; stage; stage = stage->next) {
+		if (__sync_lock_test_and_set(&stage->lock, 1)) {
+			if (how == RBTRACE_STAGE_TRY) {
+				continue;
+			}
+			while (__sync_lock_test_and_set(&stage->lock, 1)) {
+				pause();
+			}
+		}
+		rbtrace_stage_flush(stage);
+		__sync_lock_release(&stage->lock);
+	}
+	pthread_mutex_unlock(&rbt_stage_mutex);
+}
+
+/* Unlink the stage, publish what is left and free it */
+static void rbtrace_stage_release(struct rbtrace_stage *stage)
+{
+	struct rbtrace_stage **pp;
+
+	pthread_mutex_lock(&rbt_stage_mutex);
+	for (pp = &rbt_stages; *pp; pp = &(*pp)->next) {
+		if (*pp == stage) {
+			*pp = stage->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rbt_stage_mutex);
+
+	while (__sync_lock_test_and_set(&stage->lock, 1)) {
+		pause();
+	}
+	rbtrace_stage_flush(stage);
+	free(stage);
+}
+
+/* Thread exit */
+static void rbtrace_stage_destroy(void *arg)
+{
+	rbtrace_stage_release((struct rbtrace_stage *)arg);
+	rbt_stage = NULL;
+}
+
+static void *rbtrace_stage_timer_fn(void *arg)
+{
+	while (!rbt_stage_timer_stop) {
+		usleep(RBTRACE_STAGE_FLUSH_USECS);
+		rbtrace_stage_flush_all(RBTRACE_STAGE_TRY);
+	}
+
+	return NULL;
+}
+
+/* Publish staged entries from a signal handler. Only the room left in
+ * the active buffer is claimed, so there is no swap to do and nothing
+ * to wait for, and only buffers this process has mapped are written.
+ * Whatever doesn't fit is counted as lost.
+ */
+static void rbtrace_stage_publish_fatal(struct rbtrace_stage *stage,
+					rbtrace_ring_t ring)
+{
+	struct ring_info *ri = &rbt_globals.ri_ptr[ring];
+	struct subring_info *si;
+	struct subring_geo *geo;
+	uint64_t pos;
+	uint32_t pass;
+	uint32_t first;
+	uint32_t size;
+	uint8_t gen;
+	char *ent;
+	int nr = stage->nr[ring];
+	int n;
+	int i;
+
+	if (nr == 0) {
+		return;
+	}
+	stage->nr[ring] = 0;
+
+	si = ringwrap_subring(ri, rbtrace_getcpu());
+	do {
+		pos = si->si_pos;
+		pass = RBTRACE_POS_PASS(pos);
+		first = RBTRACE_POS_COUNT(pos);
+		size = ring_size(si, pass);
+		geo = &si->si_geo[rbtrace_pass_layout(pass)];
+		ent = ring_seg_mapped(ri, geo, rbtrace_pass_layout(pass));
+		if ((first >= size) || (ent == NULL)) {
+			n = 0;
+			break;
+		}
+		n = (nr < size - first) ? nr : size - first;
+	} while (!__sync_bool_compare_and_swap(&si->si_pos, pos, pos + n));
+
+	if (n) {
+		ent = ring_buffer_at(ri, geo, ent, rbtrace_pass_head(pass)) +
+			(uint64_t)first * ri->ri_entry_size;
+		memcpy(ent, stage->ents[ring], (size_t)n * ri->ri_entry_size);
+		gen = rbtrace_pass_gen(pass);
+		for (i = 0; i < n; i++, ent += ri->ri_entry_size) {
+			__atomic_store_n((uint8_t *)ent + ri->ri_commit_off,
+					 gen, __ATOMIC_RELEASE);
+		}
+		nr -= n;
+	}
+	if (nr) {
+		ring_count_lost(ri, si, nr);
+	}
+}
+
+/* Only async-signal-safe work here: the stage of the faulting thread
+ * is published unless it died while staging a record, the stages of
+ * other threads are left to the timer
+ */
+static void rbtrace_stage_fatal(int sig)
+{
+	struct rbtrace_stage *stage = rbt_stage;
+	int i;
+
+	if (stage && rbt_globals.ri_ptr &&
+	    !__sync_lock_test_and_set(&stage->lock, 1)) {
+		for (i = RBTRACE_RING_IO; i < rbt_globals.nr_rings; i++) {
+			rbtrace_stage_publish_fatal(stage, i);
+		}
+		__sync_lock_release(&stage->lock);
+	}
+
+	/* Let the prior handler, or the default action, take over */
+	for (i = 0; i < RBT_NR_FATAL_SIGNALS; i++) {
+		if (rbt_fatal_signals[i] == sig) {
+			sigaction(sig, &rbt_fatal_oldacts[i], NULL);
+			break;
+		}
+	}
+	raise(sig);
+}
+
+/* Called with rbt_stage_mutex held */
+static void rbtrace_stage_setup(void)
+{
+	struct sigaction sa;
+	int rc;
+	int i;
+
+	if (!rbt_stage_timer_running) {
+		rbt_stage_timer_stop = false;
+		rc = pthread_create(&rbt_stage_timer, NULL,
+				    rbtrace_stage_timer_fn, NULL);
+		if (rc != 0) {
+			dprintf("create stage timer failed, error:%d\n", rc);
+		} else {
+			rbt_stage_timer_running = true;
+		}
+	}
+
+	if (!rbt_fatal_installed) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = rbtrace_stage_fatal;
+		sigemptyset(&sa.sa_mask);
+		for (i = 0; i < RBT_NR_FATAL_SIGNALS; i++) {
+			sigaction(rbt_fatal_signals[i], &sa,
+				  &rbt_fatal_oldacts[i]);
+		}
+		rbt_fatal_installed = true;
+	}
+}
+
+int rbtrace_stage_thread(int enable)
+{
+	struct rbtrace_stage *stage;
+
+	if (!rbt_globals.inited) {
+		return -1;
+	}
+
+	if (!enable) {
+		if (rbt_stage) {
+			pthread_setspecific(rbt_stage_key, NULL);
+			rbtrace_stage_release(rbt_stage);
+			rbt_stage = NULL;
+		}
+		return 0;
+	}
+
+	if (rbt_stage) {
+		return 0;
+	}
+
+	stage = calloc(1, sizeof(*stage) +
+		       rbt_globals.nr_rings * sizeof(stage->ents[0]));
+	if (stage == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&rbt_stage_mutex);
+	stage->next = rbt_stages;
+	rbt_stages = stage;
+	rbtrace_stage_setup();
+	pthread_mutex_unlock(&rbt_stage_mutex);
+
+	pthread_setspecific(rbt_stage_key, stage);
+	rbt_stage = stage;
+	return 0;
+}
+
+/* Stage a record, the stage stays locked until it is committed */
+static uint64_t *rbtrace_stage_reserve(struct ring_info *ri,
+				       uint8_t traceid)
+{
+	struct rbtrace_stage *stage = rbt_stage;
+	struct ring_stamp st;
+	char *ent;
+
+	while (__sync_lock_test_and_set(&stage->lock, 1)) {
+		pause();
+	}
+
+	if (stage->nr[ri->ri_ring] == RBTRACE_STAGE_ENTRIES) {
+		rbtrace_stage_publish(stage, ri->ri_ring);
+	}
+
+	ent = stage->ents[ri->ri_ring] +
+		stage->nr[ri->ri_ring] * ri->ri_entry_size;
+	stage->nr[ri->ri_ring]++;
+
+	ring_stamp(ri, &st);
+	ring_entry_init(ri, ent, rbtrace_getcpu(), traceid, 0, &st);
+
+	return (uint64_t *)(ent + ri->ri_args_off);
+}
+
+uint64_t *rbtrace_reserve(rbtrace_ring_t ring, uint8_t traceid,
+			  int *nr_args)
 {
-	struct ring_config *cfg;
 	struct ring_info *ri;
-	struct rbtrace_entry *re;
+	char *ent;
 
-	if ((ring >= RBTRACE_RING_MAX) ||
+	if ((ring >= rbt_globals.nr_rings) ||
 	    (NULL == rbt_globals.ri_ptr)) {
+		return NULL;
+	}
+
+	ri = &rbt_globals.ri_ptr[ring];
+	if (nr_args) {
+		*nr_args = (ri->ri_format == RBTRACE_FMT_COMPACT) ? 2 : 4;
+	}
+
+	if (rbt_stage) {
+		return rbtrace_stage_reserve(ri, traceid);
+	}
+
+	ent = ringwrap(ri, traceid);
+	if (ent == NULL) {
+		return NULL;
+	}
+
+	return (uint64_t *)(ent + ri->ri_args_off);
+}
+
+void rbtrace_commit(rbtrace_ring_t ring, uint64_t *args)
+{
+	if (rbt_stage) {
+		__sync_lock_release(&rbt_stage->lock);
+		return;
+	}
+
+	ring_commit(&rbt_globals.ri_ptr[ring], args);
+}
+
+int rbtrace_batch(rbtrace_ring_t ring, int nr,
+		  const struct rbtrace_rec *recs)
+{
+	struct ring_info *ri;
+	int done;
+	int i;
+
+	if ((ring >= rbt_globals.nr_rings) ||
+	    (NULL == rbt_globals.ri_ptr) ||
+	    (nr < 0)) {
 		return -1;
 	}
 
 	ri = &rbt_globals.ri_ptr[ring];
-	cfg = &ring_cfgs[ring];
-	re = ringwrap(cfg, ri);
-	if (re == NULL) {
+	done = ringwrap_batch(ri, nr, recs, NULL);
+	if (ri->ri_flags & RBTRACE_DO_ARMED) {
+		for (i = 0; i < done; i++) {
+			ring_check_trigger(ri, recs[i].traceid, recs[i].a0);
+		}
+	}
+	return done;
+}
+
+int rbtrace(rbtrace_ring_t ring, uint8_t traceid, uint64_t a0,
+	    uint64_t a1, uint64_t a2, uint64_t a3)
+{
+	uint64_t *args;
+	int nr_args;
+
+	args = rbtrace_reserve(ring, traceid, &nr_args);
+	if (args == NULL) {
 		return -1;
-	} else {
-		re->traceid = traceid;
-		re->a0 = a0;
-		re->a1 = a1;
-		re->a2 = a2;
-		re->a3 = a3;
 	}
 
+	args[0] = a0;
+	args[1] = a1;
+	if (nr_args > 2) {
+		args[2] = a2;
+		args[3] = a3;
+	}
+
+	rbtrace_commit(ring, args);
+	ring_check_trigger(&rbt_globals.ri_ptr[ring], traceid, a0);
 	return 0;
 }
 
+int rbtrace_trigger(rbtrace_ring_t ring)
+{
+	if ((ring >= rbt_globals.nr_rings) ||
+	    (NULL == rbt_globals.ri_ptr)) {
+		return -1;
+	}
+
+	return ring_trigger(&rbt_globals.ri_ptr[ring]);
+}
+
 int rbtrace_traffic_enabled(rbtrace_ring_t ring, uint8_t traceid)
 {
-	if ((ring >= RBTRACE_RING_MAX) ||
+	if ((ring >= rbt_globals.nr_rings) ||
 	    (traceid >= RBT_TRAFFIC_LAST) ||
 	    (rbt_globals.ri_ptr == NULL)) {
 		return false;
@@ -200,32 +1260,173 @@ int rbtrace_traffic_enabled(rbtrace_ring_t ring, uint8_t traceid)
 	return rbt_globals.ri_ptr[ring].ri_tflags & (1 << traceid);
 }
 
-static size_t rbtrace_calc_ring_size(struct ring_config *cfg)
+int rbtrace_ring_find(const char *name)
 {
-	size_t size = 0;
+	int i;
 
-	/* Double ring buffer */
-	size = cfg->rc_size * sizeof(struct rbtrace_entry) * 2;
-	return size;
+	for (i = 0; i < rbt_globals.nr_rings; i++) {
+		if (strncmp(rbt_globals.ri_ptr[i].ri_name, name,
+			    RBTRACE_MAX_NAME) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
 }
 
-size_t rbtrace_calc_shm_size(void)
+/* Number of buffers in each sub-ring of a ring, nr_bufs overrides
+ * the ring default if not 0
+ */
+uint32_t rbtrace_ring_nr_bufs(struct ring_config *cfg, uint32_t nr_bufs)
+{
+	if (nr_bufs == 0) {
+		nr_bufs = cfg->rc_nr_bufs;
+	}
+	if (nr_bufs < RBTRACE_MIN_BUFS) {
+		nr_bufs = RBTRACE_MIN_BUFS;
+	} else if (nr_bufs > RBTRACE_MAX_BUFS) {
+		nr_bufs = RBTRACE_MAX_BUFS;
+	}
+	return nr_bufs;
+}
+
+/* Sub-rings of a ring: one per CPU in per-CPU mode, otherwise one
+ * per NUMA node in NUMA mode or a single one
+ */
+uint32_t rbtrace_ring_nr_subrings(struct rbtrace_daemon_opts *dopts)
+{
+	int nr_cpus;
+
+	if (dopts->percpu) {
+		nr_cpus = get_nprocs_conf();
+		if (nr_cpus > RBTRACE_MAX_CPUS) {
+			nr_cpus = RBTRACE_MAX_CPUS;
+		}
+		return nr_cpus;
+	}
+	if (dopts->numa) {
+		return rbt_numa.nr_nodes;
+	}
+	return 1;
+}
+
+size_t rbtrace_calc_ring_size(struct ring_config *cfg,
+			      struct rbtrace_daemon_opts *dopts)
 {
-	int i;
 	size_t size = 0;
+	uint32_t nr_bufs;
 
-	size += sizeof(*rbt_globals.fsize_ptr);
-	size += sizeof(*rbt_globals.ring_ptr);
+	/* A queue of ring buffers for each sub-ring */
+	nr_bufs = rbtrace_ring_nr_bufs(cfg, dopts->nr_bufs);
+	size = (dopts->percpu ? cfg->rc_cpu_size : cfg->rc_size) *
+		rbtrace_entry_size(cfg->rc_format) * nr_bufs;
 
-	for (i = RBTRACE_RING_IO; i < RBTRACE_RING_MAX; i++) {
-		size += rbtrace_calc_ring_size(&ring_cfgs[i]);
+	/* Sub-rings bound to a node must not share pages */
+	if (dopts->numa) {
+		size = RBTRACE_ALIGN(size, RBTRACE_PAGE_SIZE);
 	}
+	return size * rbtrace_ring_nr_subrings(dopts);
+}
 
-	size += (RBTRACE_RING_MAX * sizeof(*rbt_globals.ri_ptr));
+size_t rbtrace_calc_shm_size(struct ring_config *cfgs, int nr_rings,
+			     struct rbtrace_daemon_opts *dopts)
+{
+	int i;
+	size_t size = rbtrace_shm_re_off(nr_rings);
+
+	for (i = 0; i < nr_rings; i++) {
+		size += rbtrace_calc_ring_size(&cfgs[i], dopts);
+	}
 
 	return size;
 }
 
+/* Parse a sysfs list like 0-3,8-11 into set, returns the number of
+ * entries in it or -1 if it can't be read
+ */
+static int rbtrace_read_list(const char *path, uint8_t *set, int max)
+{
+	FILE *fp;
+	char buf[4096];
+	char *p, *endptr;
+	long lo, hi;
+	int nr = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (p == NULL) {
+		return -1;
+	}
+
+	memset(set, 0, max);
+	while ((*p != '\0') && (*p != '\n')) {
+		lo = strtol(p, &endptr, 10);
+		if (endptr == p) {
+			break;
+		}
+		hi = lo;
+		p = endptr;
+		if (*p == '-') {
+			hi = strtol(p + 1, &endptr, 10);
+			p = endptr;
+		}
+		for (; (lo <= hi) && (lo < max); lo++) {
+			if ((lo >= 0) && !set[lo]) {
+				set[lo] = 1;
+				nr++;
+			}
+		}
+		if (*p == ',') {
+			p++;
+		}
+	}
+
+	return nr;
+}
+
+/* Number the online nodes that have CPUs and map CPUs to them */
+void rbtrace_numa_init(void)
+{
+	char path[128];
+	uint8_t online[64];
+	uint8_t cpus[RBTRACE_MAX_CPUS];
+	int node, cpu;
+	int nr = 0;
+
+	memset(rbt_numa.cpu_node, 0, sizeof(rbt_numa.cpu_node));
+	rbt_numa.node_ids[0] = 0;
+	rbt_numa.nr_nodes = 1;
+
+	if (rbtrace_read_list(RBTRACE_SYSFS_NODE "/online", online,
+			      sizeof(online)) <= 0) {
+		return;
+	}
+	for (node = 0; (node < sizeof(online)) &&
+		     (nr < RBTRACE_MAX_NODES); node++) {
+		if (!online[node]) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/node%d/cpulist",
+			 RBTRACE_SYSFS_NODE, node);
+		if (rbtrace_read_list(path, cpus, sizeof(cpus)) <= 0) {
+			continue;
+		}
+		for (cpu = 0; cpu < RBTRACE_MAX_CPUS; cpu++) {
+			if (cpus[cpu]) {
+				rbt_numa.cpu_node[cpu] = nr;
+			}
+		}
+		rbt_numa.node_ids[nr++] = node;
+	}
+	if (nr > 0) {
+		rbt_numa.nr_nodes = nr;
+	}
+}
+
 void update_coredump_filter(void)
 {
 	int rc = 0;
@@ -244,42 +1445,96 @@ void update_coredump_filter(void)
 }
 
 void rbtrace_globals_init(int shm_fd, char *shm_base,
-			  size_t shm_size,
-			  sem_t *sem_ptr)
+			  size_t shm_size)
 {
 	size_t offset = 0;
 
 	rbt_globals.shm_fd = shm_fd;
-	rbt_globals.sem_ptr = sem_ptr;
 	rbt_globals.shm_base = shm_base;
 	rbt_globals.shm_size = shm_size;
 
 	rbt_globals.fsize_ptr = (uint64_t *)(shm_base + offset);
-	offset += sizeof(uint64_t);
-	rbt_globals.ring_ptr = (rbtrace_ring_t *)(shm_base + offset);
-	offset += sizeof(rbtrace_ring_t);
+	offset = RBTRACE_SHM_DIR_OFF;
+	rbt_globals.dir_ptr = (struct rbtrace_shm_dir *)(shm_base + offset);
+
+	/* Rings are wherever the directory says */
+	rbt_globals.nr_rings = rbt_globals.dir_ptr->sd_nr_rings;
+	rbt_globals.nr_nodes = rbt_globals.dir_ptr->sd_nr_nodes;
+	offset = rbt_globals.dir_ptr->sd_db_off;
+	rbt_globals.db_ptr = (struct rbtrace_doorbell *)(shm_base + offset);
+	offset = rbt_globals.dir_ptr->sd_ri_off;
 	rbt_globals.ri_ptr = (struct ring_info *)(shm_base + offset);
-	offset += sizeof(struct ring_info) * RBTRACE_RING_MAX;
-	rbt_globals.re_base = (struct rbtrace_entry *)(shm_base + offset);
+	offset = rbt_globals.dir_ptr->sd_re_off;
+	rbt_globals.re_base = shm_base + offset;
 
 	rbt_globals.inited = true;
 }
 
-void rbtrace_globals_cleanup(bool do_unlink)
+/* Map shared memory at a huge page aligned address, so that huge
+ * pages backing it can be mapped whole. Returns MAP_FAILED on error.
+ */
+char *rbtrace_shm_map(int fd, size_t size, bool huge)
 {
-	int rc = 0;
+	size_t len = RBTRACE_ALIGN(size, RBTRACE_PAGE_SIZE);
+	size_t span = len;
+	char *addr = NULL;
+	char *base = NULL;
 
-	if ((rbt_globals.sem_ptr != SEM_FAILED) &&
-	    (rbt_globals.sem_ptr != NULL)) {
-		sem_close(rbt_globals.sem_ptr);
-		if (do_unlink) {
-			rc = sem_unlink(RBTRACE_SEM_NAME);
-			if (rc < 0) {
-				dprintf("unlink sem failed, error:%s\n",
-					strerror(errno));
+	if (huge) {
+		/* Reserve enough to find an aligned start in */
+		span = len + RBTRACE_HUGE_PAGE_SIZE;
+		addr = mmap(NULL, span, PROT_NONE,
+			    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (addr == MAP_FAILED) {
+			return MAP_FAILED;
+		}
+		base = (char *)RBTRACE_ALIGN((uintptr_t)addr,
+					     RBTRACE_HUGE_PAGE_SIZE);
+		if (base > addr) {
+			munmap(addr, base - addr);
+		}
+		munmap(base + len, addr + span - (base + len));
+	}
+
+	addr = mmap(base, len, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|(huge ? MAP_FIXED : 0), fd, 0);
+	if (addr == MAP_FAILED) {
+		if (huge) {
+			munmap(base, len);
+		}
+	} else if (huge && (madvise(addr, len, MADV_HUGEPAGE) == -1)) {
+		dprintf("madvise huge page failed, error:%d\n", errno);
+	}
+
+	return addr;
+}
+
+static void rbtrace_seg_cleanup(void)
+{
+	struct rbtrace_seg *sg;
+	int i, j;
+
+	pthread_mutex_lock(&rbt_seg_mutex);
+	for (i = 0; i < RBTRACE_RING_MAX; i++) {
+		for (j = 0; j < 2; j++) {
+			sg = &rbt_segs[i][j];
+			if (sg->base) {
+				munmap(sg->base, sg->size);
 			}
+			memset(sg, 0, sizeof(*sg));
 		}
 	}
+	while ((sg = rbt_segs_retired) != NULL) {
+		rbt_segs_retired = sg->next;
+		munmap(sg->base, sg->size);
+		free(sg);
+	}
+	pthread_mutex_unlock(&rbt_seg_mutex);
+}
+
+void rbtrace_globals_cleanup(bool do_unlink)
+{
+	int rc = 0;
 
 	if (rbt_globals.shm_fd != -1) {
 		if ((rbt_globals.shm_base != MAP_FAILED) &&
@@ -302,14 +1557,38 @@ void rbtrace_globals_cleanup(bool do_unlink)
 		}
 	}
 
-	rbt_globals.sem_ptr = SEM_FAILED;
+	rbtrace_seg_cleanup();
+
 	rbt_globals.shm_fd = -1;
 	rbt_globals.shm_base = MAP_FAILED;
+	rbt_globals.nr_rings = 0;
+	rbt_globals.nr_nodes = 0;
+	rbt_globals.ri_ptr = NULL;
 	rbt_globals.inited = false;
 }
 
 void rbtrace_exit(void)
 {
+	int i;
+
+	if (rbt_stage_timer_running) {
+		rbt_stage_timer_stop = true;
+		pthread_join(rbt_stage_timer, NULL);
+		rbt_stage_timer_running = false;
+	}
+	rbtrace_stage_flush_all(RBTRACE_STAGE_WAIT);
+
+	/* Rings are unmapped next, fatal signals must not flush to them */
+	pthread_mutex_lock(&rbt_stage_mutex);
+	if (rbt_fatal_installed) {
+		for (i = 0; i < RBT_NR_FATAL_SIGNALS; i++) {
+			sigaction(rbt_fatal_signals[i], &rbt_fatal_oldacts[i],
+				  NULL);
+		}
+		rbt_fatal_installed = false;
+	}
+	pthread_mutex_unlock(&rbt_stage_mutex);
+
 	rbtrace_globals_cleanup(false);
 }
 
@@ -319,14 +1598,16 @@ int rbtrace_init(void)
 	int shm_fd = -1;
 	size_t shm_size = 0;
 	char *shm_base = NULL;
-	sem_t *sem_ptr = SEM_FAILED;
+	struct rbtrace_shm_dir *dir;
+	uint32_t flags = 0;
+	struct stat st;
 
 	if (rbt_globals.inited) {
 		rc = -1;
 		goto out;
 	}
 
-	shm_size = rbtrace_calc_shm_size();
+	pthread_once(&rbt_once, rbtrace_once_init);
 
 	shm_fd = shm_open(RBTRACE_SHM_NAME, O_RDWR, 0666);
 	if (shm_fd == -1) {
@@ -335,28 +1616,63 @@ int rbtrace_init(void)
 		goto out;
 	}
 
-	shm_base = mmap(NULL, shm_size, PROT_READ|PROT_WRITE,
-			MAP_SHARED, shm_fd, 0);
+	/* The layout was decided by rbtraced, just map all of it */
+	if (fstat(shm_fd, &st) == -1) {
+		rc = errno;
+		dprintf("fstat failed, error:%d\n", errno);
+		goto mmap_fail;
+	}
+	shm_size = st.st_size;
+
+	/* Peek at the directory for how rbtraced backs the shm, it is
+	 * checked for real once mapped
+	 */
+	if (pread(shm_fd, &flags, sizeof(flags), RBTRACE_SHM_DIR_OFF +
+		  offsetof(struct rbtrace_shm_dir, sd_flags)) !=
+	    sizeof(flags)) {
+		flags = 0;
+	}
+
+	shm_base = rbtrace_shm_map(shm_fd, shm_size,
+				   flags & RBTRACE_SHM_HUGE);
 	if (shm_base == MAP_FAILED) {
 		rc = errno;
 		dprintf("mmap failed, error:%d\n", errno);
 		goto mmap_fail;
 	}
 
-	sem_ptr = sem_open(RBTRACE_SEM_NAME, O_RDWR);
-	if (sem_ptr == SEM_FAILED) {
-		rc = errno;
-		dprintf("sem_open failed, error:%d\n", errno);
-		goto sem_open_fail;
+	/* The directory is only valid once rbtraced has set up all
+	 * rings and it must describe a layout we know
+	 */
+	dir = (struct rbtrace_shm_dir *)(shm_base + RBTRACE_SHM_DIR_OFF);
+	if ((shm_size < RBTRACE_SHM_RI_OFF) ||
+	    strncmp(dir->sd_magic, RBTRACE_SHM_MAGIC,
+		    sizeof(dir->sd_magic))) {
+		rc = EAGAIN;
+		dprintf("shm is not ready\n");
+		goto dir_fail;
+	}
+	__sync_synchronize();
+	if ((dir->sd_major != RBTRACE_MAJOR) ||
+	    (dir->sd_ri_size != sizeof(struct ring_info)) ||
+	    (dir->sd_nr_rings == 0) ||
+	    (dir->sd_nr_rings > RBTRACE_RING_MAX) ||
+	    (dir->sd_nr_nodes == 0) ||
+	    (dir->sd_nr_nodes > RBTRACE_MAX_NODES) ||
+	    (dir->sd_db_off > dir->sd_re_off) ||
+	    (dir->sd_re_off > shm_size)) {
+		rc = EINVAL;
+		dprintf("shm directory is not valid\n");
+		goto dir_fail;
 	}
 
 	/* Dump shared memory region if cored */
 	update_coredump_filter();
 
-	rbtrace_globals_init(shm_fd, shm_base, shm_size, sem_ptr);
+	rbtrace_globals_init(shm_fd, shm_base, shm_size);
 	return rc;
 
- sem_open_fail:
+ dir_fail:
 	munmap(shm_base, shm_size);
  mmap_fail:
 	close(shm_fd);
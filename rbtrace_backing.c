@@ -1,40 +1,157 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/io_uring.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include "rbtrace.h"
 #include "rbtracedef.h"
 #include "rbtrace_private.h"
+#include "rbtrace_codec.h"
 
 STATIC_ASSERT(sizeof(struct rbtrace_fheader) < RBTRACE_FHEADER_SIZE);
 
 #define RBTRACE_THREAD_NAME		"rbtrace-flush"
 #define RBTRACE_THREAD_WAIT_SECS	(5)
 #define RBTRACE_FLUSH_WAIT_USECS	(5000)
+#define RBTRACE_COMMIT_SPINS		(4096)
 
 #define RBTRACE_DFT_FILE_SIZE		(2048ULL*1024ULL*1024ULL)
 
+#define RBTRACE_TSC_CALIBRATE_USECS	(100000)
+#define RBTRACE_TSC_SYNC_SECS		(10)
+#define RBTRACE_TSC_SAMPLE_TRIES	(8)
+
+#define NSEC_PER_SEC			(1000000000ULL)
+
+/* Writes a flusher keeps in flight, and how often it looks for
+ * completed ones while it has some
+ */
+#define RBTRACE_URING_DEPTH		(64)
+#define RBTRACE_REAP_WAIT_USECS		(1000)
+
+/* Completions of the operations linked to a write carry one of these
+ * along with the slot of the write
+ */
+#define RBTRACE_URING_SYNC		(1ULL << 32)
+#define RBTRACE_URING_FADV		(2ULL << 32)
+#define RBTRACE_URING_SLOT(_data_)	((_data_) & 0xFFFFFFFFULL)
+
+/* A write in flight, the buffer is freed when it completes */
+struct rbtrace_io {
+	rbtrace_ring_t io_ring;
+	uint32_t io_subring;	// index of the sub-ring in the ring
+	uint32_t io_seq;	// sequence of the buffer in the sub-ring
+	uint32_t io_len;	// bytes to write
+	uint32_t io_nr;		// records written, lost if the write fails
+	uint32_t io_pos;	// bytes written so far
+	uint32_t io_links;	// linked operations not completed yet
+	int io_fd;		// own descriptor of the file, for resubmits
+	uint64_t io_off;	// offset in file
+	const char *io_addr;	// data to write
+	bool io_hdr;		// file header rather than a buffer
+	bool io_drop;		// sync and drop the range from page cache
+	bool io_over;		// the write itself is over
+	bool io_lost;		// records were counted as lost
+	void *io_buf;		// copy of the buffer, freed once written
+};
+
+/* An io_uring of a flusher, set up with raw syscalls */
+struct rbtrace_uring {
+	int fd;			// -1 if writes are synchronous
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_entries;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+	uint64_t busy;		// bitmask of ios in flight
+	uint32_t inflight;	// number of ios in flight
+	struct rbtrace_io ios[RBTRACE_URING_DEPTH];
+};
+
+STATIC_ASSERT(RBTRACE_URING_DEPTH <= 64);
+
 struct rbtrace_thread_data {
 	pthread_t thread;
 	sem_t sem;
+	uint32_t node;		// NUMA node this flusher serves
 	volatile bool active;
 	volatile bool terminate;
-} rbt_thread = {
-	.active = false,
-	.terminate = false,
+	struct rbtrace_uring uring;
 };
 
+/* Flusher running on this thread, NULL outside of flushers */
+static __thread struct rbtrace_thread_data *rbt_self = NULL;
+
+/* A flusher per NUMA node, the one of node 0 also owns trace files */
+struct rbtrace_thread_data rbt_threads[RBTRACE_MAX_NODES];
+int rbt_nr_threads = 0;
+
+/* Drain the sub-rings of every node */
+#define RBTRACE_NODE_ALL		(-1)
+
 struct ring_file_data {
+	pthread_mutex_t lock;	// serializes flushers of the ring
 	int fd;
+	int bfd;	// buffered fd next to an O_DIRECT one, or -1
+	rbtrace_iomode_t iomode;// how the open file is written
+	rbtrace_codec_t codec;// codec of the open file
+	uint32_t blk_seq;// sequence of the next block in file
+	uint32_t lap;	// times the open file wrapped
+	uint64_t max_ts;// latest timestamp of the blocks written
+	struct rbtrace_index *index;// block index of the open file, or NULL
 	uint64_t seek;	// offset to seek before write
+	uint64_t sync_ns;// realtime of next TSC sync point
+	uint64_t sync_secs;// interval between TSC sync points
+	bool hdr_dirty;	// header changed since it was last written
+	volatile bool hdr_inflight;// header write in flight
+	union padded_rbtrace_fheader hdr_io;// header as it is being written
+	volatile int32_t cap_post;// buffers a capture writes before it ends
 };
 
+/* Flusher side state of a sub-ring, writes complete out of order but
+ * buffers are freed in order
+ */
+struct subring_flush {
+	uint32_t sf_issued;	// next full buffer to write
+	volatile uint32_t sf_done;// written buffers not freed yet, by index
+	uint32_t sf_trig;	// head of the sub-ring when a capture started
+};
+
+static struct subring_flush rbt_sflush[RBTRACE_RING_MAX][RBTRACE_MAX_CPUS];
+
+/* TSC frequency calibrated at start, 0 if TSC is not used */
+uint64_t rbt_tsc_hz = 0;
+
 extern struct ring_config ring_cfgs[];
+extern int nr_ring_cfgs;
+
+/* Rings this daemon was configured with */
+static struct ring_config rbt_ring_cfgs[RBTRACE_RING_MAX];
+static int rbt_nr_rings = 0;
+
+/* Segments of resized rings for each layout, 0 for the main shm */
+static uint32_t rbt_ring_segs[RBTRACE_RING_MAX][2];
+static uint32_t rbt_next_seg = 0;
 
 struct ring_file_data rbt_rfd[RBTRACE_RING_MAX];
 union padded_rbtrace_fheader rbt_hdrs[RBTRACE_RING_MAX];
@@ -59,36 +176,359 @@ static ssize_t safe_pwrite(int fd, const void *buf,
 	return 0;
 }
 
+static uint64_t timespec_to_ns(struct timespec *ts)
+{
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static uint64_t rbtrace_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_ns(&ts);
+}
+
+/* Sample TSC together with the given clock. Take the sample with the
+ * shortest TSC window among a few tries, in case we got preempted.
+ */
+static void rbtrace_tsc_sample(clockid_t clk, struct rbtrace_tsc_sync *sync)
+{
+	uint64_t t0, t1;
+	uint64_t best = UINT64_MAX;
+	struct timespec ts;
+	int i;
+
+	for (i = 0; i < RBTRACE_TSC_SAMPLE_TRIES; i++) {
+		t0 = rdtsc();
+		clock_gettime(clk, &ts);
+		t1 = rdtsc();
+		if ((t1 - t0) < best) {
+			best = t1 - t0;
+			sync->tsc = t0 + (t1 - t0) / 2;
+			sync->ns = timespec_to_ns(&ts);
+		}
+	}
+}
+
+/* TSC can be used for timestamps only if it ticks at a constant rate
+ * and doesn't stop in deep C-states
+ */
+static bool rbtrace_tsc_invariant(void)
+{
+	FILE *fp;
+	char line[4096];
+	bool constant = false;
+	bool nonstop = false;
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if (fp == NULL) {
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "flags", 5) == 0) {
+			constant = (strstr(line, " constant_tsc") != NULL);
+			nonstop = (strstr(line, " nonstop_tsc") != NULL);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return constant && nonstop;
+}
+
+static uint64_t rbtrace_tsc_calibrate(void)
+{
+	struct rbtrace_tsc_sync s0, s1;
+
+	if (!rbtrace_tsc_invariant()) {
+		dprintf("TSC is not invariant, use realtime clock\n");
+		return 0;
+	}
+
+	rbtrace_tsc_sample(CLOCK_MONOTONIC_RAW, &s0);
+	usleep(RBTRACE_TSC_CALIBRATE_USECS);
+	rbtrace_tsc_sample(CLOCK_MONOTONIC_RAW, &s1);
+
+	if ((s1.tsc <= s0.tsc) || (s1.ns <= s0.ns)) {
+		dprintf("TSC calibration failed, use realtime clock\n");
+		return 0;
+	}
+
+	return (s1.tsc - s0.tsc) * NSEC_PER_SEC / (s1.ns - s0.ns);
+}
+
+/* Record a new TSC sync point in the file header if one is due.
+ * Once the table is full every other point is dropped and the
+ * interval doubled, so the points always cover the whole file.
+ */
+static bool rbtrace_tsc_resync(rbtrace_ring_t ring, bool force)
+{
+	struct rbtrace_fheader *rf;
+	struct ring_file_data *rfd;
+	struct rbtrace_tsc_sync sync;
+	int i;
+
+	rf = &rbt_hdrs[ring].hdr;
+	rfd = &rbt_rfd[ring];
+	if (rf->tsc_hz == 0) {
+		return false;
+	}
+
+	rbtrace_tsc_sample(CLOCK_REALTIME, &sync);
+	if (!force && (sync.ns < rfd->sync_ns)) {
+		return false;
+	}
+
+	if (rf->nr_tsc_syncs == RBTRACE_MAX_TSC_SYNCS) {
+		for (i = 0; i < RBTRACE_MAX_TSC_SYNCS / 2; i++) {
+			rf->tsc_syncs[i] = rf->tsc_syncs[i * 2];
+		}
+		rf->nr_tsc_syncs = RBTRACE_MAX_TSC_SYNCS / 2;
+		rfd->sync_secs *= 2;
+	}
+
+	rf->tsc_syncs[rf->nr_tsc_syncs++] = sync;
+	rfd->sync_ns = sync.ns + rfd->sync_secs * NSEC_PER_SEC;
+	return true;
+}
+
+/* The block index of a coded file follows its header, records start
+ * after it
+ */
+static void rbtrace_format_index(rbtrace_ring_t ring,
+				 struct rbtrace_fheader *rf)
+{
+	struct ring_file_data *rfd = &rbt_rfd[ring];
+	uint64_t data;
+
+	rfd->index = calloc(RBTRACE_INDEX_NR, sizeof(*rfd->index));
+	if (rfd->index == NULL) {
+		dprintf("ring:%d block index alloc failed\n", ring);
+		return;
+	}
+
+	rf->index_nr = RBTRACE_INDEX_NR;
+	rf->index_off = sizeof(union padded_rbtrace_fheader);
+	rf->hdr_size = (rf->index_off + rf->index_nr * sizeof(*rfd->index) +
+			RBTRACE_DIO_ALIGN - 1) & ~(RBTRACE_DIO_ALIGN - 1);
+	data = *rbt_globals.fsize_ptr;
+	data = (data > rf->hdr_size) ? (data - rf->hdr_size) : 0;
+	rf->index_seg = (data / rf->index_nr + RBTRACE_BLOCK_ALIGN) &
+		~(uint64_t)(RBTRACE_BLOCK_ALIGN - 1);
+}
+
 static void rbtrace_format_header(rbtrace_ring_t ring,
 				  struct timespec ts,
 				  struct tm *tm)
 {
 	struct rbtrace_fheader *rf;
-	struct ring_config *rc;
+	struct ring_info *ri;
 	char *ptr;
 
 	rf = &rbt_hdrs[ring].hdr;
-	rc = &ring_cfgs[ring];
+	ri = &rbt_globals.ri_ptr[ring];
 	memset(&rbt_hdrs[ring], 0, sizeof(rbt_hdrs[ring]));
 	strcpy(rf->magic, RBTRACE_FHEADER_MAGIC);
 	rf->major = RBTRACE_MAJOR;
 	rf->minor = RBTRACE_MINOR;
 	rf->ring = ring;
 	rf->wrap_pos = 0;
-	rf->hdr_size = sizeof(rbt_hdrs[ring]);
-	rf->nr_records = rc->rc_size;
+	if ((rbt_rfd[ring].iomode == RBTRACE_IO_DIRECT) ||
+	    (rbt_rfd[ring].iomode == RBTRACE_IO_MMAP)) {
+		rf->hdr_size = RBTRACE_DIO_ALIGN;
+	} else {
+		rf->hdr_size = sizeof(rbt_hdrs[ring]);
+	}
+	rf->nr_records = ri->ri_size;
+	rf->nr_subrings = ri->ri_nr_subrings;
+	rf->entry_format = ri->ri_format;
+	rf->entry_size = ri->ri_entry_size;
+	rf->codec = rbt_rfd[ring].codec;
+	if (rf->codec != RBTRACE_CODEC_NONE) {
+		rbtrace_format_index(ring, rf);
+	}
 	rf->timestamp = ts;
 	rf->gmtoff = tm->tm_gmtoff;
+	if (ri->ri_flags & RBTRACE_DO_TSC) {
+		rf->tsc_hz = rbt_tsc_hz;
+		rbt_rfd[ring].sync_secs = RBTRACE_TSC_SYNC_SECS;
+		rbtrace_tsc_resync(ring, true);
+	}
 
 	ptr = ((char *)rf) + sizeof(*rf);
 	rf->tz_off = (uint32_t)(ptr - (char *)rf);
 	strcpy(ptr, tm->tm_zone);
 	ptr += (strlen(tm->tm_zone) + 1);
 	rf->name_off = (uint32_t)(ptr - (char *)rf);
-	strcpy(ptr, rc->rc_name);
-	ptr += (strlen(rc->rc_name) + 1);
+	strcpy(ptr, ri->ri_name);
+	ptr += (strlen(ri->ri_name) + 1);
 	rf->desc_off = (uint32_t)(ptr - (char *)rf);
-	strcpy(ptr, rc->rc_desc);
+	strcpy(ptr, ri->ri_desc);
+}
+
+static void rbtrace_close_file(struct ring_file_data *rfd)
+{
+	free(rfd->index);
+	rfd->index = NULL;
+	if (rfd->fd != -1) {
+		close(rfd->fd);
+		rfd->fd = -1;
+	}
+	if (rfd->bfd != -1) {
+		close(rfd->bfd);
+		rfd->bfd = -1;
+	}
+}
+
+/* File descriptor to write len bytes of buf at off with, O_DIRECT
+ * takes them only if all three are aligned
+ */
+static int rbtrace_file_fd(struct ring_file_data *rfd, const void *buf,
+			   uint64_t len, uint64_t off)
+{
+	if ((rfd->bfd != -1) &&
+	    (((uintptr_t)buf | len | off) & (RBTRACE_DIO_ALIGN - 1))) {
+		return rfd->bfd;
+	}
+	return rfd->fd;
+}
+
+/* Bytes to pad a write of len bytes with so that the offset of a file
+ * opened with O_DIRECT stays aligned, in whole records of rec bytes.
+ * Records of zeros read as never written, prbt skips them like the
+ * gap between blocks.
+ */
+static size_t rbtrace_dio_pad(struct ring_file_data *rfd, size_t len,
+			      size_t rec)
+{
+	size_t unit = RBTRACE_DIO_ALIGN;
+
+	if (rfd->bfd == -1) {
+		return 0;
+	}
+	while (unit % rec) {
+		unit += RBTRACE_DIO_ALIGN;
+	}
+	return (unit - len % unit) % unit;
+}
+
+/* Write buffer content synchronously. Writes to a file opened with
+ * O_DIRECT are padded to stay aligned, whatever is not goes through
+ * the page cache.
+ */
+static ssize_t rbtrace_file_write(struct ring_file_data *rfd,
+				  const char *buf, size_t len, uint64_t off)
+{
+	size_t head = len;
+	ssize_t ret = 0;
+
+	if (rfd->bfd != -1) {
+		head = 0;
+		if (!(((uintptr_t)buf | off) & (RBTRACE_DIO_ALIGN - 1))) {
+			head = len & ~((size_t)RBTRACE_DIO_ALIGN - 1);
+		}
+	}
+	if (head) {
+		ret = safe_pwrite(rfd->fd, buf, head, off);
+	}
+	if (!ret && (len > head)) {
+		ret = safe_pwrite(rbtrace_file_fd(rfd, buf + head, len - head,
+						  off + head),
+				  buf + head, len - head, off + head);
+	}
+	if (!ret && (rfd->iomode == RBTRACE_IO_DONTNEED)) {
+		sync_file_range(rfd->fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE|
+				SYNC_FILE_RANGE_WRITE|
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(rfd->fd, off, len, POSIX_FADV_DONTNEED);
+	}
+
+	return ret;
+}
+
+/* Point the index entry of the segment a block starts in at it, if it
+ * is the first block written there since the file wrapped
+ */
+static void rbtrace_index_block(rbtrace_ring_t ring,
+				const struct rbtrace_block *blk, uint64_t off)
+{
+	struct ring_file_data *rfd = &rbt_rfd[ring];
+	struct rbtrace_fheader *rf = &rbt_hdrs[ring].hdr;
+	struct rbtrace_index *ent;
+	uint64_t i;
+	ssize_t ret;
+
+	if (rfd->index == NULL) {
+		return;
+	}
+
+	i = (off - rf->hdr_size) / rf->index_seg;
+	if (i >= rf->index_nr) {
+		i = rf->index_nr - 1;
+	}
+	ent = &rfd->index[i];
+	if (!ent->off || (ent->lap != rfd->lap)) {
+		ent->off = off;
+		ent->max_ts = rfd->max_ts;
+		ent->seq = blk->seq;
+		ent->lap = blk->lap;
+		off = rf->index_off + i * sizeof(*ent);
+		ret = safe_pwrite(rbtrace_file_fd(rfd, ent, sizeof(*ent), off),
+				  ent, sizeof(*ent), off);
+		if (ret) {
+			dprintf("ring:%d pwrite index failed, error:%zd\n",
+				ring, ret);
+		}
+	}
+
+	if (blk->max_ts > rfd->max_ts) {
+		rfd->max_ts = blk->max_ts;
+	}
+}
+
+/* Open a trace file the way the ring asks for. A file system that
+ * rejects O_DIRECT gets buffered writes dropped from the page cache
+ * instead.
+ */
+static int rbtrace_open_file(rbtrace_ring_t ring, const char *path)
+{
+	struct ring_file_data *rfd = &rbt_rfd[ring];
+
+	rfd->iomode = rbt_globals.ri_ptr[ring].ri_iomode;
+	rfd->codec = rbt_globals.ri_ptr[ring].ri_codec;
+	rfd->blk_seq = 0;
+	rfd->lap = 0;
+	rfd->max_ts = 0;
+	if (rfd->iomode == RBTRACE_IO_MMAP) {
+		/* Buffers are mapped from the file as it is */
+		rfd->codec = RBTRACE_CODEC_NONE;
+		rfd->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+		return (rfd->fd == -1) ? errno : 0;
+	} else if (rfd->iomode == RBTRACE_IO_DIRECT) {
+		rfd->fd = open(path, O_RDWR|O_CREAT|O_DIRECT, 0666);
+		if (rfd->fd != -1) {
+			/* Header and unaligned tails go through here */
+			rfd->bfd = open(path, O_RDWR);
+			if (rfd->bfd == -1) {
+				return errno;
+			}
+			return 0;
+		}
+		if (errno != EINVAL) {
+			return errno;
+		}
+		dprintf("ring:%d O_DIRECT not supported on %s, "
+			"writing buffered\n", ring, path);
+		rfd->iomode = RBTRACE_IO_DONTNEED;
+	}
+
+	rfd->fd = open(path, O_RDWR|O_CREAT, 0666);
+	if (rfd->fd == -1) {
+		return errno;
+	}
+	return 0;
 }
 
 static void rbtrace_write_header(rbtrace_ring_t ring)
@@ -112,7 +552,12 @@ static void rbtrace_write_header(rbtrace_ring_t ring)
 	gm = localtime(&ts.tv_sec);
 	assert(gm != NULL);
 
-	if (ri->ri_flags & RBTRACE_DO_ZAP) {
+	/* Producers map the file of a ring from ri_file_path, every
+	 * capture gets a file of its own
+	 */
+	if (((ri->ri_flags & RBTRACE_DO_ZAP) &&
+	     (ri->ri_iomode != RBTRACE_IO_MMAP)) ||
+	    (ri->ri_flags & RBTRACE_DO_TRIGGER)) {
 		snprintf(path, sizeof(path),
 			 "%s.%02d-%02d_%02d-%02d-%02d_%03ld",
 			 ri->ri_file_path, gm->tm_mon + 1,
@@ -122,28 +567,56 @@ static void rbtrace_write_header(rbtrace_ring_t ring)
 		strcpy(path, ri->ri_file_path);
 	}
 
-	rfd->fd = open(path, O_RDWR|O_CREAT, 0666);
-	if (rfd->fd == -1) {
-		dprintf("ring:%d open %s failed, error:%d\n",
-			ring, path, errno);
+	ret = rbtrace_open_file(ring, path);
+	if (ret) {
+		dprintf("ring:%d open %s failed, error:%zd\n",
+			ring, path, ret);
 		goto out;
 	}
 
 	dprintf("ring:%d file %s open\n", ring, path);
 
+	/* Reserve the blocks up front so that writes don't allocate
+	 * them, the size only grows as records land
+	 */
+	if (((rfd->iomode == RBTRACE_IO_DIRECT) ||
+	     (rfd->iomode == RBTRACE_IO_DONTNEED)) &&
+	    (fallocate(rfd->fd, FALLOC_FL_KEEP_SIZE, 0,
+		       *rbt_globals.fsize_ptr) == -1)) {
+		dprintf("ring:%d fallocate %s failed, error:%d\n",
+			ring, path, errno);
+	}
+
 	/* Format the trace header */
 	rbtrace_format_header(ring, ts, gm);
 
 	/* Write trace header to trace file */
-	ret = safe_pwrite(rfd->fd, &rbt_hdrs[ring],
-			  sizeof(rbt_hdrs[ring]), 0);
+	ret = safe_pwrite(rbtrace_file_fd(rfd, &rbt_hdrs[ring],
+					  sizeof(rbt_hdrs[ring]), 0),
+			  &rbt_hdrs[ring], sizeof(rbt_hdrs[ring]), 0);
 	if (ret) {
 		dprintf("ring:%d pwrite header failed, error:%zd\n",
 			ring, ret);
 		goto out;
 	}
 
-	rfd->seek = sizeof(rbt_hdrs[ring]);
+	/* A file written before may have left an index behind */
+	if (rfd->index) {
+		ret = safe_pwrite(rbtrace_file_fd(rfd, rfd->index,
+						  RBTRACE_INDEX_NR *
+						  sizeof(*rfd->index),
+						  rbt_hdrs[ring].hdr.index_off),
+				  rfd->index,
+				  RBTRACE_INDEX_NR * sizeof(*rfd->index),
+				  rbt_hdrs[ring].hdr.index_off);
+		if (ret) {
+			dprintf("ring:%d pwrite index failed, error:%zd\n",
+				ring, ret);
+			goto out;
+		}
+	}
+
+	rfd->seek = rbt_hdrs[ring].hdr.hdr_size;
 	/* Set flag to indicate file is open for business */
 	ri->ri_flags |= RBTRACE_DO_DISK;
 
@@ -154,214 +627,1893 @@ static void rbtrace_write_header(rbtrace_ring_t ring)
  out:
 	ri->ri_flags &= ~RBTRACE_DO_OPEN;
 	rfd->seek = 0;
-	if (rfd->fd != -1) {
-		close(rfd->fd);
-		rfd->fd = -1;
-	}
+	rbtrace_close_file(rfd);
 }
 
-static void rbtrace_write_data(rbtrace_ring_t ring,
-			       bool do_flush)
+/* Free the oldest full buffer of a sub-ring once it is written, and
+ * report the records lost since it was queued
+ */
+static void rbtrace_free_buffer(rbtrace_ring_t ring,
+				struct subring_info *si)
 {
-	struct ring_config *cfg = NULL;
-	struct ring_info *ri = NULL;
-	struct ring_file_data *rfd = NULL;
-	union padded_rbtrace_fheader *prf = NULL;
-	char *buf = NULL;
-	ssize_t buf_size = 0;
-	ssize_t ret = 0;
-	int flush = 0;
+	struct ring_info *ri;
+	struct policy_stats *ps;
+	int discard = 0;
 	int lost = 0;
-	bool update_hdr = false;
 
-	rfd = &rbt_rfd[ring];
-	if (rfd->fd == -1) {
-		dprintf("ring:%d invalid file descriptor!\n", ring);
-		goto end;
+	ri = &rbt_globals.ri_ptr[ring];
+	ps = rbtrace_policy_stats(ri);
+	lost = __sync_lock_test_and_set(&si->si_lost, 0);
+	discard = __sync_lock_test_and_set(&si->si_discard, 0);
+
+	/* Oldest buffer is free again, wake blocked producers */
+	__sync_add_and_fetch(&si->si_tail, 1);
+	rbtrace_subring_wake(si);
+
+	if (discard || lost) {
+		/* Discarded buffers are counted in records of their own
+		 * layout, the ring may have been resized since
+		 */
+		if (discard) {
+			lost += discard;
+			__sync_add_and_fetch(&ps->ps_lost, discard);
+		}
+		dprintf("ring:%d trace buffer:%lx lost %d records\n",
+			ring, __sync_add_and_fetch(&total_buffers, 1), lost);
+		rbtrace(RBTRACE_RING_IO, RBT_LOST, lost, 0, 0, 0);
+	} else {
+		__sync_add_and_fetch(&total_buffers, 1);
 	}
+}
+
+/* Mark a full buffer written and free the written buffers at the tail
+ * of the sub-ring. Whoever clears the done bit of the tail frees it,
+ * so flushers completing writes of the same sub-ring don't race.
+ */
+static void rbtrace_buffer_done(rbtrace_ring_t ring,
+				struct subring_info *si, uint32_t seq)
+{
+	struct ring_info *ri;
+	struct subring_flush *sf;
+	uint32_t bit;
 
-	cfg = &ring_cfgs[ring];
 	ri = &rbt_globals.ri_ptr[ring];
-	prf = &rbt_hdrs[ring];
+	sf = &rbt_sflush[ring][si - ri->ri_subrings];
+	__sync_fetch_and_or(&sf->sf_done, 1U << (seq % ri->ri_nr_bufs));
+	for (;;) {
+		bit = 1U << (si->si_tail % ri->ri_nr_bufs);
+		if (!(__sync_fetch_and_and(&sf->sf_done, ~bit) & bit)) {
+			break;
+		}
+		rbtrace_free_buffer(ring, si);
+	}
+}
 
-	if (do_flush) {
-		buf = (char *)(rbt_globals.re_base + ri->ri_cir_off);
-		buf_size = (ri->ri_slot + 1) * sizeof(struct rbtrace_entry);
+static void rbtrace_uring_exit(struct rbtrace_uring *ur)
+{
+	if (ur->fd == -1) {
+		return;
+	}
+	munmap(ur->sqes, ur->sqes_len);
+	if (ur->cq_ptr != ur->sq_ptr) {
+		munmap(ur->cq_ptr, ur->cq_len);
+	}
+	munmap(ur->sq_ptr, ur->sq_len);
+	close(ur->fd);
+	ur->fd = -1;
+}
+
+/* Set up an io_uring for the writes of a flusher, liburing is not
+ * needed for the few operations we use. IORING_OP_WRITE appeared
+ * along with IORING_FEAT_RW_CUR_POS, older kernels write
+ * synchronously.
+ */
+static int rbtrace_uring_init(struct rbtrace_uring *ur)
+{
+	struct io_uring_params p;
+	int rc = 0;
+
+	memset(ur, 0, sizeof(*ur));
+	memset(&p, 0, sizeof(p));
+	ur->fd = syscall(__NR_io_uring_setup, RBTRACE_URING_DEPTH, &p);
+	if (ur->fd == -1) {
+		return errno;
+	}
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		rc = ENOTSUP;
+		goto setup_fail;
+	}
+
+	ur->sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	ur->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_len > ur->sq_len) {
+			ur->sq_len = ur->cq_len;
+		}
+		ur->cq_len = ur->sq_len;
+	}
+	ur->sq_ptr = mmap(NULL, ur->sq_len, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, ur->fd,
+			  IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED) {
+		rc = errno;
+		goto setup_fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ptr = ur->sq_ptr;
 	} else {
-		buf = (char *)(rbt_globals.re_base + ri->ri_alt_off);
-		buf_size = cfg->rc_data_size;
+		ur->cq_ptr = mmap(NULL, ur->cq_len, PROT_READ|PROT_WRITE,
+				  MAP_SHARED|MAP_POPULATE, ur->fd,
+				  IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED) {
+			rc = errno;
+			goto cq_fail;
+		}
+	}
+	ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		rc = errno;
+		goto sqes_fail;
 	}
 
-	/* Update file header if this ring is wrapped */
-	if (prf->hdr.wrap_pos && (ri->ri_flags & RBTRACE_DO_WRAP)) {
-		rfd->seek = prf->hdr.wrap_pos;
-		prf->hdr.wrap_pos += buf_size;
-		update_hdr = true;
+	ur->sq_head = (uint32_t *)((char *)ur->sq_ptr + p.sq_off.head);
+	ur->sq_tail = (uint32_t *)((char *)ur->sq_ptr + p.sq_off.tail);
+	ur->sq_mask = (uint32_t *)((char *)ur->sq_ptr + p.sq_off.ring_mask);
+	ur->sq_entries = (uint32_t *)((char *)ur->sq_ptr +
+				      p.sq_off.ring_entries);
+	ur->sq_array = (uint32_t *)((char *)ur->sq_ptr + p.sq_off.array);
+	ur->cq_head = (uint32_t *)((char *)ur->cq_ptr + p.cq_off.head);
+	ur->cq_tail = (uint32_t *)((char *)ur->cq_ptr + p.cq_off.tail);
+	ur->cq_mask = (uint32_t *)((char *)ur->cq_ptr + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ur->cq_ptr +
+					   p.cq_off.cqes);
+	return 0;
+
+ sqes_fail:
+	if (ur->cq_ptr != ur->sq_ptr) {
+		munmap(ur->cq_ptr, ur->cq_len);
 	}
+ cq_fail:
+	munmap(ur->sq_ptr, ur->sq_len);
+ setup_fail:
+	close(ur->fd);
+	ur->fd = -1;
+	return rc;
+}
 
-	/* Write buffer content to file */
-	ret = safe_pwrite(rfd->fd, buf, buf_size, rfd->seek);
-	if (ret) {
-		dprintf("ring:%d write trace failed, error:%zd\n",
-			ring, ret);
-		goto end;
+/* Count records that won't make it to the trace file, the producer
+ * reports them with its next swap
+ */
+static inline void rbtrace_count_lost(struct ring_info *ri,
+				      struct subring_info *si, int nr)
+{
+	__sync_add_and_fetch(&si->si_lost, nr);
+	__sync_add_and_fetch(&rbtrace_policy_stats(ri)->ps_lost, nr);
+}
+
+/* Records of a write that didn't make it to the file are lost */
+static void rbtrace_io_lost(struct rbtrace_io *io)
+{
+	struct ring_info *ri = &rbt_globals.ri_ptr[io->io_ring];
+	struct subring_info *si = &ri->ri_subrings[io->io_subring];
+
+	if (io->io_lost) {
+		return;
+	}
+	io->io_lost = true;
+	if (io->io_hdr) {
+		/* Have the next header update write it again */
+		rbt_rfd[io->io_ring].hdr_dirty = true;
+		return;
+	}
+	rbtrace_count_lost(ri, si, io->io_nr);
+	__sync_sub_and_fetch(&ri->ri_stats.rs_node_records[si->si_node],
+			     io->io_nr);
+}
+
+static bool rbtrace_uring_submit(struct rbtrace_uring *ur, uint64_t slot);
+
+/* An operation completed. A write that was cut short or interrupted
+ * is submitted again for the rest, once it is over its buffer is
+ * freed or the next header update may go out. The slot is free once
+ * the operations linked to the write completed too.
+ */
+static void rbtrace_io_done(struct rbtrace_uring *ur, uint64_t data,
+			    int32_t res)
+{
+	struct rbtrace_io *io;
+	struct ring_info *ri;
+	uint64_t slot = RBTRACE_URING_SLOT(data);
+	ssize_t ret;
+
+	if (slot >= RBTRACE_URING_DEPTH) {
+		return;
+	}
+	io = &ur->ios[slot];
+	ri = &rbt_globals.ri_ptr[io->io_ring];
+
+	if (data != slot) {
+		/* A write that failed or was short cancels its links */
+		io->io_links--;
+		if ((res < 0) && (res != -ECANCELED)) {
+			dprintf("ring:%d %s of trace failed, error:%d\n",
+				io->io_ring, (data & RBTRACE_URING_SYNC) ?
+				"sync" : "fadvise", -res);
+			if (data & RBTRACE_URING_SYNC) {
+				rbtrace_io_lost(io);
+			}
+		}
+		goto out;
+	}
+
+	if (res > 0) {
+		io->io_pos += res;
+	}
+	if ((res == -EAGAIN) || (res == -EINTR) ||
+	    ((res > 0) && (io->io_pos < io->io_len))) {
+		if (rbtrace_uring_submit(ur, slot)) {
+			return;
+		}
+		ret = safe_pwrite(io->io_fd, io->io_addr + io->io_pos,
+				  io->io_len - io->io_pos,
+				  io->io_off + io->io_pos);
+		if (ret) {
+			res = ret;
+		}
+	}
+	if ((res < 0) || (io->io_pos < io->io_len)) {
+		dprintf("ring:%d write %s failed, %u of %u bytes, error:%d\n",
+			io->io_ring, io->io_hdr ? "header" : "trace",
+			io->io_pos, io->io_len, res < 0 ? -res : EIO);
+		rbtrace_io_lost(io);
+	}
+
+	io->io_over = true;
+	if (io->io_hdr) {
+		rbt_rfd[io->io_ring].hdr_inflight = false;
+		if (rbt_rfd[io->io_ring].hdr_dirty) {
+			rbtrace_signal_thread(ri, 0);
+		}
+	} else if (io->io_buf) {
+		/* The buffer was freed once it was copied */
+		free(io->io_buf);
+		io->io_buf = NULL;
 	} else {
-		/* Clear the buffer to avoid poison data */
-		memset(buf, 0, buf_size);
+		rbtrace_buffer_done(io->io_ring,
+				    &ri->ri_subrings[io->io_subring],
+				    io->io_seq);
 	}
 
-	rfd->seek += buf_size;
+ out:
+	if (io->io_over && (io->io_links == 0)) {
+		close(io->io_fd);
+		io->io_fd = -1;
+		ur->busy &= ~(1ULL << slot);
+		ur->inflight--;
+	}
+}
 
-	/* Close or wrap the file if buffer limit reached */
-	if (rfd->seek >= *rbt_globals.fsize_ptr) {
-		if (ri->ri_flags & RBTRACE_DO_CLOSE) {
-			/* Flush will be done in thread_fn */
-			dprintf("ring:%d user specified close.\n", ring);
-		} else if (ri->ri_flags & RBTRACE_DO_WRAP) {
-			/* Reset wrap position */
-			prf->hdr.wrap_pos = sizeof(*prf);
-			update_hdr = true;
-		} else if (ri->ri_flags & RBTRACE_DO_ZAP) {
-			/* Close current and open a new trace file */
-			close(rfd->fd);
-			rfd->fd = -1;
-			rbtrace_write_header(ring);
-		} else {
-			/* Close file and stop tracing */
-			close(rfd->fd);
-			rfd->fd = -1;
-			ri->ri_flags &= ~RBTRACE_DO_DISK;
+/* Submission queue entries the kernel has not consumed yet */
+static inline uint32_t rbtrace_uring_pending(struct rbtrace_uring *ur)
+{
+	return *ur->sq_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Handle completed writes, waiting for at least min of them */
+static void rbtrace_uring_reap(struct rbtrace_uring *ur, uint32_t min)
+{
+	struct io_uring_cqe *cqe;
+	uint32_t head, tail;
+	long rc;
+
+	if (ur->fd == -1) {
+		return;
+	}
+	if (min) {
+		do {
+			rc = syscall(__NR_io_uring_enter, ur->fd,
+				     rbtrace_uring_pending(ur), min,
+				     IORING_ENTER_GETEVENTS, NULL, 0);
+		} while ((rc == -1) && (errno == EINTR));
+	}
+
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		rbtrace_io_done(ur, cqe->user_data, cqe->res);
+		head++;
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for all writes of this flusher to complete */
+static void rbtrace_uring_quiesce(void)
+{
+	if (rbt_self == NULL) {
+		return;
+	}
+	while (rbt_self->uring.inflight) {
+		rbtrace_uring_reap(&rbt_self->uring, 1);
+	}
+}
+
+/* Take the next submission queue entry */
+static struct io_uring_sqe *rbtrace_uring_sqe(struct rbtrace_uring *ur,
+					      uint32_t tail, uint8_t opcode,
+					      int fd, uint64_t off,
+					      uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t idx;
+
+	idx = tail & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	ur->sq_array[idx] = idx;
+	return sqe;
+}
+
+/* Queue what is left of the write in a slot, with drop the whole
+ * range is synced and dropped from the page cache by linked
+ * operations. Returns false if nothing was submitted.
+ */
+static bool rbtrace_uring_submit(struct rbtrace_uring *ur, uint64_t slot)
+{
+	struct rbtrace_io *io = &ur->ios[slot];
+	struct io_uring_sqe *sqe;
+	uint32_t tail, nr;
+	long rc;
+
+	tail = *ur->sq_tail;
+	sqe = rbtrace_uring_sqe(ur, tail, IORING_OP_WRITE, io->io_fd,
+				io->io_off + io->io_pos, slot);
+	sqe->addr = (uintptr_t)(io->io_addr + io->io_pos);
+	sqe->len = io->io_len - io->io_pos;
+	nr = 1;
+	if (io->io_drop) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = rbtrace_uring_sqe(ur, tail + nr++,
+					IORING_OP_SYNC_FILE_RANGE, io->io_fd,
+					io->io_off, slot | RBTRACE_URING_SYNC);
+		sqe->len = io->io_len;
+		sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE|
+			SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER;
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = rbtrace_uring_sqe(ur, tail + nr++, IORING_OP_FADVISE,
+					io->io_fd, io->io_off,
+					slot | RBTRACE_URING_FADV);
+		sqe->len = io->io_len;
+		sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+	}
+	__atomic_store_n(ur->sq_tail, tail + nr, __ATOMIC_RELEASE);
+
+	/* Entries the kernel leaves behind go out with the next submit */
+	do {
+		rc = syscall(__NR_io_uring_enter, ur->fd,
+			     rbtrace_uring_pending(ur), 0, 0, NULL, 0);
+	} while ((rc == -1) && (errno == EINTR));
+	if (rc <= 0) {
+		/* Take the entries back, nothing was consumed */
+		__atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+		dprintf("ring:%d io_uring submit failed, error:%d\n",
+			io->io_ring, rc == -1 ? errno : EAGAIN);
+		return false;
+	}
+
+	io->io_links += nr - 1;
+	return true;
+}
+
+/* Queue a write on the io_uring of this flusher and submit it right
+ * away. The write holds a descriptor of its own so that the file can
+ * be closed or replaced right after. Returns false if the write has
+ * to be done synchronously.
+ */
+static bool rbtrace_uring_write(struct rbtrace_io *req, int fd,
+				const void *buf, uint64_t off, bool drop)
+{
+	struct rbtrace_uring *ur;
+	struct rbtrace_io *io;
+	uint64_t slot;
+
+	if ((rbt_self == NULL) || (rbt_self->uring.fd == -1)) {
+		return false;
+	}
+	ur = &rbt_self->uring;
+
+	/* Every io in flight holds a slot */
+	while (ur->busy == ~0ULL) {
+		rbtrace_uring_reap(ur, 1);
+	}
+	slot = __builtin_ctzll(~ur->busy);
+	io = &ur->ios[slot];
+	*io = *req;
+	io->io_fd = dup(fd);
+	if (io->io_fd == -1) {
+		return false;
+	}
+	io->io_off = off;
+	io->io_addr = buf;
+	io->io_drop = drop;
+	io->io_pos = 0;
+	io->io_links = 0;
+	io->io_over = false;
+	io->io_lost = false;
+	if (!rbtrace_uring_submit(ur, slot)) {
+		close(io->io_fd);
+		io->io_fd = -1;
+		return false;
+	}
+
+	ur->busy |= 1ULL << slot;
+	ur->inflight++;
+	return true;
+}
+
+/* Write the file header if it changed. Only the flusher of node 0
+ * queues header writes, one at a time so that they land in order,
+ * other flushers leave it to node 0 unless writes are synchronous.
+ */
+static void rbtrace_write_hdr(rbtrace_ring_t ring)
+{
+	struct ring_file_data *rfd = &rbt_rfd[ring];
+	struct rbtrace_io req;
+	ssize_t ret;
+
+	if (!rfd->hdr_dirty || rfd->hdr_inflight) {
+		return;
+	}
+
+	if ((rbt_self != NULL) && (rbt_self->uring.fd != -1)) {
+		if (rbt_self->node != 0) {
+			rbtrace_signal_thread(&rbt_globals.ri_ptr[ring], 0);
+			return;
+		}
+		memcpy(&rfd->hdr_io, &rbt_hdrs[ring], sizeof(rfd->hdr_io));
+		memset(&req, 0, sizeof(req));
+		req.io_ring = ring;
+		req.io_len = sizeof(rfd->hdr_io);
+		req.io_hdr = true;
+		rfd->hdr_inflight = true;
+		rfd->hdr_dirty = false;
+		if (rbtrace_uring_write(&req,
+					rbtrace_file_fd(rfd, &rfd->hdr_io,
+							req.io_len, 0),
+					&rfd->hdr_io, 0, false)) {
+			return;
+		}
+		rfd->hdr_inflight = false;
+	}
+
+	rfd->hdr_dirty = false;
+	ret = safe_pwrite(rbtrace_file_fd(rfd, &rbt_hdrs[ring],
+					  sizeof(rbt_hdrs[ring]), 0),
+			  &rbt_hdrs[ring], sizeof(rbt_hdrs[ring]), 0);
+	if (ret) {
+		dprintf("ring:%d update hdr failed, error:%zd\n",
+			ring, ret);
+	}
+}
+
+/* Wait for producers that reserved a slot in a buffer to commit it,
+ * with one bounded wait for the whole buffer. Returns the number of
+ * records still uncommitted, they are counted as lost.
+ */
+static int rbtrace_wait_commits(struct ring_info *ri, const char *buf,
+				int nr, uint8_t gen)
+{
+	const volatile uint8_t *commit;
+	int left = 0;
+	int cnt = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		commit = (const volatile uint8_t *)(buf + (size_t)i *
+						    ri->ri_entry_size +
+						    ri->ri_commit_off);
+		while (__atomic_load_n(commit, __ATOMIC_ACQUIRE) != gen) {
+			if (cnt >= RBTRACE_COMMIT_SPINS) {
+				left++;
+				break;
+			}
+			/* Producer may be preempted on this CPU */
+			if ((++cnt % 64) == 0) {
+				sched_yield();
+			} else {
+				pause();
+			}
+		}
+	}
+
+	return left;
+}
+
+/* Copy the records of a buffer that are committed, the others are
+ * zeroed in the copy so that they read as never written. The buffer
+ * itself is left alone as a late producer may still write to it.
+ * Returns the number of records left out.
+ */
+static int rbtrace_copy_commits(struct ring_info *ri, const char *buf,
+				char *copy, int nr, uint8_t gen)
+{
+	const uint8_t *commit;
+	size_t off;
+	int left = 0;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		off = (size_t)i * ri->ri_entry_size;
+		commit = (const uint8_t *)(buf + off + ri->ri_commit_off);
+		/* A committed record doesn't change until it is freed */
+		if (__atomic_load_n(commit, __ATOMIC_ACQUIRE) == gen) {
+			memcpy(copy + off, buf + off, ri->ri_entry_size);
+		} else {
+			memset(copy + off, 0, ri->ri_entry_size);
+			left++;
+		}
+	}
+
+	return left;
+}
+
+/* Mark the uncommitted records of a buffer mapped from the trace file
+ * pending so that prbt skips them. A marker left by an older pass is
+ * only replaced if no producer got to the record in the meantime.
+ */
+static void rbtrace_mark_commits(struct ring_info *ri, char *buf,
+				 int nr, uint8_t gen)
+{
+	uint8_t *commit;
+	uint8_t old;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		commit = (uint8_t *)(buf + (size_t)i * ri->ri_entry_size +
+				     ri->ri_commit_off);
+		old = __atomic_load_n(commit, __ATOMIC_ACQUIRE);
+		if ((old != gen) && !(old & RBTRACE_COMMIT_PENDING)) {
+			__sync_bool_compare_and_swap(commit, old,
+						     old |
+						     RBTRACE_COMMIT_PENDING);
+		}
+	}
+}
+
+/* A full buffer mapped from the trace file is there already, start
+ * its writeback and point the header at the oldest buffer, the one
+ * producers fill after the active one. Buffers filled before the ring
+ * moved onto the file have nowhere to go.
+ */
+static void rbtrace_map_data(rbtrace_ring_t ring, struct subring_info *si,
+			     uint32_t layout, uint32_t seq, int nr, int lost)
+{
+	struct ring_info *ri = &rbt_globals.ri_ptr[ring];
+	struct subring_geo *geo = &si->si_geo[layout];
+	size_t buf_size;
+	uint32_t head;
+
+	if (!(geo->sg_seg & RBTRACE_SEG_FILE)) {
+		lost = nr;
+	}
+	if (lost) {
+		rbtrace_count_lost(ri, si, lost);
+	}
+	if (lost == nr) {
+		return;
+	}
+
+	buf_size = (size_t)geo->sg_size * ri->ri_entry_size;
+	sync_file_range(rbt_rfd[ring].fd, geo->sg_buf_off +
+			(seq % ri->ri_nr_bufs) * buf_size, buf_size,
+			SYNC_FILE_RANGE_WRITE);
+	__sync_add_and_fetch(&ri->ri_stats.rs_node_records[si->si_node],
+			     nr - lost);
+
+	head = rbtrace_pass_head(RBTRACE_POS_PASS(si->si_pos));
+	rbt_hdrs[ring].hdr.wrap_pos = geo->sg_buf_off +
+		((head + 1) % ri->ri_nr_bufs) * buf_size;
+	rbtrace_tsc_resync(ring, false);
+	rbt_rfd[ring].hdr_dirty = true;
+	rbtrace_write_hdr(ring);
+}
+
+/* Write out the oldest full buffer of a sub-ring that is not written
+ * yet, or the active buffer if we were asked to flush. Full buffers
+ * are written asynchronously if the flusher has an io_uring, they are
+ * freed once written.
+ */
+static void rbtrace_write_data(rbtrace_ring_t ring,
+			       struct subring_info *si,
+			       bool do_flush)
+{
+	struct ring_info *ri = NULL;
+	struct ring_file_data *rfd = NULL;
+	struct subring_flush *sf = NULL;
+	union padded_rbtrace_fheader *prf = NULL;
+	struct rbtrace_io req;
+	char *buf = NULL;
+	char *blk = NULL;
+	char *copy = NULL;
+	ssize_t buf_size = 0;
+	ssize_t ret = 0;
+	size_t pad = 0;
+	uint64_t pos = 0;
+	uint64_t off = 0;
+	uint32_t pass = 0;
+	uint32_t seq = 0;
+	uint32_t layout = 0;
+	int lost = 0;
+	int slot = 0;
+	uint8_t gen = 0;
+	bool update_hdr = false;
+	bool queued = false;
+	bool freed = false;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	rfd = &rbt_rfd[ring];
+	sf = &rbt_sflush[ring][si - ri->ri_subrings];
+	if (!do_flush) {
+		seq = sf->sf_issued++;
+	}
+	if (rfd->fd == -1) {
+		dprintf("ring:%d invalid file descriptor!\n", ring);
+		goto end;
+	}
+
+	prf = &rbt_hdrs[ring];
+
+	/* Active buffers left the file when it was asked to close */
+	if (do_flush && (rfd->iomode == RBTRACE_IO_MMAP)) {
+		goto end;
+	}
+
+	if (do_flush) {
+		/* Count may run past the buffer end if records are
+		 * being dropped
+		 */
+		pos = si->si_pos;
+		pass = RBTRACE_POS_PASS(pos);
+		seq = rbtrace_pass_head(pass);
+		layout = rbtrace_pass_layout(pass);
+		slot = RBTRACE_POS_COUNT(pos);
+		if (slot > (int)si->si_geo[layout].sg_size) {
+			slot = si->si_geo[layout].sg_size;
+		}
+		gen = rbtrace_pass_gen(pass);
+	} else {
+		/* Oldest full buffer in the queue not written yet */
+		gen = si->si_buf_gen[seq % ri->ri_nr_bufs];
+		layout = (gen & RBTRACE_BUF_LAYOUT) ? 1 : 0;
+		gen &= RBTRACE_COMMIT_GEN_MASK;
+		slot = si->si_geo[layout].sg_size;
+	}
+	buf_size = slot * ri->ri_entry_size;
+	if (buf_size == 0) {
+		goto end;
+	}
+	buf = rbtrace_subring_buffer(ri, si, layout, seq);
+	if (buf == NULL) {
+		goto end;
+	}
+
+	lost = rbtrace_wait_commits(ri, buf, slot, gen);
+	if (rfd->iomode == RBTRACE_IO_MMAP) {
+		if (lost) {
+			rbtrace_mark_commits(ri, buf, slot, gen);
+		}
+		rbtrace_map_data(ring, si, layout, seq, slot, lost);
+		goto end;
+	}
+
+	/* Stragglers are left out of a copy of the buffer, which is
+	 * written instead and frees the buffer right away. So is a
+	 * buffer that needs padding for O_DIRECT.
+	 */
+	if (rfd->codec == RBTRACE_CODEC_NONE) {
+		pad = rbtrace_dio_pad(rfd, buf_size, ri->ri_entry_size);
+	}
+	if (lost || pad) {
+		if (posix_memalign((void **)&copy, RBTRACE_DIO_ALIGN,
+				   buf_size + pad)) {
+			dprintf("ring:%d copy alloc failed\n", ring);
+			copy = NULL;
+			lost = slot;
+		} else {
+			lost = rbtrace_copy_commits(ri, buf, copy, slot, gen);
+			memset(copy + buf_size, 0, pad);
+			buf = copy;
+			buf_size += pad;
+		}
+		if (lost) {
+			rbtrace_count_lost(ri, si, lost);
+		}
+		if (copy == NULL) {
+			goto end;
+		}
+		if (!do_flush) {
+			rbtrace_buffer_done(ring, si, seq);
+			freed = true;
+		}
+	}
+
+	/* A coded file gets a block per buffer, the buffer is free to
+	 * fill again once it is coded
+	 */
+	if (rfd->codec != RBTRACE_CODEC_NONE) {
+		buf_size = rbtrace_block_bound(slot, ri->ri_format);
+		buf_size += rbtrace_dio_pad(rfd, buf_size,
+					    RBTRACE_BLOCK_ALIGN);
+		if (posix_memalign((void **)&blk, RBTRACE_DIO_ALIGN,
+				   buf_size)) {
+			dprintf("ring:%d block alloc failed\n", ring);
+			blk = NULL;
+			goto end;
+		}
+		buf_size = rbtrace_encode_block(buf, slot, ri->ri_format,
+						prf->hdr.tsc_hz != 0,
+						rfd->codec,
+						si - ri->ri_subrings,
+						rfd->blk_seq++,
+						rfd->lap, blk);
+		pad = rbtrace_dio_pad(rfd, buf_size, RBTRACE_BLOCK_ALIGN);
+		memset(blk + buf_size, 0, pad);
+		buf_size += pad;
+		buf = blk;
+		free(copy);
+		copy = NULL;
+		if (!do_flush && !freed) {
+			rbtrace_buffer_done(ring, si, seq);
+			freed = true;
+		}
+	}
+
+	/* Update file header if this ring is wrapped */
+	if (prf->hdr.wrap_pos && (ri->ri_flags & RBTRACE_DO_WRAP)) {
+		rfd->seek = prf->hdr.wrap_pos;
+		prf->hdr.wrap_pos += buf_size;
+		update_hdr = true;
+	}
+
+	/* Write buffer content to file, the active buffer keeps
+	 * filling so it is written synchronously
+	 */
+	off = rfd->seek;
+	if (blk) {
+		rbtrace_index_block(ring, (struct rbtrace_block *)blk, off);
+	}
+	if (!do_flush) {
+		memset(&req, 0, sizeof(req));
+		req.io_ring = ring;
+		req.io_subring = si - ri->ri_subrings;
+		req.io_seq = seq;
+		req.io_len = buf_size;
+		req.io_nr = slot - lost;
+		req.io_buf = blk ? blk : copy;
+		queued = rbtrace_uring_write(&req,
+					     rbtrace_file_fd(rfd, buf,
+							     buf_size, off),
+					     buf, off, rfd->iomode ==
+					     RBTRACE_IO_DONTNEED);
+	}
+	if (!queued) {
+		ret = rbtrace_file_write(rfd, buf, buf_size, off);
+		if (ret) {
+			dprintf("ring:%d write trace failed, error:%zd\n",
+				ring, ret);
+			rbtrace_count_lost(ri, si, slot - lost);
+			goto end;
+		}
+	}
+
+	rfd->seek += buf_size;
+	__sync_add_and_fetch(&ri->ri_stats.rs_node_records[si->si_node],
+			     slot - lost);
+
+	/* A capture ends once it wrote its buffers after the trigger */
+	if (!do_flush && (ri->ri_flags & RBTRACE_DO_TRIGGER) &&
+	    (((seq - sf->sf_trig) & RBTRACE_PASS_HEAD_MASK) <=
+	     RBTRACE_PASS_HEAD_MASK / 2) &&
+	    (__sync_sub_and_fetch(&rfd->cap_post, 1) == 0)) {
+		rbtrace_ctrl(ring, RBTRACE_OP_CLOSE, NULL);
+	}
+
+	/* Let prbt follow the drift between TSC and realtime */
+	if (rbtrace_tsc_resync(ring, false)) {
+		update_hdr = true;
+	}
+
+	/* Close or wrap the file if buffer limit reached */
+	if (rfd->seek >= *rbt_globals.fsize_ptr) {
+		if (ri->ri_flags & RBTRACE_DO_CLOSE) {
+			/* Flush will be done in thread_fn */
+			dprintf("ring:%d user specified close.\n", ring);
+		} else if (ri->ri_flags & RBTRACE_DO_WRAP) {
+			/* Reset wrap position */
+			prf->hdr.wrap_pos = prf->hdr.hdr_size;
+			rfd->lap++;
+			update_hdr = true;
+		} else if (ri->ri_flags & RBTRACE_DO_ZAP) {
+			/* Close current and open a new trace file */
+			rbtrace_close_file(rfd);
+			rbtrace_write_header(ring);
+		} else {
+			/* Close file and stop tracing */
+			rbtrace_close_file(rfd);
+			ri->ri_flags &= ~RBTRACE_DO_DISK;
+		}
+	}
+
+	if (update_hdr) {
+		rfd->hdr_dirty = true;
+		rbtrace_write_hdr(ring);
+	}
+
+ end:
+	/* A flush of the active buffer doesn't complete a swap, a
+	 * queued write frees its buffer when it completes
+	 */
+	if (!do_flush && !queued && !freed) {
+		rbtrace_buffer_done(ring, si, seq);
+	}
+	if (!queued) {
+		free(blk);
+		free(copy);
+	}
+}
+
+/* Number of full buffers of a sub-ring waiting to be written */
+static inline uint32_t rbtrace_queued(rbtrace_ring_t ring,
+				      struct subring_info *si)
+{
+	struct ring_info *ri = &rbt_globals.ri_ptr[ring];
+
+	return (rbtrace_pass_head(RBTRACE_POS_PASS(si->si_pos)) -
+		rbt_sflush[ring][si - ri->ri_subrings].sf_issued) &
+		RBTRACE_PASS_HEAD_MASK;
+}
+
+/* Write out the full buffers of the sub-rings on a node in order, or
+ * of all sub-rings for RBTRACE_NODE_ALL, and the partially filled
+ * active buffers too if we were asked to flush
+ */
+static void rbtrace_drain_ring(rbtrace_ring_t ring, int node)
+{
+	struct ring_info *ri;
+	struct subring_info *si;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		if ((node != RBTRACE_NODE_ALL) && (si->si_node != node)) {
+			continue;
+		}
+		while (rbtrace_queued(ring, si)) {
+			rbtrace_write_data(ring, si, false);
+		}
+	}
+
+	if (ri->ri_flags & RBTRACE_DO_FLUSH) {
+		for (i = 0; i < ri->ri_nr_subrings; i++) {
+			rbtrace_write_data(ring, &ri->ri_subrings[i], true);
+		}
+		ri->ri_flags &= ~RBTRACE_DO_FLUSH;
+	}
+
+	/* Header updates held back while one was in flight */
+	rbtrace_write_hdr(ring);
+}
+
+/* A layout can be given new buffers once no sub-ring fills or has
+ * queued buffers of it
+ */
+static bool rbtrace_layout_busy(struct ring_info *ri, uint32_t layout)
+{
+	struct subring_info *si;
+	uint32_t head;
+	uint32_t seq;
+	uint8_t gen;
+	int i;
+
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		head = rbtrace_pass_head(RBTRACE_POS_PASS(si->si_pos));
+		if (rbtrace_pass_layout(RBTRACE_POS_PASS(si->si_pos)) ==
+		    layout) {
+			return true;
+		}
+		for (seq = si->si_tail; seq != head;
+		     seq = (seq + 1) & RBTRACE_PASS_HEAD_MASK) {
+			gen = si->si_buf_gen[seq % ri->ri_nr_bufs];
+			if (((gen & RBTRACE_BUF_LAYOUT) ? 1 : 0) == layout) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Sub-rings move to the layout of the ring when their buffer fills.
+ * Move the ones nothing was traced to in their pass right away, idle
+ * sub-rings would hold on to the old layout forever otherwise.
+ */
+static void rbtrace_layout_switch_idle(struct ring_info *ri)
+{
+	struct subring_info *si;
+	uint32_t layout;
+	uint32_t pass;
+	uint64_t pos;
+	int i;
+
+	layout = ri->ri_layout ? RBTRACE_PASS_LAYOUT : 0;
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		pos = si->si_pos;
+		pass = RBTRACE_POS_PASS(pos);
+		if (((pass & RBTRACE_PASS_LAYOUT) == layout) ||
+		    (RBTRACE_POS_COUNT(pos) != 0)) {
+			continue;
+		}
+		pass = ((pass + RBTRACE_PASS_DISCARD) & ~RBTRACE_PASS_LAYOUT) |
+			layout;
+		__sync_bool_compare_and_swap(&si->si_pos, pos,
+					     RBTRACE_POS(pass, 0));
+	}
+}
+
+/* Bytes the buffers of a sub-ring take, sub-rings placed on NUMA
+ * nodes start on a page of their own
+ */
+static size_t rbtrace_subring_bytes(struct ring_info *ri, uint32_t size)
+{
+	size_t bytes = (size_t)size * ri->ri_entry_size * ri->ri_nr_bufs;
+
+	if (rbt_globals.dir_ptr->sd_flags & RBTRACE_SHM_NUMA) {
+		bytes = RBTRACE_ALIGN(bytes, RBTRACE_PAGE_SIZE);
+	}
+	return bytes;
+}
+
+/* Have the kernel place the buffers of a sub-ring on its node when
+ * they are first touched. The node is preferred rather than bound so
+ * that a full node falls back to another instead of failing the fault.
+ */
+static int rbtrace_subring_bind(struct ring_info *ri,
+				struct subring_info *si,
+				uint32_t layout)
+{
+	unsigned long mask;
+	char *buf;
+	int id;
+
+	id = rbt_numa.node_ids[si->si_node];
+	if (id >= sizeof(mask) * 8) {
+		return EINVAL;
+	}
+	buf = rbtrace_subring_buffer(ri, si, layout, 0);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	mask = 1UL << id;
+	if (syscall(SYS_mbind, buf,
+		    rbtrace_subring_bytes(ri, si->si_geo[layout].sg_size),
+		    MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == -1) {
+		dprintf("ring:%d bind to node %d failed, error:%d\n",
+			ri->ri_ring, id, errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* Give a layout of a ring buffers of size records in segment seg,
+ * sub-rings start at off in it, and point the ring at it. Producers
+ * move over as their sub-rings swap buffers.
+ */
+static int rbtrace_ring_switch(rbtrace_ring_t ring, uint32_t layout,
+			       uint32_t size, uint32_t seg, uint64_t off)
+{
+	struct ring_info *ri;
+	struct subring_info *si;
+	char name[RBTRACE_MAX_NAME];
+	uint32_t old;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		si->si_geo[layout].sg_size = size;
+		si->si_geo[layout].sg_seg = seg;
+		si->si_geo[layout].sg_buf_off = off + (uint64_t)i *
+			rbtrace_subring_bytes(ri, size);
+	}
+
+	/* Map it here first so that a failure leaves the ring as is */
+	if (rbtrace_subring_buffer(ri, &ri->ri_subrings[0],
+				   layout, 0) == NULL) {
+		return ENOMEM;
+	}
+
+	/* Nobody touched the new buffers yet */
+	if (rbt_globals.dir_ptr->sd_flags & RBTRACE_SHM_NUMA) {
+		for (i = 0; i < ri->ri_nr_subrings; i++) {
+			if (rbtrace_subring_bind(ri, &ri->ri_subrings[i],
+						 layout) != 0) {
+				break;
+			}
+		}
+	}
+
+	/* Nobody needs the name of the segment the layout had before */
+	old = rbt_ring_segs[ring][layout];
+	if (old && !(old & RBTRACE_SEG_FILE)) {
+		rbtrace_seg_name(name, sizeof(name), ring, old);
+		shm_unlink(name);
+	}
+	rbt_ring_segs[ring][layout] = seg;
+
+	__sync_synchronize();
+	ri->ri_size = size;
+	ri->ri_layout = layout;
+	rbtrace_layout_switch_idle(ri);
+	return 0;
+}
+
+/* Give the unused layout of a ring buffers of the new size in a new
+ * shm segment
+ */
+static void rbtrace_resize_ring(rbtrace_ring_t ring)
+{
+	struct ring_info *ri;
+	char name[RBTRACE_MAX_NAME];
+	uint32_t layout;
+	uint32_t size;
+	uint32_t seg;
+	size_t seg_size;
+	int fd;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	layout = ri->ri_layout ? 0 : 1;
+	size = ri->ri_resize;
+
+	/* Buffers mapped from the trace file keep their size */
+	if (ri->ri_flags & RBTRACE_DO_MMAP) {
+		dprintf("ring:%d buffers mapped from file, not resized\n",
+			ring);
+		goto out;
+	}
+
+	/* Wait for the last resize to complete */
+	rbtrace_layout_switch_idle(ri);
+	if (rbtrace_layout_busy(ri, layout)) {
+		return;
+	}
+
+	seg = ++rbt_next_seg;
+	seg_size = rbtrace_subring_bytes(ri, size) * ri->ri_nr_subrings;
+	if (rbt_globals.dir_ptr->sd_flags & RBTRACE_SHM_HUGE) {
+		seg_size = RBTRACE_ALIGN(seg_size, RBTRACE_HUGE_PAGE_SIZE);
+	}
+	rbtrace_seg_name(name, sizeof(name), ring, seg);
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0666);
+	if (fd == -1) {
+		dprintf("ring:%d create segment %s failed, error:%d\n",
+			ring, name, errno);
+		goto out;
+	}
+	if (ftruncate(fd, seg_size) == -1) {
+		dprintf("ring:%d size segment %s failed, error:%d\n",
+			ring, name, errno);
+		close(fd);
+		goto unlink;
+	}
+	close(fd);
+
+	if (rbtrace_ring_switch(ring, layout, size, seg, 0) != 0) {
+		goto unlink;
+	}
+	dprintf("ring:%d resized to %u records\n", ring, size);
+	goto out;
+
+ unlink:
+	shm_unlink(name);
+ out:
+	__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_RESIZE);
+}
+
+/* Move a sub-ring to a layout right away rather than when its buffer
+ * fills. Records claimed in the active buffer stay in the trace file
+ * if the buffer is mapped from it and the rest of the buffer is
+ * cleared for prbt to skip, records in a shm buffer are lost.
+ */
+static void rbtrace_subring_move(rbtrace_ring_t ring,
+				 struct subring_info *si, uint32_t layout)
+{
+	struct ring_info *ri = &rbt_globals.ri_ptr[ring];
+	struct subring_geo *geo;
+	uint64_t pos;
+	uint32_t pass;
+	uint32_t nr;
+	char *buf;
+	int lost;
+
+	for (;;) {
+		pos = si->si_pos;
+		pass = RBTRACE_POS_PASS(pos);
+		nr = RBTRACE_POS_COUNT(pos);
+		geo = &si->si_geo[rbtrace_pass_layout(pass)];
+		if (rbtrace_pass_layout(pass) == layout) {
+			return;
+		}
+		/* Leave a full buffer to the producer swapping it */
+		if (nr >= geo->sg_size) {
+			sched_yield();
+			continue;
+		}
+		if (__sync_bool_compare_and_swap(&si->si_pos, pos,
+			RBTRACE_POS(((pass + RBTRACE_PASS_DISCARD) &
+				     ~RBTRACE_PASS_LAYOUT) |
+				    (layout ? RBTRACE_PASS_LAYOUT : 0), 0))) {
+			break;
+		}
+	}
+	rbtrace_subring_wake(si);
+
+	buf = rbtrace_subring_buffer(ri, si, rbtrace_pass_layout(pass),
+				     rbtrace_pass_head(pass));
+	if ((buf == NULL) || (nr == 0)) {
+		return;
+	}
+	lost = rbtrace_wait_commits(ri, buf, nr, rbtrace_pass_gen(pass));
+	if (geo->sg_seg & RBTRACE_SEG_FILE) {
+		if (lost) {
+			rbtrace_mark_commits(ri, buf, nr,
+					     rbtrace_pass_gen(pass));
+		}
+		memset(buf + (size_t)nr * ri->ri_entry_size, 0,
+		       (size_t)(geo->sg_size - nr) * ri->ri_entry_size);
+		__sync_add_and_fetch(&ri->ri_stats.rs_node_records[si->si_node],
+				     nr - lost);
+	} else {
+		lost = nr;
+	}
+	if (lost) {
+		rbtrace_count_lost(ri, si, lost);
+	}
+}
+
+/* Have producers trace straight into the trace file, the unused
+ * layout of the ring gets buffers in the file after its header and
+ * every sub-ring moves to it at once. Records are then copied neither
+ * to the file nor out of shm.
+ */
+static int rbtrace_ring_map(rbtrace_ring_t ring)
+{
+	struct ring_info *ri;
+	struct ring_file_data *rfd;
+	uint32_t layout;
+	uint64_t off;
+	int rc = 0;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	rfd = &rbt_rfd[ring];
+	layout = ri->ri_layout ? 0 : 1;
+	off = rbt_hdrs[ring].hdr.hdr_size;
+
+	/* A resize may still be using the layout */
+	rbtrace_layout_switch_idle(ri);
+	if (rbtrace_layout_busy(ri, layout)) {
+		rc = EBUSY;
+		goto out;
+	}
+
+	/* Blocks are allocated up front so that producers never fault
+	 * on a full file system
+	 */
+	if (fallocate(rfd->fd, 0, 0, off + rbtrace_subring_bytes(ri,
+		      ri->ri_size) * ri->ri_nr_subrings) == -1) {
+		rc = errno;
+		goto out;
+	}
+
+	rc = rbtrace_ring_switch(ring, layout, ri->ri_size,
+				 ++rbt_next_seg | RBTRACE_SEG_FILE, off);
+	if (rc != 0) {
+		goto out;
+	}
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		rbtrace_subring_move(ring, &ri->ri_subrings[i], layout);
+	}
+	__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_MMAP);
+
+ out:
+	return rc;
+}
+
+/* Move the sub-rings of a ring back to the shm buffers they had before
+ * its trace file is closed
+ */
+static void rbtrace_ring_unmap(rbtrace_ring_t ring)
+{
+	struct ring_info *ri;
+	uint32_t layout;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	layout = ri->ri_layout ? 0 : 1;
+	ri->ri_size = ri->ri_subrings[0].si_geo[layout].sg_size;
+	__sync_synchronize();
+	ri->ri_layout = layout;
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		rbtrace_subring_move(ring, &ri->ri_subrings[i], layout);
+	}
+	__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_MMAP);
+}
+
+/* Copy nr records of a buffer for a snapshot and write them out.
+ * Producers may still fill or even discard the active buffer, records
+ * not committed in the generation of the buffer after a bounded wait
+ * are cleared in the copy.
+ */
+static ssize_t rbtrace_snap_buffer(struct ring_info *ri, int fd,
+				   const char *buf, char *copy,
+				   uint32_t nr, uint8_t gen, uint64_t off)
+{
+	rbtrace_wait_commits(ri, buf, nr, gen);
+	rbtrace_copy_commits(ri, buf, copy, nr, gen);
+
+	return safe_pwrite(fd, copy, (size_t)nr * ri->ri_entry_size, off);
+}
+
+/* Have producers of a flight recorder ring keep their full buffers,
+ * and wait for swaps that didn't see it to complete
+ */
+static void rbtrace_freeze_ring(struct ring_info *ri)
+{
+	struct subring_info *si;
+	int i;
+
+	__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_FREEZE);
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		while (RBTRACE_POS_COUNT(si->si_pos) >=
+		       si->si_geo[rbtrace_pass_layout(
+			       RBTRACE_POS_PASS(si->si_pos))].sg_size) {
+			sched_yield();
+		}
+	}
+}
+
+/* Dump the buffers of a flight recorder ring to a trace file, oldest
+ * first so that it doesn't wrap. Producers keep their full buffers
+ * while it is taken, a producer that fills the active buffer in the
+ * meantime drops its records rather than waiting.
+ */
+static void rbtrace_snapshot(rbtrace_ring_t ring)
+{
+	struct ring_info *ri;
+	struct subring_info *si;
+	struct subring_geo *geo;
+	struct timespec ts;
+	struct tm *gm;
+	char *copy = NULL;
+	char *buf;
+	ssize_t ret = 0;
+	uint64_t off;
+	uint64_t pos;
+	uint32_t pass;
+	uint32_t seq;
+	uint32_t layout;
+	uint32_t nr;
+	uint8_t gen;
+	int fd = -1;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	rbtrace_freeze_ring(ri);
+
+	fd = open(ri->ri_file_path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fd == -1) {
+		dprintf("ring:%d open %s failed, error:%d\n",
+			ring, ri->ri_file_path, errno);
+		goto out;
+	}
+	/* Big enough for a buffer of either layout */
+	geo = ri->ri_subrings[0].si_geo;
+	nr = (geo[0].sg_size > geo[1].sg_size) ?
+		geo[0].sg_size : geo[1].sg_size;
+	copy = malloc((size_t)nr * ri->ri_entry_size);
+	if (copy == NULL) {
+		dprintf("ring:%d snapshot buffer alloc failed\n", ring);
+		goto out;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gm = localtime(&ts.tv_sec);
+	assert(gm != NULL);
+	rbt_rfd[ring].iomode = RBTRACE_IO_BUFFERED;
+	rbt_rfd[ring].codec = RBTRACE_CODEC_NONE;
+	rbtrace_format_header(ring, ts, gm);
+	ret = safe_pwrite(fd, &rbt_hdrs[ring], sizeof(rbt_hdrs[ring]), 0);
+	off = rbt_hdrs[ring].hdr.hdr_size;
+
+	for (i = 0; !ret && (i < ri->ri_nr_subrings); i++) {
+		si = &ri->ri_subrings[i];
+		pos = si->si_pos;
+		pass = RBTRACE_POS_PASS(pos);
+
+		/* Full buffers, then what the active one holds now */
+		for (seq = si->si_tail;
+		     !ret && (seq != rbtrace_pass_head(pass));
+		     seq = (seq + 1) & RBTRACE_PASS_HEAD_MASK) {
+			gen = si->si_buf_gen[seq % ri->ri_nr_bufs];
+			layout = (gen & RBTRACE_BUF_LAYOUT) ? 1 : 0;
+			geo = &si->si_geo[layout];
+			buf = rbtrace_subring_buffer(ri, si, layout, seq);
+			if (buf == NULL) {
+				continue;
+			}
+			ret = rbtrace_snap_buffer(ri, fd, buf, copy,
+					geo->sg_size,
+					gen & RBTRACE_COMMIT_GEN_MASK, off);
+			off += (uint64_t)geo->sg_size * ri->ri_entry_size;
+		}
+
+		geo = &si->si_geo[rbtrace_pass_layout(pass)];
+		nr = RBTRACE_POS_COUNT(pos);
+		if (nr > geo->sg_size) {
+			nr = geo->sg_size;
+		}
+		buf = rbtrace_subring_buffer(ri, si, rbtrace_pass_layout(pass),
+					     rbtrace_pass_head(pass));
+		if (!ret && nr && buf) {
+			ret = rbtrace_snap_buffer(ri, fd, buf, copy, nr,
+						  rbtrace_pass_gen(pass), off);
+			off += (uint64_t)nr * ri->ri_entry_size;
+		}
+	}
+	if (ret) {
+		dprintf("ring:%d write snapshot failed, error:%zd\n",
+			ring, ret);
+	} else {
+		dprintf("ring:%d snapshot %s taken, %lu bytes\n", ring,
+			ri->ri_file_path, off);
+	}
+
+ out:
+	free(copy);
+	if (fd != -1) {
+		close(fd);
+	}
+	__sync_fetch_and_and(&ri->ri_flags,
+			     ~(RBTRACE_DO_FREEZE|RBTRACE_DO_SNAP));
+}
+
+/* Turn a triggered flight recorder ring into a writing one. The last
+ * pre full buffers of every sub-ring are kept and written to a new
+ * file, followed by the buffers filled from now on until post of them
+ * are written.
+ */
+static void rbtrace_capture_start(rbtrace_ring_t ring)
+{
+	struct ring_info *ri;
+	struct ring_file_data *rfd;
+	struct subring_info *si;
+	struct subring_flush *sf;
+	uint32_t head;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	rfd = &rbt_rfd[ring];
+	rbtrace_freeze_ring(ri);
+
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		sf = &rbt_sflush[ring][i];
+		head = rbtrace_pass_head(RBTRACE_POS_PASS(si->si_pos));
+		while (((head - si->si_tail) & RBTRACE_PASS_HEAD_MASK) >
+		       ri->ri_trig_pre) {
+			__sync_add_and_fetch(&si->si_tail, 1);
+		}
+		sf->sf_issued = si->si_tail;
+		sf->sf_done = 0;
+		sf->sf_trig = head;
+	}
+	rfd->cap_post = ri->ri_trig_post;
+
+	strcpy(ri->ri_file_path, ri->ri_trig_path);
+	rbtrace_write_header(ring);
+	if (rfd->fd == -1) {
+		__sync_fetch_and_and(&ri->ri_flags, ~(RBTRACE_DO_FREEZE|
+						      RBTRACE_DO_TRIGGER));
+		return;
+	}
+	/* Buffers stay in shm, the capture is written as usual */
+	if (rfd->iomode == RBTRACE_IO_MMAP) {
+		rfd->iomode = RBTRACE_IO_BUFFERED;
+		ftruncate(rfd->fd, rfd->seek);
+	}
+
+	/* Swaps queue full buffers for us from now on */
+	__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_FLIGHT);
+	__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_FREEZE);
+	dprintf("ring:%d capture triggered\n", ring);
+
+	if (rfd->cap_post == 0) {
+		rbtrace_ctrl(ring, RBTRACE_OP_CLOSE, NULL);
+	}
+	rbtrace_drain_ring(ring, RBTRACE_NODE_ALL);
+}
+
+/* The file of a capture is closed, go back to flight recording and
+ * wait for the next trigger
+ */
+static void rbtrace_capture_end(rbtrace_ring_t ring)
+{
+	struct ring_info *ri = &rbt_globals.ri_ptr[ring];
+
+	__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_FLIGHT);
+	__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_TRIGGER);
+	dprintf("ring:%d capture done\n", ring);
+}
+
+static void rbtrace_service_ring(rbtrace_ring_t ring)
+{
+	struct ring_info *ri = NULL;
+	struct ring_file_data *rfd = NULL;
+	struct subring_flush *sf = NULL;
+	int rc;
+	int i;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	rfd = &rbt_rfd[ring];
+
+	pthread_mutex_lock(&rfd->lock);
+
+	if (ri->ri_flags & RBTRACE_DO_RESIZE) {
+		rbtrace_resize_ring(ring);
+	}
+
+	if (ri->ri_flags & RBTRACE_DO_SNAP) {
+		rbtrace_snapshot(ring);
+	}
+
+	if ((ri->ri_flags & (RBTRACE_DO_TRIGGER|RBTRACE_DO_FLIGHT)) ==
+	    (RBTRACE_DO_TRIGGER|RBTRACE_DO_FLIGHT)) {
+		rbtrace_capture_start(ring);
+	}
+
+	/* We are about to closing the trace file? */
+	if (ri->ri_flags & RBTRACE_DO_CLOSE) {
+		/* Producers must not write to a closed file */
+		if (ri->ri_flags & RBTRACE_DO_MMAP) {
+			rbtrace_ring_unmap(ring);
+		}
+
+		/* Flush inactive buffers of every node, and all trace
+		 * records if we were asked to
+		 */
+		rbtrace_drain_ring(ring, RBTRACE_NODE_ALL);
+
+		/* Our writes land before the file is closed, those of
+		 * other nodes hold their own reference to it
+		 */
+		rbtrace_uring_quiesce();
+		rbtrace_write_hdr(ring);
+		rbtrace_uring_quiesce();
+
+		/* Close file descriptor */
+		if (rfd->fd != -1) {
+			//fsync(rbt_fds[ring]);
+			rbtrace_close_file(rfd);
+			dprintf("ring:%d file %s closed!\n",
+				ring, ri->ri_file_path);
+			memset(ri->ri_file_path, 0,
+			       sizeof(ri->ri_file_path));
+		}
+
+		ri->ri_flags &= ~RBTRACE_DO_CLOSE;
+		rfd->seek = 0;
+		if (ri->ri_flags & RBTRACE_DO_TRIGGER) {
+			rbtrace_capture_end(ring);
+		}
+	}
+	/* Open a new file? */
+	else if (ri->ri_flags & RBTRACE_DO_OPEN) {
+		/* Queued buffers were dropped on open, start writing
+		 * from where the sub-rings are now
+		 */
+		for (i = 0; i < ri->ri_nr_subrings; i++) {
+			sf = &rbt_sflush[ring][i];
+			sf->sf_issued = ri->ri_subrings[i].si_tail;
+			sf->sf_done = 0;
+		}
+		rbtrace_write_header(ring);
+		if ((rfd->fd != -1) && (rfd->iomode == RBTRACE_IO_MMAP)) {
+			rc = rbtrace_ring_map(ring);
+			if (rc != 0) {
+				dprintf("ring:%d map file failed, error:%d, "
+					"writing buffered\n", ring, rc);
+				rfd->iomode = RBTRACE_IO_BUFFERED;
+				ftruncate(rfd->fd, rfd->seek);
+			}
 		}
 	}
+	/* Normal write or flush */
+	else if (ri->ri_flags & RBTRACE_DO_DISK) {
+		rbtrace_drain_ring(ring, 0);
+	}
+	/* The file of a capture filled up */
+	else if ((ri->ri_flags & (RBTRACE_DO_TRIGGER|RBTRACE_DO_FLIGHT)) ==
+		 RBTRACE_DO_TRIGGER) {
+		rbtrace_capture_end(ring);
+	}
 
-	if (update_hdr) {
-		ret = safe_pwrite(rfd->fd, prf, sizeof(*prf), 0);
-		if (ret) {
-			dprintf("ring:%d update hdr failed, error:%zd\n",
-				ring, ret);
-		}
+	pthread_mutex_unlock(&rfd->lock);
+}
+
+/* Flushers of other nodes only write out the full buffers of their
+ * own sub-rings, trace files are opened and closed on node 0
+ */
+static void rbtrace_service_node(rbtrace_ring_t ring, uint32_t node)
+{
+	struct ring_info *ri = NULL;
+	struct ring_file_data *rfd = NULL;
+
+	ri = &rbt_globals.ri_ptr[ring];
+	rfd = &rbt_rfd[ring];
+
+	pthread_mutex_lock(&rfd->lock);
+	if ((ri->ri_flags & (RBTRACE_DO_DISK|RBTRACE_DO_OPEN|
+			     RBTRACE_DO_CLOSE)) == RBTRACE_DO_DISK) {
+		rbtrace_drain_ring(ring, node);
 	}
+	pthread_mutex_unlock(&rfd->lock);
+}
 
- end:
-	lost = __sync_lock_test_and_set(&ri->ri_lost, 0);
-	flush = __sync_lock_test_and_set(&ri->ri_flush, 0);
+/* Sleep until a producer rings the doorbell of the node, returns the
+ * rings to service, all of them if we timed out. A flusher with writes
+ * in flight only naps so that it frees their buffers soon.
+ */
+static uint64_t rbtrace_wait_doorbell(struct rbtrace_thread_data *thread)
+{
+	struct rbtrace_doorbell *db = &rbt_globals.db_ptr[thread->node];
+	bool nap = (thread->uring.inflight != 0);
+	struct timespec timeout;
+	uint64_t pending;
+	uint32_t seq;
+	long rc;
+
+	pending = __sync_lock_test_and_set(&db->db_pending, 0);
+	if (pending) {
+		return pending;
+	}
 
-	if ((flush > 1) || lost) {
-		if (flush > 1) {
-			lost += ((flush - 1) * cfg->rc_size);
+	/* Producers check db_waiting after setting a pending bit, so
+	 * either they see us waiting or we see their bit
+	 */
+	seq = db->db_futex;
+	__sync_lock_test_and_set(&db->db_waiting, 1);
+	if (db->db_pending == 0) {
+		if (nap) {
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = RBTRACE_REAP_WAIT_USECS * 1000;
+		} else {
+			timeout.tv_sec = RBTRACE_THREAD_WAIT_SECS;
+			timeout.tv_nsec = 0;
+		}
+		rc = rbtrace_futex(&db->db_futex, FUTEX_WAIT, seq, &timeout);
+		if ((rc == -1) && (errno == ETIMEDOUT)) {
+			__sync_lock_release(&db->db_waiting);
+			return nap ? 0 : ~0ULL;
 		}
-		dprintf("ring:%d trace buffer:%lx lost %d records\n",
-			ring, ++total_buffers, lost);
-		rbtrace(RBTRACE_RING_IO, RBT_LOST, lost, 0, 0, 0);
-	} else {
-		++total_buffers;
 	}
+	__sync_lock_release(&db->db_waiting);
+
+	return __sync_lock_test_and_set(&db->db_pending, 0);
 }
 
 static void *rbtrace_thread_fn(void *arg)
 {
-	int rc = 0;
 	rbtrace_ring_t ring;
-	struct timespec wait_ts;
-	struct ring_info *ri = NULL;
-	struct ring_file_data *rfd = NULL;
+	uint64_t pending;
 	struct rbtrace_thread_data *thread = NULL;
+	int rc;
 
 	thread = (struct rbtrace_thread_data *)arg;
+	rbt_self = thread;
+	rc = rbtrace_uring_init(&thread->uring);
+	if (rc != 0) {
+		dprintf("flusher %u io_uring unavailable, error:%d, "
+			"writing synchronously\n", thread->node, rc);
+	}
 	thread->active = true;
 	sem_post(&thread->sem);
 
 	while (!thread->terminate) {
-		clock_gettime(CLOCK_REALTIME, &wait_ts);
-		wait_ts.tv_sec += RBTRACE_THREAD_WAIT_SECS;
-		rc = sem_timedwait(rbt_globals.sem_ptr, &wait_ts);
-		if ((rc == -1) && (errno != ETIMEDOUT)) {
-			break;
-		}
-
-		ring = *(rbt_globals.ring_ptr);
-		if (ring >= RBTRACE_RING_MAX) {
-			dprintf("ring:%d invalid ring number!\n", ring);
-			continue;
-		}
-
-		ri = &rbt_globals.ri_ptr[ring];
-		rfd = &rbt_rfd[ring];
-
-		/* We are about to closing the trace file? */
-		if (ri->ri_flags & RBTRACE_DO_CLOSE) {
-			/* Flush inactive buffer */
-			if (ri->ri_flush) {
-				rbtrace_write_data(ring, false);
-			}
-
-			/* We were asked to flush all trace records */
-			if (ri->ri_flags & RBTRACE_DO_FLUSH) {
-				rbtrace_write_data(ring, true);
-				ri->ri_flags &= ~RBTRACE_DO_FLUSH;
-			}
+		pending = rbtrace_wait_doorbell(thread);
+		rbtrace_uring_reap(&thread->uring, 0);
 
-			/* Close file descriptor */
-			if (rfd->fd != -1) {
-				//fsync(rbt_fds[ring]);
-				close(rfd->fd);
-				rfd->fd = -1;
-				dprintf("ring:%d file %s closed!\n",
-					ring, ri->ri_file_path);
-				memset(ri->ri_file_path, 0,
-				       sizeof(ri->ri_file_path));
-			}
-
-			ri->ri_flags &= ~RBTRACE_DO_CLOSE;
-			rfd->seek = 0;
-		}
-		/* Open a new file? */
-		else if (ri->ri_flags & RBTRACE_DO_OPEN) {
-			rbtrace_write_header(ring);
-		}
-		/* Normal write or flush */
-		else if (ri->ri_flags & RBTRACE_DO_DISK) {
-			if (ri->ri_flush) {
-				rbtrace_write_data(ring, false);
+		/* Service every ring that rang, one wake up is enough */
+		for (ring = RBTRACE_RING_IO; ring < rbt_nr_rings; ring++) {
+			if (!(pending & (1ULL << ring))) {
+				continue;
 			}
-			if (ri->ri_flags & RBTRACE_DO_FLUSH) {
-				rbtrace_write_data(ring, true);
-				ri->ri_flags &= ~RBTRACE_DO_FLUSH;
+			if (thread->node == 0) {
+				rbtrace_service_ring(ring);
+			} else {
+				rbtrace_service_node(ring, thread->node);
 			}
 		}
 	}
 
+	/* Buffers must not go away under writes in flight */
+	rbtrace_uring_quiesce();
+	rbtrace_uring_exit(&thread->uring);
+
 	return NULL;
 }
 
 static size_t rbtrace_init_trace_info(struct ring_config *cfg,
 				      struct ring_info *ri,
+				      struct rbtrace_daemon_opts *dopts,
 				      size_t offset)
 {
+	struct subring_info *si;
+	size_t bytes;
+	int i;
+
 	ri->ri_ring = cfg->rc_ring;
+	snprintf(ri->ri_name, sizeof(ri->ri_name), "%s", cfg->rc_name);
+	snprintf(ri->ri_desc, sizeof(ri->ri_desc), "%s", cfg->rc_desc);
 	ri->ri_flags = cfg->rc_flags;
 	ri->ri_tflags = 0;
-	ri->ri_cir_off = offset;
-	ri->ri_alt_off = ri->ri_cir_off + cfg->rc_size;
+	ri->ri_format = cfg->rc_format;
+	ri->ri_entry_size = rbtrace_entry_size(cfg->rc_format);
+	ri->ri_args_off = rbtrace_args_off(cfg->rc_format);
+	ri->ri_commit_off = rbtrace_commit_off(cfg->rc_format);
+	ri->ri_policy = cfg->rc_policy;
+	ri->ri_layout = 0;
+	ri->ri_nr_bufs = rbtrace_ring_nr_bufs(cfg, dopts->nr_bufs);
+	ri->ri_size = dopts->percpu ? cfg->rc_cpu_size : cfg->rc_size;
+	ri->ri_nr_subrings = rbtrace_ring_nr_subrings(dopts);
+	ri->ri_stats.rs_start_ns = rbtrace_monotonic_ns();
+
+	/* Producers pick the sub-ring of their node */
+	if (dopts->numa && !dopts->percpu) {
+		ri->ri_flags |= RBTRACE_DO_NUMA;
+	}
+
+	// every sub-ring has a queue of ri_nr_bufs buffers
+	bytes = rbtrace_subring_bytes(ri, ri->ri_size);
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		si = &ri->ri_subrings[i];
+		si->si_geo[0].sg_size = ri->ri_size;
+		si->si_geo[0].sg_seg = 0;
+		si->si_geo[0].sg_buf_off = offset;
+		offset += bytes;
+
+		if (!dopts->numa) {
+			si->si_node = 0;
+		} else if (dopts->percpu) {
+			si->si_node = rbt_numa.cpu_node[i];
+		} else {
+			si->si_node = i;
+		}
+	}
+
+	return bytes * ri->ri_nr_subrings;
+}
+
+/* Start the flusher of a NUMA node, pinned to the CPUs of the node if
+ * sub-rings are placed on nodes
+ */
+static int rbtrace_start_flusher(uint32_t node, bool pin)
+{
+	struct rbtrace_thread_data *thread = &rbt_threads[node];
+	char name[16];
+	cpu_set_t cpus;
+	int nr_cpus;
+	int cpu;
+	int rc;
+
+	thread->node = node;
+	thread->terminate = false;
+	sem_init(&thread->sem, 0, 0);
+	rc = pthread_create(&thread->thread, NULL,
+			    rbtrace_thread_fn, thread);
+	if (rc != 0) {
+		sem_destroy(&thread->sem);
+		return rc;
+	}
 
-	return cfg->rc_size * 2;// all rings are double buffered
+	if (node == 0) {
+		snprintf(name, sizeof(name), "%s", RBTRACE_THREAD_NAME);
+	} else {
+		snprintf(name, sizeof(name), "%s%u",
+			 RBTRACE_THREAD_NAME, node % RBTRACE_MAX_NODES);
+	}
+	rc = pthread_setname_np(thread->thread, name);
+	if (rc != 0) {
+		/* Non-fatal error, go on working */
+		dprintf("set rbt thread name failed\n");
+	}
+
+	if (pin) {
+		nr_cpus = get_nprocs_conf();
+		if (nr_cpus > RBTRACE_MAX_CPUS) {
+			nr_cpus = RBTRACE_MAX_CPUS;
+		}
+		CPU_ZERO(&cpus);
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (rbt_numa.cpu_node[cpu] == node) {
+				CPU_SET(cpu, &cpus);
+			}
+		}
+		rc = pthread_setaffinity_np(thread->thread,
+					    sizeof(cpus), &cpus);
+		if (rc != 0) {
+			/* Non-fatal error, the flusher reads remotely */
+			dprintf("pin flusher to node %d failed, error:%d\n",
+				rbt_numa.node_ids[node], rc);
+		}
+	}
+
+	sem_wait(&thread->sem);
+	sem_destroy(&thread->sem);
+
+	return 0;
+}
+
+static void rbtrace_stop_flushers(void)
+{
+	struct rbtrace_thread_data *thread;
+	int i;
+
+	for (i = 0; i < rbt_nr_threads; i++) {
+		thread = &rbt_threads[i];
+		thread->terminate = true;
+		rbtrace_signal_thread(&rbt_globals.ri_ptr[RBTRACE_RING_IO], i);
+		if (thread->active) {
+			pthread_join(thread->thread, NULL);
+			thread->active = false;
+		}
+	}
+	rbt_nr_threads = 0;
+}
+
+/* Shared memory gets transparent huge pages if the kernel allows
+ * them for shmem that asks with madvise
+ */
+static bool rbtrace_huge_available(void)
+{
+	FILE *fp;
+	char buf[128];
+	bool avail = false;
+
+	fp = fopen(RBTRACE_THP_SHMEM, "r");
+	if (fp == NULL) {
+		return false;
+	}
+	if (fgets(buf, sizeof(buf), fp) != NULL) {
+		avail = (strstr(buf, "[never]") == NULL) &&
+			(strstr(buf, "[deny]") == NULL);
+	}
+	fclose(fp);
+
+	return avail;
+}
+
+/* KB of the mapping at base this process maps with huge pages */
+static uint64_t rbtrace_huge_mapped(char *base)
+{
+	FILE *fp;
+	char line[256];
+	unsigned long start, end;
+	uint64_t kb = 0;
+	bool found = false;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			found = (start == (unsigned long)base);
+		} else if (found &&
+			   (sscanf(line, "ShmemPmdMapped: %lu kB",
+				   &kb) == 1)) {
+			break;
+		}
+	}
+	fclose(fp);
+
+	return kb;
+}
+
+/* Start from the default rings, a configured ring overrides the
+ * default ring of the same name or is added after them
+ */
+static int rbtrace_config_rings(struct rbtrace_daemon_opts *dopts)
+{
+	struct ring_config *cfg;
+	int i, j;
+
+	memcpy(rbt_ring_cfgs, ring_cfgs, nr_ring_cfgs * sizeof(ring_cfgs[0]));
+	rbt_nr_rings = nr_ring_cfgs;
+
+	for (i = 0; i < dopts->nr_rings; i++) {
+		cfg = &dopts->rings[i];
+		for (j = 0; j < rbt_nr_rings; j++) {
+			if (strcmp(rbt_ring_cfgs[j].rc_name,
+				   cfg->rc_name) == 0) {
+				break;
+			}
+		}
+		if (j >= RBTRACE_RING_MAX) {
+			dprintf("too many rings, at most %d\n",
+				RBTRACE_RING_MAX);
+			return EINVAL;
+		}
+		rbt_ring_cfgs[j] = *cfg;
+		rbt_ring_cfgs[j].rc_ring = j;
+		if (j == rbt_nr_rings) {
+			rbt_nr_rings++;
+		}
+	}
+
+	return 0;
 }
 
-int rbtrace_daemon_init(void)
+int rbtrace_daemon_init(struct rbtrace_daemon_opts *dopts)
 {
 	int rc = 0;
 	int shm_fd = -1;
 	size_t shm_size = 0;
 	size_t off = 0;
 	char *shm_base = NULL;
-	sem_t *sem_ptr = SEM_FAILED;
-	int i;
+	struct rbtrace_shm_dir *dir;
+	struct ring_info *ri;
+	bool huge;
+	int i, j;
+
+	rc = rbtrace_config_rings(dopts);
+	if (rc != 0) {
+		goto out;
+	}
+
+	rbtrace_numa_init();
+	if (dopts->numa) {
+		dprintf("%d NUMA nodes, a flusher for each\n",
+			rbt_numa.nr_nodes);
+	}
 
 	/* Cleanup garbage of previous run */
 	shm_unlink(RBTRACE_SHM_NAME);
-	sem_unlink(RBTRACE_SEM_NAME);
 
-	shm_size = rbtrace_calc_shm_size();
+	shm_size = rbtrace_calc_shm_size(rbt_ring_cfgs, rbt_nr_rings, dopts);
+
+	huge = dopts->huge;
+	if (huge && !rbtrace_huge_available()) {
+		dprintf("huge pages unavailable, using %d KB pages\n",
+			RBTRACE_PAGE_SIZE / 1024);
+		huge = false;
+	}
+	if (huge) {
+		/* A partial huge page at the end would be small pages */
+		shm_size = RBTRACE_ALIGN(shm_size, RBTRACE_HUGE_PAGE_SIZE);
+	}
 
 	/* Create shared memory for ring buffer */
 	shm_fd = shm_open(RBTRACE_SHM_NAME,
@@ -375,67 +2527,94 @@ int rbtrace_daemon_init(void)
 		rc = errno;
 		goto ftruncate_fail;
 	}
-	shm_base = mmap(NULL, shm_size, PROT_READ|PROT_WRITE,
-			MAP_SHARED, shm_fd, 0);
+	shm_base = rbtrace_shm_map(shm_fd, shm_size, huge);
 	if (shm_base == MAP_FAILED) {
 		rc = errno;
 		goto mmap_fail;
 	}
-	rc = mlock(shm_base, shm_size);
-	if (rc == -1) {
-		/* Failed to lock memory, but it's non-fatal error */
-		dprintf("mlock failed, error:%d\n", errno);
-	}
-	memset(shm_base, 0, shm_size);
-
-	/* Create semaphore for IPC */
-	sem_ptr = sem_open(RBTRACE_SEM_NAME,
-			   O_RDWR|O_CREAT|O_EXCL,
-			   0666, 0);
-	if (sem_ptr == SEM_FAILED) {
-		rc = errno;
-		goto sem_open_fail;
-	}
 
 	/* Dump shared memory region if cored */
 	update_coredump_filter();
 
+	/* Describe the layout, the magic is set once rings are ready */
+	dir = (struct rbtrace_shm_dir *)(shm_base + RBTRACE_SHM_DIR_OFF);
+	dir->sd_major = RBTRACE_MAJOR;
+	dir->sd_minor = RBTRACE_MINOR;
+	dir->sd_nr_rings = rbt_nr_rings;
+	dir->sd_ri_size = sizeof(struct ring_info);
+	dir->sd_ri_off = RBTRACE_SHM_RI_OFF;
+	dir->sd_re_off = rbtrace_shm_re_off(rbt_nr_rings);
+	dir->sd_db_off = rbtrace_shm_db_off(rbt_nr_rings);
+	dir->sd_nr_nodes = dopts->numa ? rbt_numa.nr_nodes : 1;
+	dir->sd_flags = (huge ? RBTRACE_SHM_HUGE : 0) |
+		(dopts->numa ? RBTRACE_SHM_NUMA : 0);
+
 	/* Initialize global pointers */
-	rbtrace_globals_init(shm_fd, shm_base, shm_size, sem_ptr);
+	rbtrace_globals_init(shm_fd, shm_base, shm_size);
 	(*rbt_globals.fsize_ptr) = RBTRACE_DFT_FILE_SIZE;
 
+	if (dopts->tsc) {
+		rbt_tsc_hz = rbtrace_tsc_calibrate();
+		dprintf("TSC frequency %lu Hz\n", rbt_tsc_hz);
+	}
+
 	/* Initialize each trace info */
-	for (i = RBTRACE_RING_IO, off = 0; i < RBTRACE_RING_MAX; i++) {
-		off += rbtrace_init_trace_info(&ring_cfgs[i],
+	for (i = RBTRACE_RING_IO, off = 0; i < rbt_nr_rings; i++) {
+		off += rbtrace_init_trace_info(&rbt_ring_cfgs[i],
 					       &rbt_globals.ri_ptr[i],
-					       off);
+					       dopts, off);
+		if (rbt_tsc_hz) {
+			rbt_globals.ri_ptr[i].ri_flags |= RBTRACE_DO_TSC;
+		}
+		if (dopts->flight) {
+			rbt_globals.ri_ptr[i].ri_flags |= RBTRACE_DO_FLIGHT;
+		}
+		pthread_mutex_init(&rbt_rfd[i].lock, NULL);
 		rbt_rfd[i].fd = -1;
+		rbt_rfd[i].bfd = -1;
 		rbt_rfd[i].seek = 0;
 	}
 
-	sem_init(&rbt_thread.sem, 0, 0);
-	rc = pthread_create(&rbt_thread.thread, NULL,
-			    rbtrace_thread_fn, &rbt_thread);
-	if (rc != 0) {
-		goto pthread_fail;
+	/* Place trace records on their nodes before they are touched */
+	for (i = RBTRACE_RING_IO; dopts->numa && (i < rbt_nr_rings); i++) {
+		ri = &rbt_globals.ri_ptr[i];
+		for (j = 0; j < ri->ri_nr_subrings; j++) {
+			if (rbtrace_subring_bind(ri, &ri->ri_subrings[j],
+						 0) != 0) {
+				break;
+			}
+		}
 	}
-	rc = pthread_setname_np(rbt_thread.thread,
-				RBTRACE_THREAD_NAME);
-	if (rc != 0) {
-		/* Non-fatal error, go on working */
-		dprintf("set rbt thread name failed\n");
+
+	rc = mlock(shm_base, shm_size);
+	if (rc == -1) {
+		/* Failed to lock memory, but it's non-fatal error */
+		dprintf("mlock failed, error:%d\n", errno);
+	}
+	memset(rbt_globals.re_base, 0, shm_size - dir->sd_re_off);
+
+	if (huge) {
+		dprintf("%lu KB of %zu KB shm on huge pages\n",
+			rbtrace_huge_mapped(shm_base), shm_size / 1024);
 	}
 
-	sem_wait(&rbt_thread.sem);
-	sem_destroy(&rbt_thread.sem);
+	__sync_synchronize();
+	memcpy(dir->sd_magic, RBTRACE_SHM_MAGIC, sizeof(RBTRACE_SHM_MAGIC));
+
+	for (i = 0; i < rbt_globals.nr_nodes; i++) {
+		rc = rbtrace_start_flusher(i, dopts->numa);
+		if (rc != 0) {
+			goto pthread_fail;
+		}
+		rbt_nr_threads++;
+	}
 
 	return 0;
 
  pthread_fail:
+	rbtrace_stop_flushers();
 	rbtrace_globals_cleanup(true);
 	goto out;
- sem_open_fail:
-	munmap(shm_base, shm_size);
  mmap_fail:
  ftruncate_fail:
 	close(shm_fd);
@@ -446,26 +2625,25 @@ int rbtrace_daemon_init(void)
 
 void rbtrace_daemon_exit(void)
 {
-	int i;
-	struct ring_file_data *rfd;
-
-	/* Terminate rbtrace thread */
-	rbt_thread.terminate = true;
-
-	if (rbt_globals.sem_ptr != SEM_FAILED) {
-		sem_post(rbt_globals.sem_ptr);
-	}
-
-	if (rbt_thread.active) {
-		pthread_join(rbt_thread.thread, NULL);
-	}
-
-	/* Close all file descriptors */
-	for (i = 0; i < RBTRACE_RING_MAX; i++) {
-		rfd = &rbt_rfd[i];
-		if (rfd->fd != -1) {
-			close(rfd->fd);
-			rfd->fd = -1;
+	int i, j;
+	char name[RBTRACE_MAX_NAME];
+
+	/* Terminate flusher threads */
+	rbtrace_stop_flushers();
+
+	/* Close all file descriptors and remove segments of resized
+	 * rings
+	 */
+	for (i = 0; i < rbt_nr_rings; i++) {
+		rbtrace_close_file(&rbt_rfd[i]);
+		for (j = 0; j < 2; j++) {
+			if (rbt_ring_segs[i][j] &&
+			    !(rbt_ring_segs[i][j] & RBTRACE_SEG_FILE)) {
+				rbtrace_seg_name(name, sizeof(name), i,
+						 rbt_ring_segs[i][j]);
+				shm_unlink(name);
+				rbt_ring_segs[i][j] = 0;
+			}
 		}
 	}
 
@@ -476,10 +2654,13 @@ void rbtrace_daemon_exit(void)
 static int rbtrace_ctrl_open(struct ring_info *ri, void *argp)
 {
 	int rc = 0;
+	int i;
+	uint32_t pass;
+	struct subring_info *si;
 	char *path = NULL;
 
-	if ((ri->ri_flags & (RBTRACE_DO_OPEN|RBTRACE_DO_DISK)) ||
-	    (argp == NULL)) {
+	if ((ri->ri_flags & (RBTRACE_DO_OPEN|RBTRACE_DO_DISK|
+			     RBTRACE_DO_FLIGHT)) || (argp == NULL)) {
 		rc = -1;
 		goto out;
 	}
@@ -492,13 +2673,21 @@ static int rbtrace_ctrl_open(struct ring_info *ri, void *argp)
 
 	strcpy(ri->ri_file_path, path);
 
-	ri->ri_slot = -1;
-	ri->ri_flush = 0;
-	ri->ri_lost = 0;
+	for (i = 0; i < ri->ri_nr_subrings; i++) {
+		/* Drop queued buffers and start a new pass */
+		si = &ri->ri_subrings[i];
+		pass = RBTRACE_POS_PASS(si->si_pos);
+		si->si_tail = rbtrace_pass_head(pass);
+		si->si_lost = 0;
+		si->si_discard = 0;
+		pass = ((pass + RBTRACE_PASS_DISCARD) & ~RBTRACE_PASS_LAYOUT) |
+			(ri->ri_layout ? RBTRACE_PASS_LAYOUT : 0);
+		__sync_lock_test_and_set(&si->si_pos, RBTRACE_POS(pass, 0));
+	}
 
 	ri->ri_flags |= RBTRACE_DO_OPEN;
 
-	rbtrace_signal_thread(ri);
+	rbtrace_signal_thread(ri, 0);
 
  out:
 	return rc;
@@ -513,7 +2702,7 @@ static int rbtrace_ctrl_close(struct ring_info *ri, void *argp)
 		ri->ri_flags &= ~RBTRACE_DO_DISK;
 		ri->ri_flags |= (RBTRACE_DO_FLUSH|RBTRACE_DO_CLOSE);
 
-		rbtrace_signal_thread(ri);
+		rbtrace_signal_thread(ri, 0);
 		rc = 0;
 	}
 
@@ -595,16 +2784,201 @@ static int rbtrace_ctrl_info(struct ring_info *ri, void *argp)
 		info_arg->flags = ri->ri_flags;
 		info_arg->tflags = ri->ri_tflags;
 		info_arg->file_size = *(rbt_globals.fsize_ptr);
-		info_arg->trace_entry_size = sizeof(struct rbtrace_entry);
+		info_arg->trace_entry_size = ri->ri_entry_size;
+		info_arg->trace_entry_format = ri->ri_format;
+		info_arg->nr_records = ri->ri_size;
+		info_arg->nr_subrings = ri->ri_nr_subrings;
+		info_arg->nr_bufs = ri->ri_nr_bufs;
+		info_arg->nr_nodes = rbt_globals.nr_nodes;
+		info_arg->policy = ri->ri_policy;
+		info_arg->iomode = ri->ri_iomode;
+		info_arg->codec = ri->ri_codec;
+		strcpy(info_arg->trigger.path, ri->ri_trig_path);
+		info_arg->trigger.pre = ri->ri_trig_pre;
+		info_arg->trigger.post = ri->ri_trig_post;
+		info_arg->trigger.traceid = ri->ri_trig_id;
+		info_arg->trigger.a0 = ri->ri_trig_a0;
+		memcpy(&info_arg->stats, (void *)&ri->ri_stats,
+		       sizeof(info_arg->stats));
 		strcpy(info_arg->file_path, ri->ri_file_path);
 
-		strncpy(info_arg->ring_name, ring_cfgs[ri->ri_ring].rc_name,
-			sizeof(info_arg->ring_name) - 1);
-		strncpy(info_arg->ring_desc, ring_cfgs[ri->ri_ring].rc_desc,
-			sizeof(info_arg->ring_desc) - 1);
+		snprintf(info_arg->ring_name, sizeof(info_arg->ring_name),
+			 "%s", ri->ri_name);
+		snprintf(info_arg->ring_desc, sizeof(info_arg->ring_desc),
+			 "%s", ri->ri_desc);
+		rc = 0;
+	}
+
+	return rc;
+}
+
+static int rbtrace_ctrl_policy(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	rbtrace_policy_t policy;
+
+	if (argp != NULL) {
+		policy = *((rbtrace_policy_t *)argp);
+		if (policy < RBTRACE_POLICY_MAX) {
+			/* Overflows from now on count under this policy */
+			ri->ri_policy = policy;
+			rc = 0;
+		}
+	}
+
+	return rc;
+}
+
+static int rbtrace_ctrl_resize(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	uint32_t size;
+
+	if ((argp == NULL) || (ri->ri_flags & RBTRACE_DO_RESIZE)) {
+		goto out;
+	}
+
+	size = *((uint32_t *)argp);
+	if ((size < RBTRACE_MIN_RECORDS) || (size > RBTRACE_MAX_RECORDS)) {
+		goto out;
+	}
+
+	/* The flusher does the resize, it may have to wait for the
+	 * last one to complete
+	 */
+	ri->ri_resize = size;
+	__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_RESIZE);
+	rbtrace_signal_thread(ri, 0);
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/* Takes effect when the next trace file is opened */
+static int rbtrace_ctrl_iomode(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	rbtrace_iomode_t iomode;
+
+	if (argp != NULL) {
+		iomode = *((rbtrace_iomode_t *)argp);
+		if (iomode < RBTRACE_IO_MAX) {
+			ri->ri_iomode = iomode;
+			rc = 0;
+		}
+	}
+
+	return rc;
+}
+
+/* Files opened after this are coded with the codec, mmap files are
+ * never coded
+ */
+static int rbtrace_ctrl_codec(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	rbtrace_codec_t codec;
+
+	if (argp != NULL) {
+		codec = *((rbtrace_codec_t *)argp);
+		if (codec < RBTRACE_CODEC_MAX) {
+			ri->ri_codec = codec;
+			rc = 0;
+		}
+	}
+
+	return rc;
+}
+
+/* Flight recorder rings keep their records in memory, so they don't
+ * go with a trace file
+ */
+static int rbtrace_ctrl_flight(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	bool enable;
+
+	if ((argp == NULL) ||
+	    (ri->ri_flags & (RBTRACE_DO_OPEN|RBTRACE_DO_DISK|
+			     RBTRACE_DO_CLOSE|RBTRACE_DO_SNAP|
+			     RBTRACE_DO_TRIGGER))) {
+		goto out;
+	}
+
+	enable = *((bool *)argp);
+	if (enable) {
+		__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_FLIGHT);
+	} else {
+		/* Only flight recorders can be triggered */
+		__sync_fetch_and_and(&ri->ri_flags,
+				     ~(RBTRACE_DO_FLIGHT|RBTRACE_DO_ARMED));
+	}
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+static int rbtrace_ctrl_snapshot(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	char *path = NULL;
+
+	if (!(ri->ri_flags & RBTRACE_DO_FLIGHT) ||
+	    (ri->ri_flags & RBTRACE_DO_SNAP) || (argp == NULL)) {
+		goto out;
+	}
+
+	path = (char *)argp;
+	if (strlen(path) >= RBTRACE_MAX_PATH) {
+		goto out;
+	}
+
+	strcpy(ri->ri_file_path, path);
+	__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_SNAP);
+	rbtrace_signal_thread(ri, 0);
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+static int rbtrace_ctrl_trigger(struct ring_info *ri, void *argp)
+{
+	int rc = -1;
+	struct rbtrace_op_trigger_arg *trig_arg;
+
+	if (argp == NULL) {
+		goto out;
+	}
+
+	trig_arg = (struct rbtrace_op_trigger_arg *)argp;
+	if (trig_arg->path[0] == '\0') {
+		__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_ARMED);
 		rc = 0;
+		goto out;
+	}
+
+	/* Rules are not changed under a capture */
+	if (!(ri->ri_flags & RBTRACE_DO_FLIGHT) ||
+	    (ri->ri_flags & RBTRACE_DO_TRIGGER) ||
+	    (strnlen(trig_arg->path, RBTRACE_MAX_PATH) >= RBTRACE_MAX_PATH)) {
+		goto out;
 	}
 
+	__sync_fetch_and_and(&ri->ri_flags, ~RBTRACE_DO_ARMED);
+	strcpy(ri->ri_trig_path, trig_arg->path);
+	/* The rest of the buffers are being filled or wait for a swap */
+	ri->ri_trig_pre = (trig_arg->pre < ri->ri_nr_bufs - 1) ?
+		trig_arg->pre : ri->ri_nr_bufs - 1;
+	ri->ri_trig_post = trig_arg->post;
+	ri->ri_trig_id = trig_arg->traceid;
+	ri->ri_trig_a0 = trig_arg->a0;
+	__sync_fetch_and_or(&ri->ri_flags, RBTRACE_DO_ARMED);
+	rc = 0;
+
+ out:
 	return rc;
 }
 
@@ -616,6 +2990,13 @@ rbtrace_op_handler rbt_ops[] = {
 	rbtrace_ctrl_zap,
 	rbtrace_ctrl_tflags,
 	rbtrace_ctrl_info,
+	rbtrace_ctrl_policy,
+	rbtrace_ctrl_resize,
+	rbtrace_ctrl_iomode,
+	rbtrace_ctrl_flight,
+	rbtrace_ctrl_snapshot,
+	rbtrace_ctrl_trigger,
+	rbtrace_ctrl_codec,
 };
 
 STATIC_ASSERT(sizeof(rbt_ops)/sizeof(rbt_ops[0]) == RBTRACE_OP_MAX);
@@ -625,7 +3006,7 @@ int rbtrace_ctrl(rbtrace_ring_t ring, rbtrace_op_t op, void *argp)
 	int rc = 0;
 	struct ring_info *ri;
 
-	if ((ring >= RBTRACE_RING_MAX) || (op >= RBTRACE_OP_MAX)) {
+	if ((ring >= rbt_globals.nr_rings) || (op >= RBTRACE_OP_MAX)) {
 		dprintf("invalid parameter, ring:%d, op:%d\n", ring, op);
 		goto out;
 	}
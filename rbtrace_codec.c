@@ -0,0 +1,691 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rbtrace.h"
+#include "rbtrace_codec.h"
+
+#define NSEC_PER_SEC	(1000000000ULL)
+
+/* Slots of the table the encoder finds metadata in the dictionary by */
+#define CODEC_HASH_SIZE	(RBTRACE_CODEC_DICT * 2)
+
+/* Bytes a coded record may take: timestamp, dictionary index or
+ * metadata literal, and args
+ */
+#define CODEC_REC_MAX(_nr_args_)	(10 + 2 + 5 + 3 + 1 + (_nr_args_) * 10)
+
+/* The LZ stage finds matches of at least 4 bytes up to 64 KB back */
+#define LZ_HASH_BITS	(14)
+#define LZ_MIN_MATCH	(4)
+#define LZ_MAX_OFF	(65535)
+
+/* Fields of a trace entry the codec keeps */
+struct codec_rec {
+	uint64_t ts;
+	uint32_t thread;
+	uint16_t cpuid;
+	uint8_t traceid;
+	uint64_t args[4];
+};
+
+struct codec_meta {
+	uint32_t thread;
+	uint16_t cpuid;
+	uint8_t traceid;
+};
+
+/* State both ends of a block keep, the encoder also hashes metadata */
+struct codec_state {
+	uint64_t ts;		// timestamp of the last record
+	uint64_t delta;		// timestamp delta of the last record
+	uint32_t nr_dict;	// metadata in the dictionary
+	struct codec_meta dict[RBTRACE_CODEC_DICT];
+	uint16_t hash[CODEC_HASH_SIZE];// dictionary index + 1 by hash
+	uint64_t args[256][4];	// args of the last record of each trace ID
+};
+
+static inline int codec_nr_args(rbtrace_format_t format)
+{
+	return (format == RBTRACE_FMT_COMPACT) ? 2 : 4;
+}
+
+static inline char *put_varint(char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char)v;
+	return p;
+}
+
+static inline const char *get_varint(const char *p, const char *end,
+				     uint64_t *v)
+{
+	uint64_t x = 0;
+	int shift = 0;
+	uint8_t b;
+
+	do {
+		if ((p >= end) || (shift > 63)) {
+			return NULL;
+		}
+		b = (uint8_t)*p++;
+		x |= (uint64_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	*v = x;
+	return p;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void codec_get(const char *ent, rbtrace_format_t format, bool tsc,
+		      struct codec_rec *rec)
+{
+	const struct rbtrace_entry *re;
+	const struct rbtrace_entry_v2 *re2;
+	const struct rbtrace_entry_compact *rec2;
+
+	switch (format) {
+	case RBTRACE_FMT_V2:
+		re2 = (const struct rbtrace_entry_v2 *)ent;
+		rec->ts = re2->timestamp;
+		rec->thread = re2->thread;
+		rec->cpuid = re2->cpuid;
+		rec->traceid = re2->traceid;
+		rec->args[0] = re2->a0;
+		rec->args[1] = re2->a1;
+		rec->args[2] = re2->a2;
+		rec->args[3] = re2->a3;
+		break;
+	case RBTRACE_FMT_COMPACT:
+		rec2 = (const struct rbtrace_entry_compact *)ent;
+		rec->ts = rec2->timestamp;
+		rec->thread = rec2->thread;
+		rec->cpuid = rec2->cpuid;
+		rec->traceid = rec2->traceid;
+		rec->args[0] = rec2->a0;
+		rec->args[1] = rec2->a1;
+		break;
+	default:
+		re = (const struct rbtrace_entry *)ent;
+		if (tsc) {
+			rec->ts = re->tsc;
+		} else {
+			rec->ts = re->timestamp.tv_sec * NSEC_PER_SEC +
+				re->timestamp.tv_nsec;
+		}
+		rec->thread = re->thread;
+		rec->cpuid = re->cpuid;
+		rec->traceid = re->traceid;
+		rec->args[0] = re->a0;
+		rec->args[1] = re->a1;
+		rec->args[2] = re->a2;
+		rec->args[3] = re->a3;
+		break;
+	}
+}
+
+static void codec_put(char *ent, rbtrace_format_t format, bool tsc,
+		      const struct codec_rec *rec)
+{
+	struct rbtrace_entry *re;
+	struct rbtrace_entry_v2 *re2;
+	struct rbtrace_entry_compact *rec2;
+
+	memset(ent, 0, rbtrace_entry_size(format));
+	switch (format) {
+	case RBTRACE_FMT_V2:
+		re2 = (struct rbtrace_entry_v2 *)ent;
+		re2->timestamp = rec->ts;
+		re2->thread = rec->thread;
+		re2->cpuid = rec->cpuid;
+		re2->traceid = rec->traceid;
+		re2->a0 = rec->args[0];
+		re2->a1 = rec->args[1];
+		re2->a2 = rec->args[2];
+		re2->a3 = rec->args[3];
+		break;
+	case RBTRACE_FMT_COMPACT:
+		rec2 = (struct rbtrace_entry_compact *)ent;
+		rec2->timestamp = rec->ts;
+		rec2->thread = rec->thread;
+		rec2->cpuid = rec->cpuid;
+		rec2->traceid = rec->traceid;
+		rec2->a0 = rec->args[0];
+		rec2->a1 = rec->args[1];
+		break;
+	default:
+		re = (struct rbtrace_entry *)ent;
+		if (tsc) {
+			re->tsc = rec->ts;
+		} else {
+			re->timestamp.tv_sec = rec->ts / NSEC_PER_SEC;
+			re->timestamp.tv_nsec = rec->ts % NSEC_PER_SEC;
+		}
+		re->thread = rec->thread;
+		re->cpuid = rec->cpuid;
+		re->traceid = rec->traceid;
+		re->a0 = rec->args[0];
+		re->a1 = rec->args[1];
+		re->a2 = rec->args[2];
+		re->a3 = rec->args[3];
+		break;
+	}
+}
+
+/* Index of the metadata of rec in the dictionary, or the number of
+ * entries in it if it is new. New metadata is added while there is
+ * room.
+ */
+static uint32_t codec_dict_find(struct codec_state *st,
+				const struct codec_rec *rec)
+{
+	struct codec_meta *meta;
+	uint32_t h;
+	uint32_t idx;
+
+	h = (rec->thread * 2654435761U) ^ (rec->cpuid * 40503U) ^
+		rec->traceid;
+	for (h %= CODEC_HASH_SIZE; st->hash[h]; h = (h + 1) % CODEC_HASH_SIZE) {
+		meta = &st->dict[st->hash[h] - 1];
+		if ((meta->thread == rec->thread) &&
+		    (meta->cpuid == rec->cpuid) &&
+		    (meta->traceid == rec->traceid)) {
+			return st->hash[h] - 1;
+		}
+	}
+
+	idx = st->nr_dict;
+	if (idx < RBTRACE_CODEC_DICT) {
+		meta = &st->dict[idx];
+		meta->thread = rec->thread;
+		meta->cpuid = rec->cpuid;
+		meta->traceid = rec->traceid;
+		st->hash[h] = idx + 1;
+		st->nr_dict++;
+	}
+	return idx;
+}
+
+/* Timestamps are coded as delta of delta, metadata as an index into a
+ * dictionary built as the block is coded, args as the delta to those
+ * of the last record of the same trace ID. All as zigzag varints.
+ */
+static char *codec_code(struct codec_state *st, const char *ents,
+			uint32_t nr, rbtrace_format_t format, bool tsc,
+			char *p)
+{
+	struct codec_rec rec;
+	uint32_t size = rbtrace_entry_size(format);
+	uint32_t nr_dict;
+	uint32_t idx;
+	uint64_t delta;
+	uint32_t i;
+	int k;
+
+	memset(&rec, 0, sizeof(rec));
+	for (i = 0; i < nr; i++, ents += size) {
+		codec_get(ents, format, tsc, &rec);
+
+		delta = rec.ts - st->ts;
+		p = put_varint(p, zigzag((int64_t)(delta - st->delta)));
+		st->ts = rec.ts;
+		st->delta = delta;
+
+		nr_dict = st->nr_dict;
+		idx = codec_dict_find(st, &rec);
+		p = put_varint(p, idx);
+		if (idx == nr_dict) {
+			/* New metadata follows as a literal */
+			p = put_varint(p, rec.thread);
+			p = put_varint(p, rec.cpuid);
+			*p++ = (char)rec.traceid;
+		}
+
+		for (k = 0; k < codec_nr_args(format); k++) {
+			p = put_varint(p, zigzag((int64_t)(rec.args[k] -
+				st->args[rec.traceid][k])));
+			st->args[rec.traceid][k] = rec.args[k];
+		}
+	}
+
+	return p;
+}
+
+static const char *codec_decode(struct codec_state *st, const char *p,
+				const char *end, uint32_t nr,
+				rbtrace_format_t format, bool tsc, char *ents)
+{
+	struct codec_rec rec;
+	struct codec_meta *meta;
+	uint32_t size = rbtrace_entry_size(format);
+	uint64_t v;
+	uint32_t i;
+	int k;
+
+	memset(&rec, 0, sizeof(rec));
+	for (i = 0; (i < nr) && p; i++, ents += size) {
+		p = get_varint(p, end, &v);
+		if (p == NULL) {
+			break;
+		}
+		st->delta += (uint64_t)unzigzag(v);
+		st->ts += st->delta;
+		rec.ts = st->ts;
+
+		p = get_varint(p, end, &v);
+		if (p == NULL) {
+			break;
+		}
+		if (v < st->nr_dict) {
+			meta = &st->dict[v];
+			rec.thread = meta->thread;
+			rec.cpuid = meta->cpuid;
+			rec.traceid = meta->traceid;
+		} else if (v == st->nr_dict) {
+			p = get_varint(p, end, &v);
+			rec.thread = (uint32_t)v;
+			p = p ? get_varint(p, end, &v) : NULL;
+			if ((p == NULL) || (p >= end)) {
+				return NULL;
+			}
+			rec.cpuid = (uint16_t)v;
+			rec.traceid = (uint8_t)*p++;
+			if (st->nr_dict < RBTRACE_CODEC_DICT) {
+				meta = &st->dict[st->nr_dict++];
+				meta->thread = rec.thread;
+				meta->cpuid = rec.cpuid;
+				meta->traceid = rec.traceid;
+			}
+		} else {
+			return NULL;
+		}
+
+		for (k = 0; (k < codec_nr_args(format)) && p; k++) {
+			p = get_varint(p, end, &v);
+			rec.args[k] = st->args[rec.traceid][k] +
+				(uint64_t)unzigzag(v);
+			st->args[rec.traceid][k] = rec.args[k];
+		}
+
+		codec_put(ents, format, tsc, &rec);
+	}
+
+	return (i == nr) ? p : NULL;
+}
+
+static uint8_t *lz_put_len(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Append a sequence of nlit literals and a match of mlen bytes off
+ * back, the last sequence of a stream has no match
+ */
+static uint8_t *lz_put_seq(uint8_t *op, const uint8_t *lit, size_t nlit,
+			   size_t off, size_t mlen)
+{
+	uint8_t *token = op++;
+
+	*token = (uint8_t)(((nlit < 15) ? nlit : 15) << 4);
+	if (nlit >= 15) {
+		op = lz_put_len(op, nlit - 15);
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0) {
+		return op;
+	}
+
+	*op++ = (uint8_t)(off & 0xFF);
+	*op++ = (uint8_t)(off >> 8);
+	mlen -= LZ_MIN_MATCH;
+	*token |= (uint8_t)((mlen < 15) ? mlen : 15);
+	if (mlen >= 15) {
+		op = lz_put_len(op, mlen - 15);
+	}
+	return op;
+}
+
+/* Bytes a sequence takes at most */
+static inline size_t lz_seq_max(size_t nlit, size_t mlen)
+{
+	return 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1;
+}
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Compress n bytes in into at most max bytes out, a byte oriented
+ * LZ77 with a single probe hash table. Returns the compressed size,
+ * or 0 if it doesn't fit.
+ */
+static size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out,
+			  size_t max)
+{
+	const uint8_t *ip = in;
+	const uint8_t *anchor = in;
+	const uint8_t *iend = in + n;
+	const uint8_t *ref;
+	uint8_t *op = out;
+	uint32_t *tab;
+	uint32_t seq;
+	uint32_t h;
+	size_t mlen;
+
+	tab = calloc(1 << LZ_HASH_BITS, sizeof(*tab));
+	if (tab == NULL) {
+		return 0;
+	}
+
+	while (ip + LZ_MIN_MATCH <= iend) {
+		seq = lz_read32(ip);
+		h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref = in + tab[h] - 1;
+		tab[h] = (uint32_t)(ip - in) + 1;
+		if ((ref < in) || (ip - ref > LZ_MAX_OFF) ||
+		    (lz_read32(ref) != seq)) {
+			/* Skip faster through data that doesn't match */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		mlen = LZ_MIN_MATCH;
+		while ((ip + mlen < iend) && (ref[mlen] == ip[mlen])) {
+			mlen++;
+		}
+		if ((size_t)(out + max - op) <
+		    lz_seq_max(ip - anchor, mlen)) {
+			goto fail;
+		}
+		op = lz_put_seq(op, anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+	}
+
+	if ((size_t)(out + max - op) < lz_seq_max(iend - anchor, 0)) {
+		goto fail;
+	}
+	op = lz_put_seq(op, anchor, iend - anchor, 0, 0);
+	free(tab);
+	return op - out;
+
+ fail:
+	free(tab);
+	return 0;
+}
+
+static int lz_decompress(const uint8_t *in, size_t n, uint8_t *out,
+			 size_t size)
+{
+	const uint8_t *ip = in;
+	const uint8_t *iend = in + n;
+	const uint8_t *ref;
+	uint8_t *op = out;
+	uint8_t *oend = out + size;
+	uint8_t token;
+	uint8_t b;
+	size_t len;
+	size_t off;
+
+	while (ip < iend) {
+		token = *ip++;
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if (((size_t)(iend - ip) < len) ||
+		    ((size_t)(oend - op) < len)) {
+			return -1;
+		}
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		off = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if ((off == 0) || (off > (size_t)(op - out))) {
+			return -1;
+		}
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += LZ_MIN_MATCH;
+		if ((size_t)(oend - op) < len) {
+			return -1;
+		}
+		/* Matches may overlap what they copy */
+		for (ref = op - off; len; len--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return (op == oend) ? 0 : -1;
+}
+
+static uint32_t block_check(const struct rbtrace_block *blk)
+{
+	const uint8_t *p = (const uint8_t *)blk;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < offsetof(struct rbtrace_block, check); i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+bool rbtrace_block_valid(const struct rbtrace_block *blk)
+{
+	return (blk->magic == RBTRACE_BLOCK_MAGIC) &&
+		(blk->check == block_check(blk)) &&
+		!(blk->flags & ~(RBTRACE_BLOCK_RAW|RBTRACE_BLOCK_LZ));
+}
+
+size_t rbtrace_block_bound(uint32_t nr, rbtrace_format_t format)
+{
+	size_t coded = (size_t)nr * CODEC_REC_MAX(codec_nr_args(format));
+	size_t raw = (size_t)nr * rbtrace_entry_size(format);
+
+	return sizeof(struct rbtrace_block) + RBTRACE_BLOCK_ALIGN +
+		((coded > raw) ? coded : raw);
+}
+
+/* Sum up the records that were written in the block header */
+static void codec_zone(const char *ents, uint32_t nr,
+		       rbtrace_format_t format, bool tsc,
+		       struct rbtrace_block *blk)
+{
+	struct codec_rec rec;
+	uint32_t size = rbtrace_entry_size(format);
+	uint32_t bit;
+	uint32_t i;
+	int k;
+
+	memset(&rec, 0, sizeof(rec));
+	blk->min_ts = UINT64_MAX;
+	blk->max_ts = 0;
+	for (k = 0; k < 4; k++) {
+		blk->min_args[k] = UINT64_MAX;
+		blk->max_args[k] = 0;
+	}
+
+	for (i = 0; i < nr; i++, ents += size) {
+		codec_get(ents, format, tsc, &rec);
+		if ((rec.traceid == RBT_NULL) && (rec.thread == 0)) {
+			continue;
+		}
+		if (rec.ts < blk->min_ts) {
+			blk->min_ts = rec.ts;
+		}
+		if (rec.ts > blk->max_ts) {
+			blk->max_ts = rec.ts;
+		}
+		blk->tids |= 1ULL << (rec.traceid % 64);
+		bit = rec.cpuid % RBTRACE_ZONE_BITS;
+		blk->cpus[bit / 64] |= 1ULL << (bit % 64);
+		bit = rbtrace_zone_thread(rec.thread);
+		blk->threads[bit / 64] |= 1ULL << (bit % 64);
+		for (k = 0; k < 4; k++) {
+			if (rec.args[k] < blk->min_args[k]) {
+				blk->min_args[k] = rec.args[k];
+			}
+			if (rec.args[k] > blk->max_args[k]) {
+				blk->max_args[k] = rec.args[k];
+			}
+		}
+	}
+
+	/* No record was written */
+	if (blk->min_ts > blk->max_ts) {
+		blk->min_ts = 0;
+		memset(blk->min_args, 0, sizeof(blk->min_args));
+	}
+}
+
+size_t rbtrace_encode_block(const char *ents, uint32_t nr,
+			    rbtrace_format_t format, bool tsc,
+			    rbtrace_codec_t codec, uint32_t subring,
+			    uint32_t seq, uint32_t lap, char *out)
+{
+	struct rbtrace_block *blk = (struct rbtrace_block *)out;
+	struct codec_state *st;
+	char *payload = out + sizeof(*blk);
+	char *tmp = NULL;
+	size_t raw = (size_t)nr * rbtrace_entry_size(format);
+	size_t size = 0;
+
+	memset(blk, 0, sizeof(*blk));
+	blk->magic = RBTRACE_BLOCK_MAGIC;
+	blk->seq = seq;
+	blk->nr_records = nr;
+	blk->subring = subring;
+	blk->lap = lap;
+	codec_zone(ents, nr, format, tsc, blk);
+
+	st = (codec == RBTRACE_CODEC_RAW) ? NULL : calloc(1, sizeof(*st));
+	if (st) {
+		size = codec_code(st, ents, nr, format, tsc, payload) -
+			payload;
+		free(st);
+	}
+	blk->coded_size = size;
+
+	/* LZ is kept only if it makes the block smaller */
+	if ((codec == RBTRACE_CODEC_LZ) && size) {
+		tmp = malloc(size);
+		if (tmp) {
+			blk->size = lz_compress((uint8_t *)payload, size,
+						(uint8_t *)tmp, size - 1);
+			if (blk->size) {
+				memcpy(payload, tmp, blk->size);
+				blk->flags |= RBTRACE_BLOCK_LZ;
+				size = blk->size;
+			}
+			free(tmp);
+		}
+	}
+
+	/* Records that don't code well are kept as they are */
+	if ((size == 0) || (size >= raw)) {
+		memcpy(payload, ents, raw);
+		blk->flags = RBTRACE_BLOCK_RAW;
+		blk->coded_size = raw;
+		size = raw;
+	}
+	blk->size = size;
+	blk->check = block_check(blk);
+
+	/* Pad to the next block */
+	memset(payload + size, 0, rbtrace_block_span(blk) - sizeof(*blk) -
+	       size);
+	return rbtrace_block_span(blk);
+}
+
+int rbtrace_decode_block(const struct rbtrace_block *blk,
+			 const char *payload, rbtrace_format_t format,
+			 bool tsc, char *ents)
+{
+	struct codec_state *st = NULL;
+	const char *coded = payload;
+	const char *end;
+	char *tmp = NULL;
+	size_t raw = (size_t)blk->nr_records * rbtrace_entry_size(format);
+	int rc = -1;
+
+	if (blk->flags & RBTRACE_BLOCK_RAW) {
+		if (blk->size != raw) {
+			goto out;
+		}
+		memcpy(ents, payload, raw);
+		rc = 0;
+		goto out;
+	}
+
+	if (blk->flags & RBTRACE_BLOCK_LZ) {
+		tmp = malloc(blk->coded_size);
+		if ((tmp == NULL) ||
+		    (lz_decompress((const uint8_t *)payload, blk->size,
+				   (uint8_t *)tmp, blk->coded_size) != 0)) {
+			goto out;
+		}
+		coded = tmp;
+		end = tmp + blk->coded_size;
+	} else {
+		end = payload + blk->size;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL) {
+		goto out;
+	}
+	if (codec_decode(st, coded, end, blk->nr_records, format, tsc,
+			 ents) == end) {
+		rc = 0;
+	}
+
+ out:
+	free(st);
+	free(tmp);
+	return rc;
+}
@@ -0,0 +1,52 @@
+#ifndef __RBTRACE_CODEC_H__
+#define __RBTRACE_CODEC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "rbtracedef.h"
+
+#ifdef RBT_STR
+const char *rbt_codec_str[] = {
+	"none",
+	"raw",
+	"delta",
+	"lz",
+};
+#endif	/* RBT_STR */
+
+/* Records a block dictionary holds (thread, cpuid, traceid) of */
+#define RBTRACE_CODEC_DICT	(4096)
+
+/* Bytes a block of nr entries of format may take, header included */
+size_t rbtrace_block_bound(uint32_t nr, rbtrace_format_t format);
+
+/* Code nr entries of format, written from subring, into block seq of
+ * lap at out, which must hold rbtrace_block_bound() bytes. Timestamps
+ * of v1 entries are TSC ticks if tsc is set. Returns the bytes the
+ * block takes in file.
+ */
+size_t rbtrace_encode_block(const char *ents, uint32_t nr,
+			    rbtrace_format_t format, bool tsc,
+			    rbtrace_codec_t codec, uint32_t subring,
+			    uint32_t seq, uint32_t lap, char *out);
+
+/* Whether blk looks like an intact block header */
+bool rbtrace_block_valid(const struct rbtrace_block *blk);
+
+/* Bytes a block takes in file, header included */
+static inline size_t rbtrace_block_span(const struct rbtrace_block *blk)
+{
+	return sizeof(*blk) + ((blk->size + RBTRACE_BLOCK_ALIGN - 1) &
+			       ~(size_t)(RBTRACE_BLOCK_ALIGN - 1));
+}
+
+/* Decode the payload of a block into entries of format at ents, which
+ * must hold blk->nr_records of them. Returns 0 or -1 if the block is
+ * corrupt.
+ */
+int rbtrace_decode_block(const struct rbtrace_block *blk,
+			 const char *payload, rbtrace_format_t format,
+			 bool tsc, char *ents);
+
+#endif	/* __RBTRACE_CODEC_H__ */
@@ -3,7 +3,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include <semaphore.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <assert.h>
 #include "rbtrace.h"
 #include "rbtracedef.h"
@@ -12,21 +16,254 @@
 #define dprintf		printf
 #endif
 
+#ifndef pause
+#define pause()	__asm __volatile("pause\n": : : "memory")
+#endif
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc\n" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdtscp(uint32_t *aux)
+{
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtscp\n" : "=a"(lo), "=d"(hi), "=c"(*aux));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 #define RBTRACE_SHM_NAME	"/rbtracebuf"
-#define RBTRACE_SEM_NAME	"/rbtrace"
+
+/* Max number of per-CPU sub-rings in a ring */
+#define RBTRACE_MAX_CPUS	(256)
+
+/* Max number of NUMA nodes sub-rings are placed on */
+#define RBTRACE_MAX_NODES	(16)
+#define RBTRACE_SYSFS_NODE	"/sys/devices/system/node"
+
+/* Control data shared between producers is laid out so that data
+ * written on every record never shares a cache line with data that
+ * is only read on the hot path
+ */
+#define RBTRACE_CACHE_LINE	(64)
+#define __cacheline_aligned	__attribute__((aligned(RBTRACE_CACHE_LINE)))
+
+#define RBTRACE_PAGE_SIZE	(4096)
+#define RBTRACE_HUGE_PAGE_SIZE	(2UL * 1024 * 1024)
+
+/* Whether shmem may use transparent huge pages */
+#define RBTRACE_THP_SHMEM	"/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+
+#define RBTRACE_ALIGN(_x_, _a_)	(((_x_) + (_a_) - 1) & ~((size_t)(_a_) - 1))
+
+/* Number of buffers in a sub-ring */
+#define RBTRACE_MIN_BUFS	(2)
+#define RBTRACE_DFT_BUFS	(4)
+#define RBTRACE_MAX_BUFS	(16)
+
+/* Where the buffers of a sub-ring are in one of the two layouts a
+ * ring switches between when it is resized
+ */
+struct subring_geo {
+	uint32_t sg_size;	// number of trace records in a buffer
+	uint32_t sg_seg;	// shm segment of the buffers, 0 for the main one
+	uint64_t sg_buf_off;	// offset in bytes to the buffers in the segment
+};
+
+/* Segments with this bit are the trace file of the ring, mapped from
+ * ri_file_path rather than from a shm name
+ */
+#define RBTRACE_SEG_FILE	(1U << 31)
+
+/* A sub-ring is a queue of buffers with its own slot counter. A ring
+ * has one sub-ring by default, or one per CPU in per-CPU mode so
+ * that producers on different CPUs never touch the same counters.
+ * Producers fill the buffer at the head of the queue, full buffers
+ * are drained by the flusher in order from the tail.
+ */
+struct subring_info {
+	/* Written by producers on every record */
+	volatile uint64_t si_pos __cacheline_aligned;// pass and slots claimed in it
+	volatile int si_lost;	// number of records lost
+	volatile int si_discard;// records in full buffers discarded
+
+	/* Read on every record, written on buffer swap */
+	struct subring_geo si_geo[2] __cacheline_aligned;// buffers of each layout
+	volatile uint32_t si_tail;	// next full buffer to be flushed
+	volatile uint32_t si_seq;	// bumped on swap and flush done, futex
+	volatile uint32_t si_waiters;// producers sleeping on si_seq
+	uint32_t si_node;	// NUMA node the buffers are on, flushed from
+	volatile uint8_t si_buf_gen[RBTRACE_MAX_BUFS];// generation and layout of full buffers
+};
+
+/* si_pos packs a pass number with the count of slots claimed in that
+ * pass, so a producer knows which buffer its slot is in from the same
+ * atomic that claimed it. The low bits of a pass are the sequence of
+ * the head buffer, then the layout of the buffers and the high bits
+ * count discarded passes.
+ */
+#define RBTRACE_POS(_pass_, _cnt_)	(((uint64_t)(_pass_) << 32) | (_cnt_))
+#define RBTRACE_POS_PASS(_pos_)		((uint32_t)((_pos_) >> 32))
+#define RBTRACE_POS_COUNT(_pos_)	((uint32_t)(_pos_))
+#define RBTRACE_PASS_HEAD_MASK		(0x7FFFFF)
+#define RBTRACE_PASS_LAYOUT		(1U << 23)
+#define RBTRACE_PASS_DISCARD		(1U << 24)
+
+/* Full buffers keep their layout next to their generation */
+#define RBTRACE_BUF_LAYOUT		(0x80)
+
+static inline uint32_t rbtrace_pass_head(uint32_t pass)
+{
+	return pass & RBTRACE_PASS_HEAD_MASK;
+}
+
+static inline uint32_t rbtrace_pass_layout(uint32_t pass)
+{
+	return (pass & RBTRACE_PASS_LAYOUT) ? 1 : 0;
+}
+
+/* What a producer does when the active buffer of its sub-ring is full
+ * and another producer is swapping it
+ */
+typedef enum rbtrace_policy {
+	RBTRACE_POLICY_DROP = 0,// drop the record at once
+	RBTRACE_POLICY_SPIN,	// spin a while for the swap
+	RBTRACE_POLICY_WAIT,	// sleep until the buffer is swapped
+	RBTRACE_POLICY_BLOCK,	// like wait, and wait for the flusher rather
+				// than discard a full buffer
+	RBTRACE_POLICY_MAX,
+} rbtrace_policy_t;
+
+#ifdef RBT_STR
+const char *rbt_policy_str[] = {
+	"drop",
+	"spin",
+	"wait",
+	"block",
+};
+#endif	/* RBT_STR */
+
+/* How trace files are written */
+typedef enum rbtrace_iomode {
+	RBTRACE_IO_BUFFERED = 0,// through the page cache
+	RBTRACE_IO_DIRECT,	// with O_DIRECT, bypassing the page cache
+	RBTRACE_IO_DONTNEED,	// through the page cache, dropped once on disk
+	RBTRACE_IO_MMAP,	// the buffers of the ring are the file itself
+	RBTRACE_IO_MAX,
+} rbtrace_iomode_t;
+
+#ifdef RBT_STR
+const char *rbt_iomode_str[] = {
+	"buffered",
+	"direct",
+	"dontneed",
+	"mmap",
+};
+#endif	/* RBT_STR */
+
+/* O_DIRECT writes are aligned to this, trace files written with it
+ * pad their header to it
+ */
+#define RBTRACE_DIO_ALIGN	RBTRACE_PAGE_SIZE
+
+/* Wait time histogram buckets, bucket 0 counts waits shorter than
+ * 1us, bucket n waits of [2^(n-1), 2^n) us and the last one the rest
+ */
+#define RBTRACE_WAIT_BUCKETS	(16)
+
+/* Overflow statistics of a ring under one policy */
+struct policy_stats {
+	volatile uint64_t ps_lost;	// records lost
+	volatile uint64_t ps_waits;	// waits for a buffer swap
+	volatile uint64_t ps_wait_hist[RBTRACE_WAIT_BUCKETS];
+};
+
+/* Statistics of a ring since it was set up, only written on the slow
+ * path. Overflows are counted under the policy in effect.
+ */
+struct ring_stats {
+	struct policy_stats rs_policy[RBTRACE_POLICY_MAX];
+	uint64_t rs_start_ns;	// CLOCK_MONOTONIC time of the reset
+	volatile uint64_t rs_node_records[RBTRACE_MAX_NODES];// records written per node
+};
 
 struct ring_info {
-	char ri_file_path[RBTRACE_MAX_PATH];// trace file path
-	rbtrace_ring_t ri_ring;	// ring ID
+	/* Read on every record, rarely written */
+	rbtrace_ring_t ri_ring __cacheline_aligned;// ring ID
 	volatile uint64_t ri_flags;// attribute flags for this ring
 	volatile uint64_t ri_tflags;// traffic flags for this ring
-	volatile int ri_cir_off;// offset in trace records to active ring buffer
-	volatile int ri_alt_off;// offset in trace records to inactive ring buffer
-	volatile int ri_slot;	// current position in ring
-	volatile int ri_flush;	// flushing
-	volatile int ri_lost;	// number of records lost
+	uint32_t ri_size;	// number of trace records in a buffer
+	uint32_t ri_nr_subrings;// number of sub-rings in this ring
+	uint32_t ri_nr_bufs;	// number of buffers in a sub-ring
+	rbtrace_format_t ri_format;// format of trace entries
+	uint32_t ri_entry_size;	// size of a trace entry
+	uint32_t ri_args_off;	// offset of a0 in a trace entry
+	uint32_t ri_commit_off;	// offset of commit marker in a trace entry
+	volatile rbtrace_policy_t ri_policy;// overflow policy
+	volatile uint32_t ri_layout;// layout of buffers new passes use
+	volatile uint8_t ri_trig_id;// trace ID that fires the trigger
+	volatile uint64_t ri_trig_a0;// least a0 of a record that fires it
+
+	/* Only used by rbt and the flusher */
+	char ri_file_path[RBTRACE_MAX_PATH] __cacheline_aligned;// trace file path
+	char ri_name[RBTRACE_MAX_NAME];// ring name
+	char ri_desc[RBTRACE_MAX_DESC];// ring description
+	volatile uint32_t ri_resize;// records per buffer to resize to
+	volatile rbtrace_iomode_t ri_iomode;// how trace files are written
+	char ri_trig_path[RBTRACE_MAX_PATH];// base path of triggered captures
+	volatile uint32_t ri_trig_pre;// full buffers kept before a trigger
+	volatile uint32_t ri_trig_post;// full buffers written after a trigger
+	volatile rbtrace_codec_t ri_codec;// codec of trace files
+
+	/* Written when a sub-ring overflows */
+	struct ring_stats ri_stats __cacheline_aligned;
+
+	struct subring_info ri_subrings[RBTRACE_MAX_CPUS];
 };
 
+/* Overflow statistics of the policy a ring has now */
+static inline struct policy_stats *rbtrace_policy_stats(struct ring_info *ri)
+{
+	return &ri->ri_stats.rs_policy[ri->ri_policy % RBTRACE_POLICY_MAX];
+}
+
+static inline uint32_t rbtrace_args_off(rbtrace_format_t format)
+{
+	switch (format) {
+	case RBTRACE_FMT_V2:
+		return offsetof(struct rbtrace_entry_v2, a0);
+	case RBTRACE_FMT_COMPACT:
+		return offsetof(struct rbtrace_entry_compact, a0);
+	default:
+		return offsetof(struct rbtrace_entry, a0);
+	}
+}
+
+static inline uint32_t rbtrace_commit_off(rbtrace_format_t format)
+{
+	switch (format) {
+	case RBTRACE_FMT_V2:
+		return offsetof(struct rbtrace_entry_v2, commit);
+	case RBTRACE_FMT_COMPACT:
+		return offsetof(struct rbtrace_entry_compact, commit);
+	default:
+		return offsetof(struct rbtrace_entry, commit);
+	}
+}
+
+/* Buffer generations run from 1 to RBTRACE_COMMIT_GEN_MASK, 0 is
+ * never used so that a zeroed entry is never taken as committed. Every
+ * pass of a sub-ring gets a different generation than the one before.
+ */
+static inline uint8_t rbtrace_pass_gen(uint32_t pass)
+{
+	return (pass % RBTRACE_COMMIT_GEN_MASK) + 1;
+}
+
 /* Flags for ri_flags in ring_info */
 #define RBTRACE_DO_DISK		(1 << 1)
 #define RBTRACE_DO_OPEN		(1 << 2)
@@ -34,30 +271,147 @@ struct ring_info {
 #define RBTRACE_DO_ZAP		(1 << 4)
 #define RBTRACE_DO_CLOSE	(1 << 5)
 #define RBTRACE_DO_FLUSH	(1 << 6)
+#define RBTRACE_DO_TSC		(1 << 7)
+#define RBTRACE_DO_RESIZE	(1 << 8)
+#define RBTRACE_DO_NUMA		(1 << 9)	// one sub-ring per NUMA node
+#define RBTRACE_DO_MMAP		(1 << 10)	// buffers are mapped from the trace file
+#define RBTRACE_DO_FLIGHT	(1 << 11)	// full buffers are overwritten, not written
+#define RBTRACE_DO_SNAP		(1 << 12)	// snapshot to ri_file_path requested
+#define RBTRACE_DO_FREEZE	(1 << 13)	// full buffers are kept for a snapshot
+#define RBTRACE_DO_ARMED	(1 << 14)	// a trigger starts a capture
+#define RBTRACE_DO_TRIGGER	(1 << 15)	// a capture was triggered
+
+#ifdef RBT_STR
+const char *rbt_format_str[] = {
+	"v1",
+	"v2",
+	"compact",
+};
+#endif	/* RBT_STR */
 
 struct ring_config {
 	rbtrace_ring_t rc_ring;
-	char *rc_name;
-	char *rc_desc;
+	char rc_name[RBTRACE_MAX_NAME];
+	char rc_desc[RBTRACE_MAX_DESC];
 	uint64_t rc_flags;
 	uint32_t rc_size;	// number of trace records in a buffer
-	uint32_t rc_data_size;	// number of bytes in a buffer write
+	uint32_t rc_cpu_size;	// number of trace records in a per-CPU buffer
+	rbtrace_format_t rc_format;// format of trace entries
+	rbtrace_policy_t rc_policy;// overflow policy
+	uint32_t rc_nr_bufs;	// number of buffers in a sub-ring
 };
 
+/* Options of the rbtrace daemon */
+struct rbtrace_daemon_opts {
+	bool percpu;		// one sub-ring per CPU
+	bool tsc;		// timestamp records with TSC
+	bool huge;		// back shared memory with huge pages
+	bool numa;		// place sub-rings on NUMA nodes
+	bool flight;		// start rings in flight recorder mode
+	uint32_t nr_bufs;	// buffers per sub-ring, 0 for ring default
+	struct ring_config *rings;// rings to add to or override the defaults
+	int nr_rings;
+};
+
+/* Records in a buffer of a configured ring */
+#define RBTRACE_MIN_RECORDS	(64)
+#define RBTRACE_MAX_RECORDS	(16*1024*1024)
+
+/* Producers ring the doorbell to have the flusher service a ring.
+ * The futex is only woken if the flusher is sleeping on it, so a
+ * busy flusher costs producers no syscall. Each NUMA node has a
+ * flusher and a doorbell of its own.
+ */
+struct rbtrace_doorbell {
+	volatile uint64_t db_pending __cacheline_aligned;// bitmask of rings to service
+	volatile uint32_t db_futex;	// bumped on every wake
+	volatile uint32_t db_waiting;	// flusher sleeps on db_futex
+};
+
+/* Directory of the shared memory, written by rbtraced once all rings
+ * are set up so that rbtrace_init() can find them
+ */
+#define RBTRACE_SHM_MAGIC	"RBTSHM"
+
+/* Flags for sd_flags in rbtrace_shm_dir */
+#define RBTRACE_SHM_HUGE	(1 << 0)	// back with huge pages
+#define RBTRACE_SHM_NUMA	(1 << 1)	// sub-rings placed on nodes
+
+struct rbtrace_shm_dir {
+	char sd_magic[8];	// RBTRACE_SHM_MAGIC when ready
+	uint16_t sd_major;	// RBTRACE_MAJOR
+	uint16_t sd_minor;	// RBTRACE_MINOR
+	uint32_t sd_nr_rings;	// number of configured rings
+	uint32_t sd_ri_size;	// size of a ring info
+	uint32_t sd_flags;	// RBTRACE_SHM_* flags
+	uint64_t sd_ri_off;	// offset in bytes to ring infos
+	uint64_t sd_re_off;	// offset in bytes to trace records
+	uint32_t sd_nr_nodes;	// number of flushers and doorbells
+	uint64_t sd_db_off;	// offset in bytes to doorbells
+};
+
+/* Layout of shared memory: file size takes the first cache line,
+ * the directory the second, ring infos and a doorbell per NUMA node
+ * follow and trace records start at a page boundary
+ */
+#define RBTRACE_SHM_DIR_OFF	(RBTRACE_CACHE_LINE)
+#define RBTRACE_SHM_RI_OFF	(RBTRACE_CACHE_LINE * 2)
+
+static inline size_t rbtrace_shm_db_off(int nr_rings)
+{
+	return RBTRACE_SHM_RI_OFF + sizeof(struct ring_info) * nr_rings;
+}
+
+static inline size_t rbtrace_shm_re_off(int nr_rings)
+{
+	return RBTRACE_ALIGN(rbtrace_shm_db_off(nr_rings) +
+			     sizeof(struct rbtrace_doorbell) *
+			     RBTRACE_MAX_NODES,
+			     RBTRACE_PAGE_SIZE);
+}
+
+static inline long rbtrace_futex(volatile uint32_t *uaddr, int op,
+				 uint32_t val,
+				 const struct timespec *timeout)
+{
+	/* Shared futex, the word lives in shared memory */
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/* Wake producers waiting for a swap or for the flusher */
+static inline void rbtrace_subring_wake(struct subring_info *si)
+{
+	__sync_add_and_fetch(&si->si_seq, 1);
+	if (si->si_waiters) {
+		rbtrace_futex(&si->si_seq, FUTEX_WAKE, INT32_MAX, NULL);
+	}
+}
+
 struct rbtrace_global_data {
 	bool inited;
 	int shm_fd;		// shared memory fd
 	size_t shm_size;
 	char *shm_base;
-	sem_t *sem_ptr;
 	uint64_t *fsize_ptr;
-	rbtrace_ring_t *ring_ptr;
+	struct rbtrace_doorbell *db_ptr;
+	struct rbtrace_shm_dir *dir_ptr;
+	int nr_rings;		// number of configured rings
+	int nr_nodes;		// number of doorbells
 	struct ring_info *ri_ptr;
-	struct rbtrace_entry *re_base;
+	char *re_base;
 };
 
 extern struct rbtrace_global_data rbt_globals;
 
+/* NUMA topology as sysfs shows it, a single node if it doesn't */
+struct rbtrace_numa {
+	int nr_nodes;		// number of online nodes
+	int node_ids[RBTRACE_MAX_NODES];// kernel ID of each node
+	uint8_t cpu_node[RBTRACE_MAX_CPUS];// node of each CPU
+};
+
+extern struct rbtrace_numa rbt_numa;
+
 typedef enum rbtrace_op {
 	RBTRACE_OP_OPEN = 0,
 	RBTRACE_OP_CLOSE,
@@ -66,6 +420,13 @@ typedef enum rbtrace_op {
 	RBTRACE_OP_ZAP,
 	RBTRACE_OP_TFLAGS,
 	RBTRACE_OP_INFO,
+	RBTRACE_OP_POLICY,
+	RBTRACE_OP_RESIZE,
+	RBTRACE_OP_IOMODE,
+	RBTRACE_OP_FLIGHT,
+	RBTRACE_OP_SNAPSHOT,
+	RBTRACE_OP_TRIGGER,
+	RBTRACE_OP_CODEC,
 	RBTRACE_OP_MAX,
 } rbtrace_op_t;
 
@@ -74,6 +435,18 @@ struct rbtrace_op_tflags_arg {
 	uint64_t tflags;
 };
 
+/* Arm triggered capture of a flight recorder ring, an empty path
+ * disarms it. Records of trace ID traceid with a0 of at least a0 fire
+ * the trigger, RBT_NULL leaves it to rbtrace_trigger() calls.
+ */
+struct rbtrace_op_trigger_arg {
+	char path[RBTRACE_MAX_PATH];
+	uint32_t pre;
+	uint32_t post;
+	uint8_t traceid;
+	uint64_t a0;
+};
+
 struct rbtrace_op_info_arg {
 	char ring_name[RBTRACE_MAX_NAME];
 	char ring_desc[RBTRACE_MAX_DESC];
@@ -82,19 +455,39 @@ struct rbtrace_op_info_arg {
 	uint64_t tflags;
 	uint64_t file_size;
 	uint32_t trace_entry_size;
+	uint32_t trace_entry_format;
+	uint32_t nr_records;
+	uint32_t nr_subrings;
+	uint32_t nr_bufs;
+	uint32_t nr_nodes;
+	uint32_t policy;
+	uint32_t iomode;
+	uint32_t codec;
+	struct rbtrace_op_trigger_arg trigger;
+	struct ring_stats stats;
 };
 
 typedef int (*rbtrace_op_handler)(struct ring_info *ri, void *argp);
 
 void update_coredump_filter(void);
 int rbtrace_ctrl(rbtrace_ring_t ring, rbtrace_op_t op, void *argp);
-size_t rbtrace_calc_shm_size(void);
-void rbtrace_signal_thread(struct ring_info *ri);
+uint32_t rbtrace_ring_nr_bufs(struct ring_config *cfg, uint32_t nr_bufs);
+uint32_t rbtrace_ring_nr_subrings(struct rbtrace_daemon_opts *dopts);
+size_t rbtrace_calc_ring_size(struct ring_config *cfg,
+			      struct rbtrace_daemon_opts *dopts);
+size_t rbtrace_calc_shm_size(struct ring_config *cfgs, int nr_rings,
+			     struct rbtrace_daemon_opts *dopts);
+void rbtrace_numa_init(void);
+void rbtrace_signal_thread(struct ring_info *ri, uint32_t node);
+char *rbtrace_shm_map(int fd, size_t size, bool huge);
 void rbtrace_globals_init(int fd, char *shm_base,
-			  size_t shm_size,
-			  sem_t *sem_ptr);
+			  size_t shm_size);
 void rbtrace_globals_cleanup(bool do_unlink);
-int rbtrace_daemon_init(void);
+void rbtrace_seg_name(char *name, size_t len, rbtrace_ring_t ring,
+		      uint32_t seg);
+char *rbtrace_subring_buffer(struct ring_info *ri, struct subring_info *si,
+			     uint32_t layout, uint32_t seq);
+int rbtrace_daemon_init(struct rbtrace_daemon_opts *dopts);
 void rbtrace_daemon_exit(void);
 
 #endif	/* __RBTRACE_PRIVATE_H__ */
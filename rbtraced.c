@@ -5,10 +5,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include "rbtrace.h"
 #include "rbtracedef.h"
+/* Only the tables of rbtrace_private.h, rbtrace.h is included above */
+#define RBT_STR
 #include "rbtrace_private.h"
 #include "version.h"
 
@@ -16,18 +20,35 @@
 
 #define RBTRACED_DFT_PID_FILE	"rbtraced.pid"
 #define RBTRACED_DFT_LOG_FILE	"rbtraced.log"
+#define RBTRACED_DFT_SNAP_DIR	"."
 
 struct rbtrace_server {
 	char *pidfile;
 	char *logfile;
+	char *snapdir;
 	bool daemonize;
 	volatile sig_atomic_t terminate;
+	volatile sig_atomic_t snapshot;
 	sem_t sem;
+	struct rbtrace_daemon_opts dopts;
+	struct ring_config rings[RBTRACE_RING_MAX];
 } server = {
 	.pidfile = RBTRACED_DFT_PID_FILE,
 	.logfile = RBTRACED_DFT_LOG_FILE,
+	.snapdir = RBTRACED_DFT_SNAP_DIR,
 	.daemonize = false,
 	.terminate = 0,
+	.snapshot = 0,
+	.dopts = {
+		.percpu = false,
+		.tsc = false,
+		.huge = false,
+		.numa = false,
+		.flight = false,
+		.nr_bufs = 0,
+		.rings = server.rings,
+		.nr_rings = 0,
+	},
 };
 
 static void usage(void);
@@ -45,11 +66,174 @@ static void sig_handler(const int sig)
 	sem_post(&server.sem);
 }
 
+static void snap_handler(const int sig)
+{
+	server.snapshot = 1;
+	sem_post(&server.sem);
+}
+
+STATIC_ASSERT(sizeof(rbt_format_str)/sizeof(rbt_format_str[0]) == RBTRACE_FMT_MAX);
+
+/* Parse a ring spec of the form name:records[:format[:description]]
+ * into the next ring config
+ */
+static int add_ring(const char *spec)
+{
+	struct ring_config *cfg;
+	char buf[RBTRACED_MAX_LINE];
+	char *name, *records, *format, *desc;
+	char *endptr = NULL;
+	unsigned long nr;
+	int i;
+
+	if (server.dopts.nr_rings >= RBTRACE_RING_MAX) {
+		fprintf(stderr, "too many rings, at most %d\n",
+			RBTRACE_RING_MAX);
+		return -1;
+	}
+	if (strlen(spec) >= sizeof(buf)) {
+		fprintf(stderr, "ring spec too long:%s\n", spec);
+		return -1;
+	}
+	strcpy(buf, spec);
+
+	name = buf;
+	records = strchr(name, ':');
+	if (records == NULL) {
+		goto invalid;
+	}
+	*records++ = '\0';
+	format = strchr(records, ':');
+	if (format) {
+		*format++ = '\0';
+	}
+	desc = format ? strchr(format, ':') : NULL;
+	if (desc) {
+		*desc++ = '\0';
+	}
+
+	if ((name[0] == '\0') || (strlen(name) >= RBTRACE_MAX_NAME) ||
+	    (desc && (strlen(desc) >= RBTRACE_MAX_DESC))) {
+		goto invalid;
+	}
+
+	nr = strtoul(records, &endptr, 10);
+	if ((endptr == records) || (*endptr != '\0') ||
+	    (nr < RBTRACE_MIN_RECORDS) || (nr > RBTRACE_MAX_RECORDS)) {
+		fprintf(stderr, "records of ring %s must be %d-%d\n",
+			name, RBTRACE_MIN_RECORDS, RBTRACE_MAX_RECORDS);
+		return -1;
+	}
+
+	cfg = &server.rings[server.dopts.nr_rings];
+	memset(cfg, 0, sizeof(*cfg));
+	strcpy(cfg->rc_name, name);
+	strcpy(cfg->rc_desc, desc ? desc : name);
+	cfg->rc_size = nr;
+	/* Per-CPU buffers are an eighth of the size, as for io */
+	cfg->rc_cpu_size = nr / 8;
+	if (cfg->rc_cpu_size < RBTRACE_MIN_RECORDS) {
+		cfg->rc_cpu_size = RBTRACE_MIN_RECORDS;
+	}
+	cfg->rc_format = RBTRACE_FMT_V1;
+	cfg->rc_policy = RBTRACE_POLICY_SPIN;
+	cfg->rc_nr_bufs = RBTRACE_DFT_BUFS;
+
+	if (format && format[0]) {
+		for (i = 0; i < RBTRACE_FMT_MAX; i++) {
+			if (strcmp(format, rbt_format_str[i]) == 0) {
+				break;
+			}
+		}
+		if (i >= RBTRACE_FMT_MAX) {
+			goto invalid;
+		}
+		cfg->rc_format = i;
+	}
+
+	server.dopts.nr_rings++;
+	return 0;
+
+ invalid:
+	fprintf(stderr, "invalid ring spec:%s\n", spec);
+	return -1;
+}
+
+/* Read ring specs from a file, one per line */
+static int load_config(const char *path)
+{
+	FILE *fp;
+	char line[RBTRACED_MAX_LINE];
+	char *ptr;
+	size_t len;
+	int rc = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "open config:%s failed, %s\n",
+			path, strerror_r(errno, line, sizeof(line)));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		while (len && ((line[len - 1] == '\n') ||
+			       (line[len - 1] == ' ') ||
+			       (line[len - 1] == '\t'))) {
+			line[--len] = '\0';
+		}
+		ptr = line + strspn(line, " \t");
+		if ((ptr[0] == '\0') || (ptr[0] == '#')) {
+			continue;
+		}
+		rc = add_ring(ptr);
+		if (rc != 0) {
+			break;
+		}
+	}
+
+	fclose(fp);
+	return rc;
+}
+
 static void install_signal_handlers(void)
 {
 	(void)signal(SIGINT, sig_handler);
 	(void)signal(SIGTERM, sig_handler);
 	(void)signal(SIGQUIT, sig_handler);
+	(void)signal(SIGUSR1, snap_handler);
+}
+
+/* Snapshot every ring in flight recorder mode to the snapshot dir */
+static void snapshot_rings(void)
+{
+	int i;
+	int rc;
+	time_t now;
+	struct tm tm;
+	struct timespec ts;
+	struct rbtrace_op_info_arg info_arg;
+	char path[RBTRACE_MAX_PATH];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec;
+	localtime_r(&now, &tm);
+	for (i = 0; i < rbt_globals.nr_rings; i++) {
+		rc = rbtrace_ctrl(i, RBTRACE_OP_INFO, &info_arg);
+		if ((rc != 0) || !(info_arg.flags & RBTRACE_DO_FLIGHT)) {
+			continue;
+		}
+		snprintf(path, sizeof(path),
+			 "%s/%s.%02d-%02d_%02d-%02d-%02d_%03ld.rbt",
+			 server.snapdir, info_arg.ring_name,
+			 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+			 tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000000);
+		rc = rbtrace_ctrl(i, RBTRACE_OP_SNAPSHOT, path);
+		if (rc != 0) {
+			fprintf(stderr, "ring:%d snapshot failed, error:%d\n",
+				i, rc);
+		}
+	}
 }
 
 static void daemonize(void)
@@ -113,17 +297,56 @@ int main(int argc, char *argv[])
 	int ch;
 	char buf[RBTRACED_MAX_LINE];
 
-	while ((ch = getopt(argc, argv, "dhp:l:v")) != -1) {
+	while ((ch = getopt(argc, argv, "dhctHNFb:r:f:p:l:S:v")) != -1) {
 		switch (ch) {
 		case 'd':
 			server.daemonize = true;
 			break;
+		case 'c':
+			server.dopts.percpu = true;
+			break;
+		case 't':
+			server.dopts.tsc = true;
+			break;
+		case 'H':
+			server.dopts.huge = true;
+			break;
+		case 'N':
+			server.dopts.numa = true;
+			break;
+		case 'F':
+			server.dopts.flight = true;
+			break;
+		case 'b':
+			server.dopts.nr_bufs = atoi(optarg);
+			if ((server.dopts.nr_bufs < RBTRACE_MIN_BUFS) ||
+			    (server.dopts.nr_bufs > RBTRACE_MAX_BUFS)) {
+				rc = -1;
+				usage();
+				goto out;
+			}
+			break;
+		case 'r':
+			rc = add_ring(optarg);
+			if (rc != 0) {
+				goto out;
+			}
+			break;
+		case 'f':
+			rc = load_config(optarg);
+			if (rc != 0) {
+				goto out;
+			}
+			break;
 		case 'p':
 			server.pidfile = optarg;
 			break;
 		case 'l':
 			server.logfile = optarg;
 			break;
+		case 'S':
+			server.snapdir = optarg;
+			break;
 		case 'v':
 			version();
 			goto out;
@@ -150,7 +373,7 @@ int main(int argc, char *argv[])
 
 	install_signal_handlers();
 
-	rc = rbtrace_daemon_init();
+	rc = rbtrace_daemon_init(&server.dopts);
 	if (rc != 0) {
 		fprintf(stderr, "daemon init failed, error:%d\n", rc);
 		goto cleanup;
@@ -158,6 +381,10 @@ int main(int argc, char *argv[])
 
 	while (!server.terminate) {
 		sem_wait(&server.sem);
+		if (server.snapshot) {
+			server.snapshot = 0;
+			snapshot_rings();
+		}
 	}
 
 	rbtrace_daemon_exit();
@@ -182,10 +409,23 @@ static void usage(void)
 {
 	printf("Usage: ./rbtraced [options]\n"
 	       "       [-d]            Run as a daemon\n"
+	       "       [-c]            Use per-CPU sub-rings\n"
+	       "       [-t]            Timestamp records with TSC\n"
+	       "       [-H]            Back trace buffers with huge pages\n"
+	       "       [-N]            Place sub-rings on NUMA nodes, with a\n"
+	       "                       flusher per node\n"
+	       "       [-F]            Start rings in flight recorder mode\n"
+	       "       [-b <nr>]       Number of buffers per sub-ring, %d-%d\n"
+	       "       [-r <spec>]     Add or override a ring, spec is\n"
+	       "                       name:records[:format[:description]]\n"
+	       "       [-f <file>]     Read ring specs from file, one per line\n"
 	       "       [-p <pidfile>]  Specify pid file, default is %s\n"
 	       "       [-l <logfile>]  Specify log file, default is %s\n"
+	       "       [-S <dir>]      Directory for SIGUSR1 snapshots, default is %s\n"
 	       "       [-v]            Display the version information\n"
 	       "       [-h]            Display this help message\n",
+	       RBTRACE_MIN_BUFS, RBTRACE_MAX_BUFS,
 	       RBTRACED_DFT_PID_FILE,
-	       RBTRACED_DFT_LOG_FILE);
+	       RBTRACED_DFT_LOG_FILE,
+	       RBTRACED_DFT_SNAP_DIR);
 }
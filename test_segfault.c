@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include "rbtrace.h"
 
 int main(int argc, char *argv[])
@@ -15,6 +16,11 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* Staged records must still make it to the ring */
+	if ((argc > 1) && (strcmp(argv[1], "-s") == 0)) {
+		rbtrace_stage_thread(1);
+	}
+
 	/* Write a buffer lost record */
 	rbtrace(RBTRACE_RING_IO, RBT_LOST, 65536, 0, 0, 0);
 